@@ -0,0 +1,64 @@
+#ifndef BENC_ARENA_H
+#define BENC_ARENA_H
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+	struct ArenaBlock* next;
+	size_t size, used;
+};
+#define arena__hdr_size ((sizeof(struct ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define arena__data(b) ((char*)(b) + arena__hdr_size)
+typedef struct Arena {
+	struct ArenaBlock* block;
+	size_t allocs;          // number of allocations
+	size_t bytes;           // number of bytes handed out
+	size_t blocks;          // number of blocks allocated from the system
+} Arena;
+
+#define arena_new(a, t) ((t*)arena_alloc((a), sizeof(t)))
+
+// Returns zeroed memory, which lives until the arena is freed.
+inline static void* arena_alloc(Arena* a, size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	struct ArenaBlock* b = a->block;
+	if (!b || b->size - b->used < size) {
+		const size_t bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		b = (struct ArenaBlock*)malloc(arena__hdr_size + bsize);
+		if (!b) return NULL;
+		b->size = bsize;
+		b->used = 0;
+		b->next = a->block;
+		a->block = b;
+		++a->blocks;
+	}
+	void* ptr = arena__data(b) + b->used;
+	b->used += size;
+	++a->allocs;
+	a->bytes += size;
+	return memset(ptr, 0, size);
+}
+inline static void arena_free(Arena* a) {
+	struct ArenaBlock* b = a->block;
+	while (b) {
+		struct ArenaBlock* const next = b->next;
+		free(b);
+		b = next;
+	}
+	a->block = NULL;
+	a->allocs = a->bytes = a->blocks = 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_ARENA_H
@@ -0,0 +1,353 @@
+#include <elf.h>
+#include "asm_x86_64.h"
+#include "buf.h"
+
+static const char* names[] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+static const char* names32[] = {
+	"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+	"r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+static const char* mnemonics[NUM_XINSNS] = {
+	"add", "or", "and", "sub", "xor", "cmp",
+	"mov", "lea",
+	"push", "pop", "neg", "shl", "call",
+	"ret", "nop",
+	"xor",
+};
+static const uint8_t alu_digits[] = { 0, 1, 4, 5, 6, 7 };  // the /digit of XI_ADD .. XI_CMP
+static const char* jumps[] = { "jmp", "je", "jne", "jl", "jg" };
+static const uint8_t conds[] = { 0, 0x4, 0x5, 0xc, 0xf };  // tttn of XC_*
+
+static bool fits8(int64_t v) { return v == (int8_t)v; }
+static bool fits32(int64_t v) { return v == (int32_t)v; }
+
+// Returns the index of the symbol name in obj->syms, adding an undefined one if needed.
+static uint32_t symbol(XAsm* a, const char* name) {
+	ElfObject* const obj = a->obj;
+	if (!name) {
+		if (!a->pool) {
+			buf_push(obj->syms, (ElfSym){ .name = "__string_pool", .section = ELF_RODATA });
+			a->pool = buf_len(obj->syms);
+		}
+		return a->pool - 1;
+	}
+	for (size_t i = 0; i < buf_len(obj->syms); ++i) {
+		if (obj->syms[i].name == name) return i;
+	}
+	buf_push(obj->syms, (ElfSym){ .name = name, .section = ELF_UNDEF, .global = true });
+	return buf_len(obj->syms) - 1;
+}
+
+static void print_operand(const XAsm* a, const XOperand* op, bool size) {
+	OBuf* const ob = a->out;
+	switch (op->kind) {
+	case XO_REG: ob_str(ob, names[op->reg]); break;
+	case XO_IMM: ob_int(ob, op->imm); break;
+	case XO_MEM:
+		ob_str(ob, size ? "qword [" : "[");
+		if (op->reg != X_NOREG) ob_str(ob, names[op->reg]);
+		if (op->index != X_NOREG) {
+			if (op->reg != X_NOREG) ob_str(ob, " + ");
+			ob_str(ob, names[op->index]);
+			if (op->scale != 1) ob_char(ob, '*'), ob_uint(ob, op->scale);
+		}
+		if (op->disp) {
+			ob_str(ob, op->disp < 0 ? " - " : " + ");
+			ob_uint(ob, op->disp < 0 ? -(unsigned)op->disp : (unsigned)op->disp);
+		}
+		ob_char(ob, ']');
+		break;
+	case XO_REL:
+		if (!op->sym) {
+			ob_str(ob, "[rel __str");
+			ob_uint(ob, op->disp);
+		}
+		else {
+			ob_str(ob, "[rel ");
+			ob_str(ob, op->sym);
+			if (op->disp) ob_str(ob, " + "), ob_int(ob, op->disp);
+		}
+		ob_char(ob, ']');
+		break;
+	case XO_GOT:
+		ob_str(ob, "[rel ");
+		ob_str(ob, op->sym);
+		ob_str(ob, " wrt ..got]");
+		break;
+	}
+}
+
+static void emit8(XAsm* a, uint8_t b) {
+	buf_push(a->obj->text, b);
+}
+static void emit32(XAsm* a, uint32_t v) {
+	for (int i = 0; i < 4; ++i)
+		emit8(a, v >> (i * 8));
+}
+static void emit64(XAsm* a, uint64_t v) {
+	emit32(a, v);
+	emit32(a, v >> 32);
+}
+static void emit_imm(XAsm* a, int64_t v, int size) {
+	if (size == 1) emit8(a, v);
+	else if (size == 4) emit32(a, v);
+}
+static uint8_t scale_bits(uint8_t scale) {
+	return scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+}
+/*
+ * Emits [REX] opcode ModRM [SIB] [disp] with the register (or /digit) reg
+ * and the r/m operand rm. imm_size bytes of immediate follow.
+ */
+static void encode(XAsm* a, bool w, uint8_t opcode, uint8_t reg, const XOperand* rm, int imm_size) {
+	uint8_t rex = 0x40 | w << 3 | (reg & 8) >> 1;
+	if (rm->kind == XO_REG) rex |= rm->reg >> 3;
+	else if (rm->kind == XO_MEM) {
+		if (rm->index != X_NOREG) rex |= (rm->index & 8) >> 2;
+		if (rm->reg != X_NOREG) rex |= rm->reg >> 3;
+	}
+	if (rex != 0x40) emit8(a, rex);
+	emit8(a, opcode);
+	reg = (reg & 7) << 3;
+
+	switch (rm->kind) {
+	case XO_REG:
+		emit8(a, 0xc0 | reg | (rm->reg & 7));
+		break;
+	case XO_REL:
+	case XO_GOT:
+		emit8(a, 0x05 | reg);
+		buf_push(a->obj->relas, (ElfRela){
+			.offset = buf_len(a->obj->text),
+			.sym = symbol(a, rm->sym),
+			.type = rm->kind == XO_GOT ? R_X86_64_GOTPCREL : R_X86_64_PC32,
+			.addend = (int64_t)rm->disp - 4 - imm_size,
+		});
+		emit32(a, 0);
+		break;
+	case XO_MEM: {
+		const uint8_t base = rm->reg, index = rm->index == X_NOREG ? 4 : rm->index & 7;
+		if (base == X_NOREG) {      // [index*scale + disp32]
+			emit8(a, reg | 4);
+			emit8(a, scale_bits(rm->scale) << 6 | index << 3 | 5);
+			emit32(a, rm->disp);
+			break;
+		}
+		const uint8_t mod = rm->disp == 0 && (base & 7) != X_RBP ? 0 : fits8(rm->disp) ? 1 : 2;
+		if (rm->index != X_NOREG || (base & 7) == X_RSP) {
+			emit8(a, mod << 6 | reg | 4);
+			emit8(a, scale_bits(rm->scale) << 6 | index << 3 | (base & 7));
+		}
+		else emit8(a, mod << 6 | reg | (base & 7));
+		if (mod == 1) emit8(a, rm->disp);
+		else if (mod == 2) emit32(a, rm->disp);
+		break;
+	}
+	}
+}
+static void encode_insn(XAsm* a, enum XInsn insn, const XOperand* dst, const XOperand* src) {
+	int size;
+	switch (insn) {
+	case XI_ADD:
+	case XI_OR:
+	case XI_AND:
+	case XI_SUB:
+	case XI_XOR:
+	case XI_CMP: {
+		const uint8_t digit = alu_digits[insn];
+		if (src->kind == XO_IMM) {
+			size = fits8(src->imm) ? 1 : 4;
+			encode(a, true, size == 1 ? 0x83 : 0x81, digit, dst, size);
+			emit_imm(a, src->imm, size);
+		}
+		else if (src->kind == XO_REG) encode(a, true, digit << 3 | 1, src->reg, dst, 0);
+		else encode(a, true, digit << 3 | 3, dst->reg, src, 0);
+		break;
+	}
+	case XI_MOV:
+		if (src->kind == XO_IMM && dst->kind == XO_REG) {
+			if (src->imm >= 0 && src->imm <= UINT32_MAX) {  // zero-extended by the 32-bit move
+				if (dst->reg & 8) emit8(a, 0x41);
+				emit8(a, 0xb8 | (dst->reg & 7));
+				emit32(a, src->imm);
+			}
+			else if (fits32(src->imm)) {
+				encode(a, true, 0xc7, 0, dst, 4);
+				emit32(a, src->imm);
+			}
+			else {
+				emit8(a, 0x48 | dst->reg >> 3);
+				emit8(a, 0xb8 | (dst->reg & 7));
+				emit64(a, src->imm);
+			}
+		}
+		else if (src->kind == XO_IMM) {
+			encode(a, true, 0xc7, 0, dst, 4);
+			emit32(a, src->imm);
+		}
+		else if (src->kind == XO_REG) encode(a, true, 0x89, src->reg, dst, 0);
+		else encode(a, true, 0x8b, dst->reg, src, 0);
+		break;
+	case XI_LEA:    encode(a, true, 0x8d, dst->reg, src, 0); break;
+	case XI_PUSH:
+		if (dst->kind == XO_REG) {
+			if (dst->reg & 8) emit8(a, 0x41);
+			emit8(a, 0x50 | (dst->reg & 7));
+		}
+		else if (dst->kind == XO_IMM) {
+			size = fits8(dst->imm) ? 1 : 4;
+			emit8(a, size == 1 ? 0x6a : 0x68);
+			emit_imm(a, dst->imm, size);
+		}
+		else encode(a, false, 0xff, 6, dst, 0);
+		break;
+	case XI_POP:
+		if (dst->reg & 8) emit8(a, 0x41);
+		emit8(a, 0x58 | (dst->reg & 7));
+		break;
+	case XI_NEG:    encode(a, true, 0xf7, 3, dst, 0); break;
+	case XI_SHL:
+		encode(a, true, 0xc1, 4, dst, 1);
+		emit8(a, src->imm);
+		break;
+	case XI_CALL:   encode(a, false, 0xff, 2, dst, 0); break;
+	case XI_RET:    emit8(a, 0xc3); break;
+	case XI_NOP:    emit8(a, 0x90); break;
+	case XI_ZERO:   encode(a, false, 0x31, dst->reg, dst, 0); break;
+	default: break;
+	}
+}
+
+void x_insn(XAsm* a, enum XInsn insn, XOperand dst, XOperand src) {
+	if (!a->out) {
+		encode_insn(a, insn, &dst, &src);
+		return;
+	}
+	OBuf* const ob = a->out;
+	ob_str(ob, mnemonics[insn]);
+	switch (insn) {
+	case XI_RET:
+	case XI_NOP:
+		break;
+	case XI_PUSH:
+	case XI_POP:
+	case XI_NEG:
+	case XI_CALL:
+		ob_char(ob, ' ');
+		print_operand(a, &dst, true);
+		break;
+	case XI_ZERO:
+		ob_char(ob, ' ');
+		ob_str(ob, names32[dst.reg]);
+		ob_str(ob, ", ");
+		ob_str(ob, names32[dst.reg]);
+		break;
+	default:
+		ob_char(ob, ' ');
+		print_operand(a, &dst, insn != XI_LEA);
+		ob_str(ob, ", ");
+		print_operand(a, &src, insn != XI_LEA);
+		break;
+	}
+	ob_char(ob, '\n');
+}
+
+static size_t* label_at(XAsm* a, unsigned label) {
+	if (label == XL_RET) return &a->ret;
+	while (buf_len(a->labels) <= label)
+		buf_push(a->labels, SIZE_MAX);
+	return &a->labels[label];
+}
+void x_label(XAsm* a, unsigned label) {
+	if (a->out) {
+		if (label == XL_RET) ob_str(a->out, "\n.ret:\n");
+		else {
+			ob_str(a->out, ".l");
+			ob_uint(a->out, label);
+			ob_str(a->out, ":\n");
+		}
+	}
+	else *label_at(a, label) = buf_len(a->obj->text);
+}
+void x_jump(XAsm* a, enum XCond cond, unsigned label) {
+	if (a->out) {
+		ob_str(a->out, jumps[cond]);
+		if (label == XL_RET) ob_str(a->out, " .ret\n");
+		else {
+			ob_str(a->out, " .l");
+			ob_uint(a->out, label);
+			ob_char(a->out, '\n');
+		}
+		return;
+	}
+	const size_t target = *label_at(a, label);
+	if (target != SIZE_MAX) {   // backwards, the displacement is known
+		const int64_t disp = (int64_t)target - (int64_t)(buf_len(a->obj->text) + 2);
+		if (fits8(disp)) {
+			emit8(a, cond == XC_ALWAYS ? 0xeb : 0x70 | conds[cond]);
+			emit8(a, disp);
+			return;
+		}
+	}
+	if (cond == XC_ALWAYS) emit8(a, 0xe9);
+	else {
+		emit8(a, 0x0f);
+		emit8(a, 0x80 | conds[cond]);
+	}
+	buf_push(a->fixups, (struct XFixup){ buf_len(a->obj->text), label });
+	emit32(a, 0);
+}
+
+void x_extern(XAsm* a, const char* name) {
+	if (a->out) {
+		ob_str(a->out, "extern ");
+		ob_str(a->out, name);
+		ob_char(a->out, '\n');
+	}
+	else symbol(a, name);
+}
+void x_begin_func(XAsm* a, const char* name) {
+	if (a->out) {
+		ob_str(a->out, "section .text\nglobal ");
+		ob_str(a->out, name);
+		ob_str(a->out, ":function (");
+		ob_str(a->out, name);
+		ob_str(a->out, ".end - ");
+		ob_str(a->out, name);
+		ob_str(a->out, ")\n");
+		ob_str(a->out, name);
+		ob_str(a->out, ":\n");
+		return;
+	}
+	a->func = symbol(a, name);
+	ElfSym* const s = &a->obj->syms[a->func];
+	s->section = ELF_TEXT;
+	s->value = buf_len(a->obj->text);
+	s->func = true;
+	if (a->labels) buf__hdr(a->labels)->size = 0;
+	a->ret = SIZE_MAX;
+}
+int x_end_func(XAsm* a) {
+	if (a->out) {
+		ob_str(a->out, ".end:\n");
+		return 0;
+	}
+	uint8_t* const text = a->obj->text;
+	for (size_t i = 0; i < buf_len(a->fixups); ++i) {
+		const size_t target = *label_at(a, a->fixups[i].label);
+		if (target == SIZE_MAX) return 1;
+		const uint32_t disp = target - (a->fixups[i].offset + 4);
+		for (int j = 0; j < 4; ++j)
+			text[a->fixups[i].offset + j] = disp >> (j * 8);
+	}
+	if (a->fixups) buf__hdr(a->fixups)->size = 0;
+	a->obj->syms[a->func].size = buf_len(text) - a->obj->syms[a->func].value;
+	return 0;
+}
+void x_free(XAsm* a) {
+	buf_free(a->labels);
+	buf_free(a->fixups);
+}
@@ -0,0 +1,82 @@
+#ifndef BENC_ASM_X86_64_H
+#define BENC_ASM_X86_64_H
+#include "elfobj.h"
+#include "obuf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum XReg {                     // in encoding order
+	X_RAX, X_RCX, X_RDX, X_RBX, X_RSP, X_RBP, X_RSI, X_RDI,
+	X_R8, X_R9, X_R10, X_R11, X_R12, X_R13, X_R14, X_R15,
+	X_NOREG = 0xff,
+};
+enum XOperandKind {
+	XO_REG,
+	XO_IMM,
+	XO_MEM,                     // qword [reg + index*scale + disp]
+	XO_REL,                     // [rel sym + disp], sym NULL is a string literal: __str<disp> in NASM, at disp in the pool of an object
+	XO_GOT,                     // [rel sym wrt ..got], the address of sym
+};
+typedef struct XOperand {
+	uint8_t kind;
+	uint8_t reg;                // XO_REG, or the base of XO_MEM (X_NOREG for none)
+	uint8_t index, scale;       // of XO_MEM, index X_NOREG for none
+	int32_t disp;
+	int64_t imm;
+	const char* sym;
+} XOperand;
+enum XInsn {
+	XI_ADD, XI_OR, XI_AND, XI_SUB, XI_XOR, XI_CMP,
+	XI_MOV, XI_LEA,
+	XI_PUSH, XI_POP, XI_NEG, XI_SHL, XI_CALL,
+	XI_RET, XI_NOP,
+	XI_ZERO,                    // xor r32, r32
+	NUM_XINSNS,
+};
+enum XCond { XC_ALWAYS, XC_E, XC_NE, XC_L, XC_G };
+#define XL_RET ((unsigned)-1)   // the label of the epilogue, .ret
+
+/*
+ * Writes x86_64 instructions either as NASM text to out,
+ * or encoded into obj, with the symbols and relocations an ELF object needs.
+ * Labels are local to the function that is being emitted.
+ */
+typedef struct XAsm {
+	OBuf* out;
+	ElfObject* obj;
+	size_t func;                // obj->syms index of the current function
+	size_t pool;                // obj->syms index + 1 of the string pool, 0 before its first use
+	size_t* labels;             // buf, offset of label i in obj->text or SIZE_MAX
+	size_t ret;                 // offset of XL_RET
+	struct XFixup {
+		size_t offset;          // of a rel32 field
+		unsigned label;
+	}* fixups;                  // buf
+} XAsm;
+
+inline static XOperand x_reg(uint8_t reg) { return (XOperand){ .kind = XO_REG, .reg = reg }; }
+inline static XOperand x_imm(int64_t imm) { return (XOperand){ .kind = XO_IMM, .imm = imm }; }
+inline static XOperand x_mem(uint8_t base, uint8_t index, uint8_t scale, int32_t disp) {
+	return (XOperand){ .kind = XO_MEM, .reg = base, .index = index, .scale = scale, .disp = disp };
+}
+inline static XOperand x_rel(const char* sym, int32_t disp) { return (XOperand){ .kind = XO_REL, .sym = sym, .disp = disp }; }
+inline static XOperand x_got(const char* sym) { return (XOperand){ .kind = XO_GOT, .sym = sym }; }
+
+void x_extern(XAsm* a, const char* name);
+void x_begin_func(XAsm* a, const char* name);
+// Resolves the jumps of the function, returns 0 on success.
+int x_end_func(XAsm* a);
+void x_label(XAsm* a, unsigned label);
+void x_jump(XAsm* a, enum XCond cond, unsigned label);
+// Emits `insn dst, src`, unused operands are ignored.
+void x_insn(XAsm* a, enum XInsn insn, XOperand dst, XOperand src);
+inline static void x_insn1(XAsm* a, enum XInsn insn, XOperand op) { x_insn(a, insn, op, op); }
+void x_free(XAsm* a);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_ASM_X86_64_H
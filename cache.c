@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.h"
+#include "buf.h"
+
+#define SUFFIX ".bcache"
+#define CHUNK (64 * 1024)
+
+/*
+ * An entry is the header, then the options and the source that were hashed,
+ * then the output.
+ */
+typedef struct EntryHeader {
+	char magic[8];
+	uint64_t options_len, src_len, out_len;
+} EntryHeader;
+static const char magic[8] = { 'b', 'e', 'n', 'c', 'c', 'a', 'c', '1' };
+
+static uint64_t hash_bytes(uint64_t h, const char* p, size_t len) {
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)p[i]) * 1099511628211u;     // FNV-1a
+	return h;
+}
+static char* entry_path(const Cache* c, const char* options, const char* src, size_t len) {
+	uint64_t h = hash_bytes(14695981039346656037u, options, strlen(options) + 1);
+	h = hash_bytes(h, src, len);
+	char* path = malloc(strlen(c->dir) + 18 + sizeof(SUFFIX));
+	if (path) sprintf(path, "%s/%016" PRIx64 SUFFIX, c->dir, h);
+	return path;
+}
+// Whether the next n bytes of f are data.
+static bool same(FILE* f, const char* data, uint64_t n) {
+	char buf[CHUNK];
+	while (n) {
+		const size_t k = n < CHUNK ? n : CHUNK;
+		if (fread(buf, 1, k, f) != k || memcmp(buf, data, k) != 0) return false;
+		data += k;
+		n -= k;
+	}
+	return true;
+}
+static bool copy(FILE* from, FILE* to, uint64_t n) {
+	char buf[CHUNK];
+	while (n) {
+		const size_t k = n < CHUNK ? n : CHUNK;
+		if (fread(buf, 1, k, from) != k || fwrite(buf, 1, k, to) != k) return false;
+		n -= k;
+	}
+	return true;
+}
+static void count(Cache* c, bool hit) {
+	pthread_mutex_lock(&c->lock);
+	if (hit) ++c->hits;
+	else ++c->misses;
+	pthread_mutex_unlock(&c->lock);
+}
+
+bool cache_init(Cache* c, const char* dir, uint64_t max_size) {
+	*c = (Cache){ .dir = dir, .max_size = max_size };
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST) return false;
+	struct stat st;
+	if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || access(dir, R_OK | W_OK | X_OK) != 0) return false;
+	pthread_mutex_init(&c->lock, NULL);
+	return true;
+}
+bool cache_get(Cache* c, const char* options, const char* src, size_t len, const char* outname) {
+	char* path = entry_path(c, options, src, len);
+	FILE* f = path ? fopen(path, "rb") : NULL;
+	bool hit = false;
+	EntryHeader h;
+	if (f && fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, magic, sizeof(magic)) == 0
+	&& h.options_len == strlen(options) && h.src_len == len
+	&& same(f, options, h.options_len) && same(f, src, len)) {
+		FILE* out = fopen(outname, "wb");
+		hit = out && copy(f, out, h.out_len);
+		if (out && fclose(out) != 0) hit = false;
+		if (hit) utimensat(AT_FDCWD, path, NULL, 0);    // the mtime orders the entries for cache_trim()
+	}
+	if (f) fclose(f);
+	free(path);
+	count(c, hit);
+	return hit;
+}
+void cache_put(Cache* c, const char* options, const char* src, size_t len, const char* outname) {
+	FILE* in = fopen(outname, "rb");
+	struct stat st;
+	if (!in) return;
+	if (fstat(fileno(in), &st) != 0) return (void)fclose(in);
+	EntryHeader h = { .options_len = strlen(options), .src_len = len, .out_len = st.st_size };
+	if (sizeof(h) + h.options_len + h.src_len + h.out_len > c->max_size) return (void)fclose(in);
+	memcpy(h.magic, magic, sizeof(magic));
+
+	char* path = entry_path(c, options, src, len);
+	char* tmp = malloc(strlen(c->dir) + sizeof("/tmp.XXXXXX"));
+	const int fd = path && tmp ? (sprintf(tmp, "%s/tmp.XXXXXX", c->dir), mkstemp(tmp)) : -1;
+	FILE* f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (f) {
+		fchmod(fd, 0644);   // mkstemp() makes it 0600, which hides the entry from other users of the cache
+		bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(options, 1, h.options_len, f) == h.options_len
+			&& fwrite(src, 1, len, f) == len && copy(in, f, h.out_len);
+		if (fclose(f) != 0) ok = false;
+		// rename() replaces an entry at once, a concurrent cache_get() sees either the old or the new one
+		if (!ok || rename(tmp, path) != 0) unlink(tmp);
+	}
+	else if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(path);
+	fclose(in);
+}
+
+typedef struct Entry {
+	char* name;
+	uint64_t size;
+	struct timespec mtime;
+} Entry;
+static int cmp_mtime(const void* a, const void* b) {
+	const struct timespec* x = &((const Entry*)a)->mtime;
+	const struct timespec* y = &((const Entry*)b)->mtime;
+	if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+	return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+void cache_trim(Cache* c) {
+	DIR* d = opendir(c->dir);
+	if (!d) return;
+	Entry* entries = NULL;
+	uint64_t total = 0;
+	for (struct dirent* e; (e = readdir(d)); ) {
+		const size_t n = strlen(e->d_name);
+		struct stat st;
+		if (n < sizeof(SUFFIX) || strcmp(e->d_name + n - (sizeof(SUFFIX) - 1), SUFFIX) != 0) continue;
+		if (fstatat(dirfd(d), e->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) continue;
+		char* name = strdup(e->d_name);
+		if (!name) break;
+		buf_push(entries, ((Entry){ name, st.st_size, st.st_mtim }));
+		total += st.st_size;
+	}
+	if (entries) qsort(entries, buf_len(entries), sizeof(*entries), cmp_mtime);
+	size_t i = 0;
+	for (; i < buf_len(entries) && total > c->max_size; ++i) {
+		// another compiler may have removed or replaced it already
+		if (unlinkat(dirfd(d), entries[i].name, 0) == 0) ++c->evicted;
+		total -= entries[i].size;
+	}
+	c->entries = buf_len(entries) - i;
+	c->size = total;
+	for (size_t j = 0; j < buf_len(entries); ++j)
+		free(entries[j].name);
+	buf_free(entries);
+	closedir(d);
+}
+void cache_free(Cache* c) {
+	pthread_mutex_destroy(&c->lock);
+}
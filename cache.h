@@ -0,0 +1,44 @@
+#ifndef BENC_CACHE_H
+#define BENC_CACHE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A directory of outputs from earlier compilations, addressed by a hash of
+ * everything that determines them: the compiler version, the options that
+ * change the output and the bytes of the source. An entry also stores what
+ * was hashed, so a collision is a miss and not a wrong output.
+ * Entries are replaced atomically, so several compilers may share a cache.
+ * The least recently used entries are removed when it grows past max_size.
+ */
+typedef struct Cache {
+	const char* dir;
+	uint64_t max_size;          // bytes
+	pthread_mutex_t lock;       // the jobs of -j share the counters
+	unsigned hits, misses;
+	unsigned evicted;           // entries removed by cache_trim()
+	size_t entries;             // what is left after cache_trim()
+	uint64_t size;
+} Cache;
+
+// Creates dir if it doesn't exist, returns false if it can't be used.
+bool cache_init(Cache* c, const char* dir, uint64_t max_size);
+// If the output for options and the source src is cached, writes it to outname and returns true.
+bool cache_get(Cache* c, const char* options, const char* src, size_t len, const char* outname);
+// Stores the contents of outname as the output for options and src, failing to store it is not an error.
+void cache_put(Cache* c, const char* options, const char* src, size_t len, const char* outname);
+// Removes the least recently used entries until the cache fits into max_size.
+void cache_trim(Cache* c);
+void cache_free(Cache* c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_CACHE_H
@@ -14,8 +14,19 @@ noreturn static void print_help(const char* name) {
 	puts("  --version | -v\t\tDisplay compiler version information.");
 	//puts("  -o <file>\t\t\t\tPlace the output into <file>.");
 	puts("  -i\t\t\t\tOutput intermediate code.");
-	puts("  -O\t\t\t\tEnable optimizations.");
+	puts("  -c\t\t\t\tOutput an ELF object file, without an assembler.");
+	puts("  --run\t\t\t\tCompile into memory and run main (default target x86_64).");
+	puts("  --interp\t\t\tRun main in the bytecode interpreter and count the executed instructions.");
+	puts("  -O | -O1\t\t\tEnable optimizations.");
+	puts("  -O2\t\t\t\tAlso optimize in SSA form.");
+	puts("  -O3\t\t\t\tAlso allocate registers by graph coloring.");
 	puts("  -m <target>\t\t\tSelect the output <target> (default i386).");
+	puts("  -s | --stats\t\t\tPrint compilation statistics.");
+	puts("  --stream\t\t\tCompile one function at a time, so memory doesn't grow with the file.");
+	puts("  --incremental\t\t\tLike --stream, reusing the assembly of the functions that didn't change.");
+	puts("  -j <n>\t\t\tUse <n> threads, for several files and for the functions of a file.");
+	puts("  --cache <dir>\t\t\tReuse the outputs of unchanged files, which are kept in <dir>.");
+	puts("  --cache-size <n>\t\tKeep at most <n> MiB in the cache (default 256).");
 	puts("");
 	printf("Existing targets: ");
 	print_targets();
@@ -36,11 +47,34 @@ noreturn static void print_usage(const char* name) {
 	fprintf(stderr, "%s: fatal error: no input files\ncompilation terminated.\n", name);
 	exit(1);
 }
+// Returns the argument of -j, which is either attached like -j4 or the next argument.
+static unsigned parse_jobs(int argc, const char** argv, int* i) {
+	const char* arg = argv[*i][2] ? argv[*i] + 2 : *i + 1 < argc ? argv[++*i] : "";
+	char* end;
+	const unsigned long n = strtoul(arg, &end, 10);
+	if (!*arg || *end || n == 0 || n > 1024) {
+		fprintf(stderr, "%s: fatal error: -j expects a number of jobs from 1 to 1024\ncompilation terminated.\n", argv[0]);
+		exit(1);
+	}
+	return n;
+}
+static unsigned parse_cache_size(int argc, const char** argv, int* i) {
+	const char* arg = *i + 1 < argc ? argv[++*i] : "";
+	char* end;
+	const unsigned long n = strtoul(arg, &end, 10);
+	if (!*arg || *end || n == 0 || n > 1024 * 1024) {
+		fprintf(stderr, "%s: fatal error: --cache-size expects a size from 1 to 1048576 MiB\ncompilation terminated.\n", argv[0]);
+		exit(1);
+	}
+	return n;
+}
 
 #define streq(s) (strcmp(argv[i], s) == 0)
 cmdline_opts parse_cmdline(int argc, const char** argv) {
 	cmdline_opts opts = { 0 };
-	opts.target = "i386";
+	opts.target = NULL;
+	opts.jobs = 1;
+	opts.cache_size = 256;
 	for (int i = 1; i < argc; ++i) {
 		if (streq("-h") || streq("--help"))
 			print_help(argv[0]);
@@ -50,12 +84,37 @@ cmdline_opts parse_cmdline(int argc, const char** argv) {
 			opts.target = argv[++i];
 		else if (streq("-i"))
 			opts.intermediate = true;
-		else if (streq("-O"))
-			opts.optimize = true;
+		else if (streq("-c"))
+			opts.object = true;
+		else if (streq("--run"))
+			opts.run = true;
+		else if (streq("--interp"))
+			opts.interp = true;
+		else if (streq("-O") || streq("-O1"))
+			opts.optimize = 1;
+		else if (streq("-O2"))
+			opts.optimize = 2;
+		else if (streq("-O3"))
+			opts.optimize = 3;
+		else if (streq("-O0"))
+			opts.optimize = 0;
+		else if (streq("-s") || streq("--stats"))
+			opts.stats = true;
+		else if (streq("--stream"))
+			opts.stream = true;
+		else if (streq("--incremental"))
+			opts.stream = opts.incremental = true;
+		else if (streq("--cache") && i + 1 < argc)
+			opts.cache = argv[++i];
+		else if (streq("--cache-size"))
+			opts.cache_size = parse_cache_size(argc, argv, &i);
+		else if (strncmp(argv[i], "-j", 2) == 0)
+			opts.jobs = parse_jobs(argc, argv, &i);
 		else if (argv[i][0] == '-')
 			print_usage(argv[0]);
 		else buf_push(opts.inputs, argv[i]);
 	}
+	if (!opts.target) opts.target = opts.run ? "x86_64" : "i386";
 	if (!opts.inputs) print_usage(argv[0]);
 	else return opts;
 }
\ No newline at end of file
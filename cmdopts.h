@@ -9,8 +9,17 @@ extern "C" {
 typedef struct cmdline_opts {
 	const char** inputs;
 	const char* target;
-	bool optimize;
+	unsigned optimize;          // -O level
 	bool intermediate;
+	bool object;                // -c, write an ELF object instead of assembly
+	bool run;                   // --run, compile into memory and call main
+	bool interp;                // --interp, call main in the bytecode interpreter
+	bool stats;
+	bool stream;                // --stream, compile and write one function before parsing the next
+	bool incremental;           // --incremental, reuse the assembly of unchanged functions
+	unsigned jobs;              // -j, the number of threads
+	const char* cache;          // --cache, the directory of the cache, NULL without one
+	unsigned cache_size;        // --cache-size, in MiB
 } cmdline_opts;
 
 cmdline_opts parse_cmdline(int argc, const char** argv);
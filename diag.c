@@ -0,0 +1,18 @@
+#include <stdlib.h>
+#include "diag.h"
+
+static __thread const Diag* current = NULL;
+
+void diag_set(const Diag* d) {
+	current = d;
+}
+const Diag* diag_get(void) {
+	return current;
+}
+FILE* diag_out(void) {
+	return current ? current->out : stderr;
+}
+noreturn void diag_fatal(void) {
+	if (current && current->fatal) longjmp(*current->fatal, 1);
+	exit(1);
+}
@@ -0,0 +1,33 @@
+#ifndef BENC_DIAG_H
+#define BENC_DIAG_H
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdnoreturn.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Where the errors of the calling thread go. By default they are written
+ * to stderr and a fatal error exits the process. A job of -j collects them
+ * in its own stream and returns to its jmp_buf instead, so that they can
+ * be printed in the order of the input files.
+ */
+typedef struct Diag {
+	FILE* out;
+	jmp_buf* fatal;
+} Diag;
+
+// Redirects the errors of the calling thread to d, NULL restores the default.
+void diag_set(const Diag* d);
+const Diag* diag_get(void);
+FILE* diag_out(void);
+// Ends the compilation after an error was written to diag_out().
+noreturn void diag_fatal(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_DIAG_H
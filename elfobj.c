@@ -0,0 +1,123 @@
+#include <string.h>
+#include <elf.h>
+#include "elfobj.h"
+#include "buf.h"
+
+enum {                          // section header indices
+	SH_NULL, SH_TEXT, SH_RODATA, SH_RELA, SH_SYMTAB, SH_STRTAB, SH_SHSTRTAB, SH_STACK,
+	NUM_SH,
+};
+static uint32_t add_str(char** tab, const char* str) {
+	const uint32_t pos = buf_len(*tab);
+	do buf_push(*tab, *str); while (*str++);
+	return pos;
+}
+static void pad(FILE* f, long align) {
+	while (ftell(f) % align) fputc(0, f);
+}
+
+int elf_write(const ElfObject* obj, FILE* f) {
+	char* strtab = NULL;
+	char* shstrtab = NULL;
+	Elf64_Sym* syms = NULL;
+	uint32_t* index = calloc(buf_len(obj->syms) + 1, sizeof(uint32_t));
+	add_str(&strtab, "");
+	add_str(&shstrtab, "");
+
+	// the symbol table starts with the null symbol and the section symbols, then the locals before the globals
+	buf_push(syms, (Elf64_Sym){ 0 });
+	buf_push(syms, (Elf64_Sym){ .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION), .st_shndx = SH_TEXT });
+	buf_push(syms, (Elf64_Sym){ .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION), .st_shndx = SH_RODATA });
+	for (int global = 0; global < 2; ++global) {
+		for (size_t i = 0; i < buf_len(obj->syms); ++i) {
+			const ElfSym* s = &obj->syms[i];
+			if (s->global != global) continue;
+			index[i] = buf_len(syms);
+			buf_push(syms, (Elf64_Sym){
+				.st_name = add_str(&strtab, s->name),
+				.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL,
+					s->section == ELF_UNDEF ? STT_NOTYPE : s->func ? STT_FUNC : STT_OBJECT),
+				.st_shndx = s->section == ELF_TEXT ? SH_TEXT : s->section == ELF_RODATA ? SH_RODATA : SHN_UNDEF,
+				.st_value = s->value,
+				.st_size = s->size,
+			});
+		}
+	}
+	size_t first_global = 3;
+	while (first_global < buf_len(syms) && ELF64_ST_BIND(syms[first_global].st_info) == STB_LOCAL)
+		++first_global;
+
+	Elf64_Shdr sh[NUM_SH] = { 0 };
+	Elf64_Ehdr eh = {
+		.e_ident = { ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV },
+		.e_type = ET_REL,
+		.e_machine = obj->machine,
+		.e_version = EV_CURRENT,
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_shentsize = sizeof(Elf64_Shdr),
+		.e_shnum = NUM_SH,
+		.e_shstrndx = SH_SHSTRTAB,
+	};
+	fwrite(&eh, sizeof(eh), 1, f);
+
+	sh[SH_TEXT] = (Elf64_Shdr){ .sh_name = add_str(&shstrtab, ".text"), .sh_type = SHT_PROGBITS,
+		.sh_flags = SHF_ALLOC | SHF_EXECINSTR, .sh_addralign = 16 };
+	pad(f, 16);
+	sh[SH_TEXT].sh_offset = ftell(f);
+	sh[SH_TEXT].sh_size = fwrite(obj->text, 1, buf_len(obj->text), f);
+
+	sh[SH_RODATA] = (Elf64_Shdr){ .sh_name = add_str(&shstrtab, ".rodata"), .sh_type = SHT_PROGBITS,
+		.sh_flags = SHF_ALLOC, .sh_addralign = 1 };
+	sh[SH_RODATA].sh_offset = ftell(f);
+	sh[SH_RODATA].sh_size = fwrite(obj->rodata, 1, buf_len(obj->rodata), f);
+
+	sh[SH_RELA] = (Elf64_Shdr){ .sh_name = add_str(&shstrtab, ".rela.text"), .sh_type = SHT_RELA,
+		.sh_flags = SHF_INFO_LINK, .sh_link = SH_SYMTAB, .sh_info = SH_TEXT, .sh_addralign = 8,
+		.sh_entsize = sizeof(Elf64_Rela) };
+	pad(f, 8);
+	sh[SH_RELA].sh_offset = ftell(f);
+	for (size_t i = 0; i < buf_len(obj->relas); ++i) {
+		const ElfRela* r = &obj->relas[i];
+		const Elf64_Rela rela = {
+			.r_offset = r->offset,
+			.r_info = ELF64_R_INFO(index[r->sym], r->type),
+			.r_addend = r->addend,
+		};
+		sh[SH_RELA].sh_size += fwrite(&rela, 1, sizeof(rela), f);
+	}
+
+	sh[SH_SYMTAB] = (Elf64_Shdr){ .sh_name = add_str(&shstrtab, ".symtab"), .sh_type = SHT_SYMTAB,
+		.sh_link = SH_STRTAB, .sh_info = first_global, .sh_addralign = 8, .sh_entsize = sizeof(Elf64_Sym) };
+	sh[SH_SYMTAB].sh_offset = ftell(f);
+	sh[SH_SYMTAB].sh_size = fwrite(syms, 1, buf_len(syms) * sizeof(Elf64_Sym), f);
+
+	sh[SH_STRTAB] = (Elf64_Shdr){ .sh_name = add_str(&shstrtab, ".strtab"), .sh_type = SHT_STRTAB, .sh_addralign = 1 };
+	sh[SH_STRTAB].sh_offset = ftell(f);
+	sh[SH_STRTAB].sh_size = fwrite(strtab, 1, buf_len(strtab), f);
+
+	// no executable stack
+	sh[SH_STACK] = (Elf64_Shdr){ .sh_name = add_str(&shstrtab, ".note.GNU-stack"), .sh_type = SHT_PROGBITS,
+		.sh_offset = ftell(f), .sh_addralign = 1 };
+
+	sh[SH_SHSTRTAB] = (Elf64_Shdr){ .sh_name = add_str(&shstrtab, ".shstrtab"), .sh_type = SHT_STRTAB, .sh_addralign = 1 };
+	sh[SH_SHSTRTAB].sh_offset = ftell(f);
+	sh[SH_SHSTRTAB].sh_size = fwrite(shstrtab, 1, buf_len(shstrtab), f);
+
+	pad(f, 8);
+	eh.e_shoff = ftell(f);
+	fwrite(sh, sizeof(sh), 1, f);
+	fseek(f, 0, SEEK_SET);
+	fwrite(&eh, sizeof(eh), 1, f);
+
+	buf_free(strtab);
+	buf_free(shstrtab);
+	buf_free(syms);
+	free(index);
+	return ferror(f) ? 1 : 0;
+}
+void elf_free(ElfObject* obj) {
+	buf_free(obj->text);
+	buf_free(obj->rodata);
+	buf_free(obj->syms);
+	buf_free(obj->relas);
+}
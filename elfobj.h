@@ -0,0 +1,44 @@
+#ifndef BENC_ELFOBJ_H
+#define BENC_ELFOBJ_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum ElfSection {
+	ELF_UNDEF,                  // extern symbols
+	ELF_TEXT,
+	ELF_RODATA,
+};
+typedef struct ElfSym {
+	const char* name;
+	uint64_t value, size;
+	uint8_t section;            // enum ElfSection
+	bool global, func;
+} ElfSym;
+typedef struct ElfRela {        // relocation of .text
+	uint64_t offset;
+	uint32_t sym;               // index into ElfObject.syms
+	uint32_t type;              // R_X86_64_*
+	int64_t addend;
+} ElfRela;
+typedef struct ElfObject {
+	uint16_t machine;           // EM_*
+	uint8_t* text;              // buf
+	uint8_t* rodata;            // buf
+	ElfSym* syms;               // buf
+	ElfRela* relas;             // buf
+} ElfObject;
+
+// Writes obj as an ELF64 relocatable object file, returns 0 on success.
+int elf_write(const ElfObject* obj, FILE* f);
+void elf_free(ElfObject* obj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_ELFOBJ_H
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "frags.h"
+#include "buf.h"
+
+/*
+ * A store is the magic and the options, then the records: the hash of the
+ * key, then the key, the text and the literals of the fragment, each after
+ * its 32 bit length.
+ */
+static const char magic[8] = { 'b', 'e', 'n', 'c', 'f', 'r', 'g', '1' };
+
+static uint64_t hash_key(const char* p, size_t len) {
+	uint64_t h = 14695981039346656037u;     // FNV-1a
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)p[i]) * 1099511628211u;
+	return h;
+}
+static int cmp_hash(const void* a, const void* b) {
+	const uint64_t x = ((const struct FragIndex*)a)->hash, y = ((const struct FragIndex*)b)->hash;
+	return (x > y) - (x < y);
+}
+// Reads a field of a record at *off, returns false if the store ends before it.
+static bool read_field(const FragStore* fs, size_t* off, const char** p, size_t* len) {
+	uint32_t n;
+	if (fs->old_len - *off < sizeof(n)) return false;
+	memcpy(&n, fs->old + *off, sizeof(n));
+	*off += sizeof(n);
+	if (fs->old_len - *off < n) return false;
+	*p = fs->old + *off;
+	*len = n;
+	*off += n;
+	return true;
+}
+static bool read_record(const FragStore* fs, size_t* off, const char** key, size_t* key_len, AsmFragment* f) {
+	if (fs->old_len - *off < sizeof(uint64_t)) return false;
+	*off += sizeof(uint64_t);
+	return read_field(fs, off, key, key_len) && read_field(fs, off, &f->text, &f->len)
+		&& read_field(fs, off, &f->strs, &f->strs_len);
+}
+// Indexes the mapped old store, drops it if it wasn't written for options.
+static void load(FragStore* fs, const char* options) {
+	const size_t n = strlen(options);
+	size_t off = sizeof(magic) + sizeof(uint32_t) + n;
+	uint32_t len;
+	if (fs->old_len < off || memcmp(fs->old, magic, sizeof(magic)) != 0) goto mismatch;
+	memcpy(&len, fs->old + sizeof(magic), sizeof(len));
+	if (len != n || memcmp(fs->old + sizeof(magic) + sizeof(len), options, n) != 0) goto mismatch;
+	while (off < fs->old_len) {
+		struct FragIndex e = { .off = off };
+		const char* key;
+		size_t key_len;
+		AsmFragment f;
+		if (!read_record(fs, &off, &key, &key_len, &f)) break;      // a truncated store keeps what is complete
+		memcpy(&e.hash, fs->old + e.off, sizeof(e.hash));
+		buf_push(fs->index, e);
+	}
+	if (fs->index) qsort(fs->index, buf_len(fs->index), sizeof(*fs->index), cmp_hash);
+	return;
+mismatch:
+	munmap((void*)fs->old, fs->old_len);
+	fs->old = NULL;
+	fs->old_len = 0;
+}
+static void write_bytes(FragStore* fs, const void* p, size_t n) {
+	if (n && fwrite(p, 1, n, fs->out) != n) fs->failed = true;
+}
+static void write_field(FragStore* fs, const char* p, size_t n) {
+	const uint32_t len = n;
+	if (len != n) fs->failed = true;
+	write_bytes(fs, &len, sizeof(len));
+	write_bytes(fs, p, n);
+}
+
+bool frags_open(FragStore* fs, const char* path, const char* options) {
+	*fs = (FragStore){ .path = strdup(path), .tmp = malloc(strlen(path) + sizeof(".XXXXXX")) };
+	if (!fs->path || !fs->tmp) goto fail;
+	const int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			fs->old = p;
+			fs->old_len = st.st_size;
+			load(fs, options);
+		}
+	}
+	if (fd >= 0) close(fd);
+
+	sprintf(fs->tmp, "%s.XXXXXX", path);
+	const int out = mkstemp(fs->tmp);
+	fs->out = out >= 0 ? fdopen(out, "wb") : NULL;
+	if (!fs->out) {
+		if (out >= 0) {
+			close(out);
+			unlink(fs->tmp);
+		}
+		goto fail;
+	}
+	const uint32_t len = strlen(options);
+	write_bytes(fs, magic, sizeof(magic));
+	write_field(fs, options, len);
+	return true;
+fail:
+	frags_close(fs, false);
+	return false;
+}
+bool frags_find(const FragStore* fs, const char* key, size_t len, AsmFragment* f) {
+	const uint64_t h = hash_key(key, len);
+	size_t lo = 0, hi = buf_len(fs->index);
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (fs->index[mid].hash < h) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < buf_len(fs->index) && fs->index[lo].hash == h; ++lo) {
+		size_t off = fs->index[lo].off;
+		const char* k;
+		size_t k_len;
+		if (read_record(fs, &off, &k, &k_len, f) && k_len == len && memcmp(k, key, len) == 0) return true;
+	}
+	return false;
+}
+void frags_add(FragStore* fs, const char* key, size_t len, const AsmFragment* f) {
+	const uint64_t h = hash_key(key, len);
+	write_bytes(fs, &h, sizeof(h));
+	write_field(fs, key, len);
+	write_field(fs, f->text, f->len);
+	write_field(fs, f->strs, f->strs_len);
+}
+void frags_close(FragStore* fs, bool commit) {
+	if (fs->out) {
+		if (fclose(fs->out) != 0) fs->failed = true;
+		// the old store stays if the new one is incomplete, it only makes the next compilation slower
+		if (!commit || fs->failed || rename(fs->tmp, fs->path) != 0) unlink(fs->tmp);
+	}
+	if (fs->old) munmap((void*)fs->old, fs->old_len);
+	buf_free(fs->index);
+	free(fs->tmp);
+	free(fs->path);
+	*fs = (FragStore){ 0 };
+}
@@ -0,0 +1,47 @@
+#ifndef BENC_FRAGS_H
+#define BENC_FRAGS_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "target.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The assembly fragments of the functions of a source file from its last
+ * compilation, each with the key it was generated for: an encoding of the
+ * function and of what it depends on outside of it. The store is read from
+ * one file and a new one is written for the next compilation, which replaces
+ * it only if the compilation succeeds.
+ * Keys are compared in full, so a hash collision can't reuse a wrong fragment.
+ */
+typedef struct FragStore {
+	char* path;
+	char* tmp;                  // the new store until frags_close()
+	FILE* out;
+	bool failed;                // writing the new store
+	const char* old;            // the mapped old store, or NULL
+	size_t old_len;
+	struct FragIndex {
+		uint64_t hash;
+		size_t off;             // of the record in old
+	}* index;                   // buf, ordered by hash
+} FragStore;
+
+// Opens the store at path for options, it is empty if the file doesn't exist or was written for other options.
+bool frags_open(FragStore* fs, const char* path, const char* options);
+// Looks up the fragment for key, which stays valid until frags_close().
+bool frags_find(const FragStore* fs, const char* key, size_t len, AsmFragment* f);
+// Adds the fragment for key to the new store.
+void frags_add(FragStore* fs, const char* key, size_t len, const AsmFragment* f);
+// Replaces the old store with the new one if commit, else keeps the old one.
+void frags_close(FragStore* fs, bool commit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_FRAGS_H
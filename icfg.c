@@ -0,0 +1,346 @@
+#include <string.h>
+#include "icfg.h"
+#include "iutil.h"
+#include "buf.h"
+
+static bool ends_block(enum INodeType t) {
+	return is_jump(t) || t == IN_RETURN;
+}
+static void add_edge(CFG* cfg, size_t from, size_t to) {
+	BasicBlock* const b = &cfg->blocks[from];
+	for (size_t i = 0; i < buf_len(b->succs); ++i) {
+		if (b->succs[i] == to) return;
+	}
+	buf_push(b->succs, to);
+	buf_push(cfg->blocks[to].preds, from);
+}
+
+static void split_blocks(CFG* cfg) {
+	IUnit* const unit = cfg->unit;
+	const size_t len = inode_count(unit);
+	unsigned max_label = 0;
+	size_t begin = 0;
+	bool fallthrough = false;
+	// The fall-through block of a conditional jump is kept even if it is empty,
+	// so the blocks and edges only depend on the labels and jumps.
+	for (size_t i = 0; i < len; ++i) {
+		const INode* n = &unit->nodes[i];
+		if (n->type == IN_LABEL) {
+			if (n->label > max_label) max_label = n->label;
+			if (i != begin || fallthrough) {
+				buf_push(cfg->blocks, (BasicBlock){ .begin = begin, .end = i });
+				begin = i;
+			}
+		}
+		fallthrough = false;
+		if (ends_block(n->type)) {
+			buf_push(cfg->blocks, (BasicBlock){ .begin = begin, .end = i + 1 });
+			begin = i + 1;
+			fallthrough = is_jump(n->type) && n->type != IN_JMP;
+		}
+	}
+	if (begin != len || fallthrough || !cfg->blocks)
+		buf_push(cfg->blocks, (BasicBlock){ .begin = begin, .end = len });
+
+	for (unsigned l = 0; l <= max_label; ++l)
+		buf_push(cfg->label_map, BLOCK_NONE);
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		BasicBlock* const bb = &cfg->blocks[b];
+		bb->idom = bb->loop = bb->rpo = BLOCK_NONE;
+		if (bb->begin < bb->end && unit->nodes[bb->begin].type == IN_LABEL)
+			cfg->label_map[unit->nodes[bb->begin].label] = b;
+	}
+}
+static void link_blocks(CFG* cfg) {
+	const size_t num = buf_len(cfg->blocks);
+	for (size_t b = 0; b < num; ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		const INode* last = bb->begin < bb->end ? &cfg->unit->nodes[bb->end - 1] : NULL;
+		if (last && is_jump(last->type)) {
+			const size_t target = last->label < buf_len(cfg->label_map) ? cfg->label_map[last->label] : BLOCK_NONE;
+			if (target != BLOCK_NONE) add_edge(cfg, b, target);
+			if (last->type == IN_JMP) continue;
+		}
+		else if (last && last->type == IN_RETURN) continue;
+		if (b + 1 < num) add_edge(cfg, b, b + 1);
+	}
+}
+static void compute_rpo(CFG* cfg) {
+	const size_t num = buf_len(cfg->blocks);
+	size_t* post = NULL;
+	size_t* stack = NULL;       // pairs of (block, index of the next successor)
+	bool* visited = calloc(num, sizeof(bool));
+	buf_push(stack, 0);
+	buf_push(stack, 0);
+	visited[0] = true;
+	while (buf_len(stack)) {
+		const size_t b = stack[buf_len(stack) - 2];
+		size_t* const i = buf_last(stack);
+		const BasicBlock* bb = &cfg->blocks[b];
+		if (*i < buf_len(bb->succs)) {
+			const size_t s = bb->succs[(*i)++];
+			if (!visited[s]) {
+				visited[s] = true;
+				buf_push(stack, s);
+				buf_push(stack, 0);
+			}
+		}
+		else {
+			buf_push(post, b);
+			buf_pop(stack);
+			buf_pop(stack);
+		}
+	}
+	for (size_t i = buf_len(post); i; --i) {
+		cfg->blocks[post[i - 1]].rpo = buf_len(cfg->rpo);
+		buf_push(cfg->rpo, post[i - 1]);
+	}
+	buf_free(post);
+	buf_free(stack);
+	free(visited);
+}
+// "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy.
+static size_t intersect(const CFG* cfg, size_t a, size_t b) {
+	while (a != b) {
+		while (cfg->blocks[a].rpo > cfg->blocks[b].rpo) a = cfg->blocks[a].idom;
+		while (cfg->blocks[b].rpo > cfg->blocks[a].rpo) b = cfg->blocks[b].idom;
+	}
+	return a;
+}
+static void compute_dominators(CFG* cfg) {
+	cfg->blocks[0].idom = 0;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i = 1; i < buf_len(cfg->rpo); ++i) {
+			BasicBlock* const bb = &cfg->blocks[cfg->rpo[i]];
+			size_t idom = BLOCK_NONE;
+			for (size_t j = 0; j < buf_len(bb->preds); ++j) {
+				const size_t p = bb->preds[j];
+				if (cfg->blocks[p].idom == BLOCK_NONE) continue;
+				idom = idom == BLOCK_NONE ? p : intersect(cfg, p, idom);
+			}
+			if (idom != bb->idom) bb->idom = idom, changed = true;
+		}
+	}
+	cfg->blocks[0].idom = BLOCK_NONE;
+}
+// Numbers the dominator tree in pre- and post-order, so dominance is an interval test.
+static void number_dom_tree(CFG* cfg) {
+	const size_t num = buf_len(cfg->blocks);
+	size_t* child = malloc(num * sizeof(size_t));   // first child, then next sibling
+	size_t* sibling = malloc(num * sizeof(size_t));
+	size_t* stack = NULL;
+	size_t counter = 0;
+	for (size_t b = 0; b < num; ++b)
+		child[b] = sibling[b] = BLOCK_NONE;
+	for (size_t i = buf_len(cfg->rpo); i > 1; --i) {
+		const size_t b = cfg->rpo[i - 1];
+		const size_t d = cfg->blocks[b].idom;
+		sibling[b] = child[d];
+		child[d] = b;
+	}
+	buf_push(stack, 0);
+	cfg->blocks[0].dom_pre = counter++;
+	while (buf_len(stack)) {
+		const size_t b = *buf_last(stack);
+		const size_t c = child[b];
+		if (c != BLOCK_NONE) {
+			child[b] = sibling[c];
+			cfg->blocks[c].dom_pre = counter++;
+			buf_push(stack, c);
+		}
+		else {
+			cfg->blocks[b].dom_post = counter++;
+			buf_pop(stack);
+		}
+	}
+	buf_free(stack);
+	free(child);
+	free(sibling);
+}
+bool cfg_dominates(const CFG* cfg, size_t a, size_t b) {
+	if (!cfg_reachable(cfg, a) || !cfg_reachable(cfg, b)) return false;
+	return cfg->blocks[a].dom_pre <= cfg->blocks[b].dom_pre
+		&& cfg->blocks[b].dom_post <= cfg->blocks[a].dom_post;
+}
+
+// Natural loops of all back edges (edges whose target dominates their source).
+static void compute_loops(CFG* cfg) {
+	size_t* work = NULL;
+	size_t* mark = malloc(buf_len(cfg->blocks) * sizeof(size_t));  // last loop a block was added to
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b)
+		mark[b] = BLOCK_NONE;
+	for (size_t i = 0; i < buf_len(cfg->rpo); ++i) {
+		const size_t h = cfg->rpo[i];
+		const BasicBlock* hb = &cfg->blocks[h];
+		const size_t id = buf_len(cfg->loops);
+		for (size_t j = 0; j < buf_len(hb->preds); ++j) {
+			const size_t tail = hb->preds[j];
+			if (cfg_dominates(cfg, h, tail)) buf_push(work, tail);
+		}
+		if (!buf_len(work)) continue;
+		// loops are discovered outermost first, so the header's loop so far is the enclosing one
+		Loop loop = { h, hb->loop, 0, NULL };
+		loop.depth = loop.parent == BLOCK_NONE ? 1 : cfg->loops[loop.parent].depth + 1;
+		buf_push(loop.blocks, h);
+		mark[h] = id;
+		while (buf_len(work)) {
+			const size_t b = *buf_last(work);
+			buf_pop(work);
+			if (mark[b] == id) continue;
+			mark[b] = id;
+			buf_push(loop.blocks, b);
+			for (size_t j = 0; j < buf_len(cfg->blocks[b].preds); ++j) {
+				const size_t p = cfg->blocks[b].preds[j];
+				if (cfg_reachable(cfg, p) && mark[p] != id) buf_push(work, p);
+			}
+		}
+		for (size_t j = 0; j < buf_len(loop.blocks); ++j)
+			cfg->blocks[loop.blocks[j]].loop = id;
+		buf_push(cfg->loops, loop);
+	}
+	buf_free(work);
+	free(mark);
+}
+unsigned cfg_loop_depth(const CFG* cfg, size_t block) {
+	const size_t l = cfg->blocks[block].loop;
+	return l == BLOCK_NONE ? 0 : cfg->loops[l].depth;
+}
+
+size_t cfg_pred_index(const CFG* cfg, size_t block, size_t pred) {
+	const BasicBlock* bb = &cfg->blocks[block];
+	for (size_t i = 0; i < buf_len(bb->preds); ++i) {
+		if (bb->preds[i] == pred) return i;
+	}
+	return BLOCK_NONE;
+}
+#define map_reg(map, r) ((map) && (r) != IREG_NONE ? (map)[r] : (r))
+// The arguments of IN_PHI are live at the end of the corresponding predecessor.
+static void add_phi_uses(const CFG* cfg, size_t block, size_t succ, const ireg_t* map, ireg_t num, uint64_t* set) {
+	const BasicBlock* sb = &cfg->blocks[succ];
+	const size_t j = cfg_pred_index(cfg, succ, block);
+	for (size_t i = sb->begin; i < sb->end; ++i) {
+		const INode* n = &cfg->unit->nodes[i];
+		if (n->type == IN_PHI) {
+			const ireg_t r = map_reg(map, n->phi.args[j]);
+			if (r < num) regset_add(set, r);
+		}
+		else if (n->type != IN_LABEL) break;
+	}
+}
+void cfg_liveness(const CFG* cfg, ireg_t num, Liveness* lv) {
+	cfg_liveness_map(cfg, NULL, num, lv);
+}
+void cfg_liveness_map(const CFG* cfg, const ireg_t* map, ireg_t num, Liveness* lv) {
+	const size_t num_blocks = buf_len(cfg->blocks);
+	const size_t words = (num + 63) / 64;
+	uint64_t* use = calloc(num_blocks * words, sizeof(uint64_t));
+	uint64_t* def = calloc(num_blocks * words, sizeof(uint64_t));
+	uint64_t* out = calloc(words, sizeof(uint64_t));
+	lv->words = words;
+	lv->in = calloc(num_blocks * words, sizeof(uint64_t));
+	lv->out = calloc(num_blocks * words, sizeof(uint64_t));
+	for (size_t b = 0; b < num_blocks; ++b) {
+		uint64_t* const u = use + b * words;
+		uint64_t* const d = def + b * words;
+		for (size_t i = cfg->blocks[b].begin; i < cfg->blocks[b].end; ++i) {
+			const INode* n = &cfg->unit->nodes[i];
+			ireg_t uses[2];
+			const int nu = n->type == IN_PHI ? 0 : inode_uses(n, uses);
+			for (int j = 0; j < nu; ++j) {
+				const ireg_t r = map_reg(map, uses[j]);
+				if (r < num && !regset_has(d, r)) regset_add(u, r);
+			}
+			const ireg_t def = inode_def(n);
+			const ireg_t r = map_reg(map, def);
+			if (r < num) regset_add(d, r);
+		}
+	}
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t b = num_blocks; b--; ) {
+			const BasicBlock* bb = &cfg->blocks[b];
+			memset(out, 0, words * sizeof(uint64_t));
+			for (size_t i = 0; i < buf_len(bb->succs); ++i) {
+				const uint64_t* in = live_in(lv, bb->succs[i]);
+				for (size_t w = 0; w < words; ++w)
+					out[w] |= in[w];
+				add_phi_uses(cfg, b, bb->succs[i], map, num, out);
+			}
+			uint64_t* const in = live_in(lv, b);
+			const uint64_t* u = use + b * words;
+			const uint64_t* d = def + b * words;
+			for (size_t w = 0; w < words; ++w) {
+				const uint64_t x = u[w] | (out[w] & ~d[w]);
+				if (x != in[w]) in[w] = x, changed = true;
+			}
+			memcpy(live_out(lv, b), out, words * sizeof(uint64_t));
+		}
+	}
+	free(use);
+	free(def);
+	free(out);
+}
+void free_liveness(Liveness* lv) {
+	free(lv->in);
+	free(lv->out);
+}
+
+CFG* build_cfg(IUnit* unit) {
+	CFG* cfg = alloc(CFG);
+	cfg->unit = unit;
+	split_blocks(cfg);
+	link_blocks(cfg);
+	compute_rpo(cfg);
+	compute_dominators(cfg);
+	number_dom_tree(cfg);
+	compute_loops(cfg);
+	return cfg;
+}
+void free_cfg(CFG* cfg) {
+	for (size_t i = 0; i < buf_len(cfg->blocks); ++i) {
+		buf_free(cfg->blocks[i].succs);
+		buf_free(cfg->blocks[i].preds);
+	}
+	for (size_t i = 0; i < buf_len(cfg->loops); ++i)
+		buf_free(cfg->loops[i].blocks);
+	buf_free(cfg->blocks);
+	buf_free(cfg->label_map);
+	buf_free(cfg->rpo);
+	buf_free(cfg->loops);
+	free(cfg);
+}
+void print_cfg(const CFG* cfg, FILE* f) {
+	OBuf ob;
+	ob_init(&ob, f);
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		ob_str(&ob, "block ");
+		ob_uint(&ob, b);
+		ob_str(&ob, " [");
+		ob_uint(&ob, bb->begin);
+		ob_str(&ob, ", ");
+		ob_uint(&ob, bb->end);
+		ob_char(&ob, ')');
+		if (bb->idom != BLOCK_NONE) ob_str(&ob, " idom="), ob_uint(&ob, bb->idom);
+		if (!cfg_reachable(cfg, b)) ob_str(&ob, " unreachable");
+		if (bb->loop != BLOCK_NONE) {
+			ob_str(&ob, " loop=");
+			ob_uint(&ob, bb->loop);
+			ob_str(&ob, " depth=");
+			ob_uint(&ob, cfg_loop_depth(cfg, b));
+		}
+		ob_str(&ob, " ->");
+		for (size_t i = 0; i < buf_len(bb->succs); ++i)
+			ob_char(&ob, ' '), ob_uint(&ob, bb->succs[i]);
+		ob_char(&ob, '\n');
+		for (size_t i = bb->begin; i < bb->end; ++i) {
+			const INode* n = &cfg->unit->nodes[i];
+			if (n->type != IN_BEG_STMT && n->type != IN_END_STMT)
+				ob_char(&ob, '\t'), print_inode(n, &ob);
+		}
+	}
+	ob_flush(&ob);
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+#ifndef BENC_ICFG_H
+#define BENC_ICFG_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "igen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BLOCK_NONE SIZE_MAX
+
+typedef struct BasicBlock {
+	size_t begin, end;          // range of IUnit.nodes
+	size_t* succs;              // buf of block indices
+	size_t* preds;              // buf of block indices
+	size_t idom;                // immediate dominator, BLOCK_NONE for the entry and unreachable blocks
+	size_t loop;                // innermost loop, BLOCK_NONE if none
+	size_t rpo;                 // position in CFG.rpo, BLOCK_NONE if unreachable
+	size_t dom_pre, dom_post;   // numbering of the dominator tree, see cfg_dominates()
+} BasicBlock;
+typedef struct Loop {
+	size_t header;
+	size_t parent;              // enclosing loop, BLOCK_NONE if outermost
+	unsigned depth;             // 1 for outermost loops
+	size_t* blocks;             // buf of block indices, including the header
+} Loop;
+typedef struct CFG {
+	IUnit* unit;
+	BasicBlock* blocks;         // blocks[0] is the entry
+	size_t* label_map;          // label -> block, BLOCK_NONE for unknown labels
+	size_t* rpo;                // reachable blocks in reverse post-order
+	Loop* loops;
+} CFG;
+
+// Register sets of `words` 64-bit words
+typedef struct Liveness {
+	size_t words;
+	uint64_t* in;               // live-in sets of all blocks
+	uint64_t* out;              // live-out sets of all blocks
+} Liveness;
+#define live_in(lv, b)  ((lv)->in + (b) * (lv)->words)
+#define live_out(lv, b) ((lv)->out + (b) * (lv)->words)
+#define regset_has(s, r) (((s)[(r) / 64] >> ((r) % 64)) & 1)
+#define regset_add(s, r) ((s)[(r) / 64] |= (uint64_t)1 << ((r) % 64))
+
+CFG* build_cfg(IUnit* unit);
+void free_cfg(CFG* cfg);
+void print_cfg(const CFG* cfg, FILE* f);
+bool cfg_dominates(const CFG* cfg, size_t a, size_t b);
+unsigned cfg_loop_depth(const CFG* cfg, size_t block);
+#define cfg_reachable(cfg, b) ((cfg)->blocks[b].rpo != BLOCK_NONE)
+size_t cfg_pred_index(const CFG* cfg, size_t block, size_t pred);
+void cfg_liveness(const CFG* cfg, ireg_t num, Liveness* lv);    // of R0 .. R(num-1), the others are ignored
+void cfg_liveness_map(const CFG* cfg, const ireg_t* map, ireg_t num, Liveness* lv);   // of the registers r with map[r] < num, as map[r]
+void free_liveness(Liveness* lv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_ICFG_H
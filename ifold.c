@@ -0,0 +1,319 @@
+#include <string.h>
+#include "ifold.h"
+#include "icfg.h"
+#include "iutil.h"
+#include "buf.h"
+
+ireg_t iunit_frame_index(const IUnit* unit, const char* name) {
+	for (size_t i = 0; i < buf_len(unit->paramnames); ++i) {
+		if (unit->paramnames[i] == name) return i;
+	}
+	for (size_t i = 0; i < buf_len(unit->decls); ++i) {
+		if (unit->decls[i].name == name) return buf_len(unit->paramnames) + i;
+	}
+	return IREG_NONE;
+}
+static bool commutes(enum INodeType t) {
+	return t != IN_SUB;
+}
+
+/// OPERANDS
+enum { K_NONE, K_CONST, K_FRAME, K_SCALED };
+typedef struct Known {          // what a register holds
+	uint8_t kind;
+	bool scaled;                // K_FRAME: the index counts words
+	ireg_t value;               // K_CONST: the constant, K_FRAME: the frame index
+	ireg_t index;               // K_FRAME: the register added to the address, K_SCALED: the register counted in words
+	unsigned version;           // of index when the entry was made
+	unsigned block;             // stamp of the block it was made in
+} Known;
+typedef struct Tracker {
+	Known* known;
+	unsigned* version;          // bumped on every def of a register
+	unsigned block;
+} Tracker;
+#define KNOWN_NONE ((Known){ .kind = K_NONE, .index = IREG_NONE })
+
+static Known lookup(const Tracker* t, ireg_t r) {
+	const Known k = t->known[r];
+	if (k.block != t->block) return KNOWN_NONE;
+	if (k.index != IREG_NONE && t->version[k.index] != k.version) return KNOWN_NONE;
+	return k;
+}
+static Known make_known(const Tracker* t, Known k) {
+	k.block = t->block;
+	if (k.index != IREG_NONE) k.version = t->version[k.index];
+	return k;
+}
+static void fold_imm(const Tracker* t, uint8_t* kind, ireg_t* field) {
+	const Known k = lookup(t, *field);
+	if (k.kind == K_CONST) *kind = IO_IMM, *field = k.value;
+}
+static void fold_address(const Tracker* t, INode* n, uint8_t* kind, ireg_t* field) {
+	const Known k = lookup(t, *field);
+	if (k.kind != K_FRAME) return;
+	*kind = IO_FRAME, *field = k.value;
+	n->move.index = k.index;
+	n->scaled = k.scaled;
+}
+// The address that ADD n computes from a frame word and an index.
+static Known frame_address(const Tracker* t, const INode* n) {
+	Known base = lookup(t, n->binary.left);
+	ireg_t off = n->binary.right;
+	if (base.kind != K_FRAME || base.index != IREG_NONE) {
+		base = lookup(t, n->binary.right), off = n->binary.left;
+		if (base.kind != K_FRAME || base.index != IREG_NONE) return KNOWN_NONE;
+	}
+	const Known o = lookup(t, off);
+	if (o.kind == K_SCALED) base.index = o.index, base.scaled = true;
+	else base.index = off, base.scaled = false;
+	return make_known(t, base);
+}
+/*
+ * Replaces the registers that hold constants and the addresses of frame words
+ * by the operands themselves, the nodes that computed them usually die.
+ * The values are only followed within a block.
+ * LDA R0, a
+ * LDC R1, 1
+ * ADJOFF R2, R5
+ * ADD R3, R0, R2
+ * WRITE R3, R1
+ * -------------------
+ * ...
+ * WRITE [F2 + R5*W], 1
+ */
+static void fold_forward(IUnit* unit) {
+	const ireg_t num = iunit_num_regs(unit);
+	Tracker t = { calloc(num, sizeof(Known)), calloc(num, sizeof(unsigned)), 1 };
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		INode* const n = &unit->nodes[i];
+		Known k = KNOWN_NONE;
+		switch (n->type) {
+		case IN_LABEL:  ++t.block; break;   // reached from elsewhere
+		case IN_LDC:
+			if ((intmax_t)n->ldc.num == (int32_t)n->ldc.num)
+				k = make_known(&t, (Known){ .kind = K_CONST, .value = (uint32_t)n->ldc.num, .index = IREG_NONE });
+			break;
+		case IN_LDA: {
+			const ireg_t f = iunit_frame_index(unit, n->lda.name);
+			if (f != IREG_NONE) k = make_known(&t, (Known){ .kind = K_FRAME, .value = f, .index = IREG_NONE });
+			break;
+		}
+		case IN_ADJOFF:
+			k = make_known(&t, (Known){ .kind = K_SCALED, .index = n->move.src });
+			break;
+		case IN_MOVE:   k = lookup(&t, n->move.src); break;
+		case IN_READ:   fold_address(&t, n, &n->skind, &n->move.src); break;
+		case IN_WRITE:
+			fold_address(&t, n, &n->dkind, &n->move.dest);
+			fold_imm(&t, &n->skind, &n->move.src);
+			break;
+		case IN_CMP: {
+			INode* const j = inode_at(unit, i, 1);
+			// x86 only encodes the right operand as an immediate, mirror the jump
+			if (lookup(&t, n->move.dest).kind == K_CONST && lookup(&t, n->move.src).kind != K_CONST
+			&& j && is_jump(j->type) && j->type != IN_JMP) {
+				const ireg_t tmp = n->move.dest;
+				n->move.dest = n->move.src;
+				n->move.src = tmp;
+				if (j->type == IN_JL) j->type = IN_JG;
+				else if (j->type == IN_JG) j->type = IN_JL;
+			}
+			fold_imm(&t, &n->skind, &n->move.src);
+			break;
+		}
+		case IN_PUSH:   fold_imm(&t, &n->skind, &n->reg); break;
+		case IN_ADD:
+		case IN_SUB:
+		case IN_AND:
+		case IN_OR:
+		case IN_XOR:
+			if (n->type == IN_ADD) k = frame_address(&t, n);
+			if (commutes(n->type) && lookup(&t, n->binary.left).kind == K_CONST
+			&& lookup(&t, n->binary.right).kind != K_CONST) {
+				const ireg_t tmp = n->binary.left;
+				n->binary.left = n->binary.right;
+				n->binary.right = tmp;
+			}
+			fold_imm(&t, &n->skind, &n->binary.right);
+			break;
+		default: break;
+		}
+		const ireg_t d = inode_def(n);
+		if (d != IREG_NONE) {
+			++t.version[d];
+			t.known[d] = k;
+		}
+	}
+	free(t.known);
+	free(t.version);
+}
+
+/// MEMORY OPERANDS
+typedef struct Live {           // registers live at a point of a block
+	unsigned* mark;             // mark[r] == epoch if r is live
+	unsigned epoch;
+	ireg_t* exposed;            // buf of the registers read in a block before they are written there
+	Liveness lv;                // of exposed, the other registers never live across blocks
+} Live;
+#define is_live(l, r) ((l)->mark[r] == (l)->epoch)
+static void compute_live(IUnit* unit, const CFG* cfg, Live* l) {
+	const ireg_t num = iunit_num_regs(unit);
+	size_t* stamp = malloc(num * sizeof(size_t));  // block of the last def seen
+	ireg_t* map = malloc(num * sizeof(ireg_t));
+	for (ireg_t r = 0; r < num; ++r)
+		stamp[r] = BLOCK_NONE, map[r] = IREG_NONE;
+	l->exposed = NULL;
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		for (size_t i = cfg->blocks[b].begin; i < cfg->blocks[b].end; ++i) {
+			const INode* n = &unit->nodes[i];
+			ireg_t uses[2];
+			const int nu = inode_uses(n, uses);
+			for (int j = 0; j < nu; ++j) {
+				if (stamp[uses[j]] == b || map[uses[j]] != IREG_NONE) continue;
+				map[uses[j]] = buf_len(l->exposed);
+				buf_push(l->exposed, uses[j]);
+			}
+			if (inode_def(n) != IREG_NONE) stamp[inode_def(n)] = b;
+		}
+	}
+	cfg_liveness_map(cfg, map, buf_len(l->exposed), &l->lv);
+	l->mark = calloc(num, sizeof(unsigned));
+	l->epoch = 0;
+	free(stamp);
+	free(map);
+}
+static void free_live(Live* l) {
+	free(l->mark);
+	buf_free(l->exposed);
+	free_liveness(&l->lv);
+}
+static size_t prev_node(const IUnit* unit, size_t begin, size_t i) {
+	while (i-- > begin) {
+		if (unit->nodes[i].type != IN_DEAD) return i;
+	}
+	return SIZE_MAX;
+}
+static bool is_frame_read(const INode* n) {
+	return n->type == IN_READ && n->skind == IO_FRAME && n->move.index == IREG_NONE;
+}
+/*
+ * Lets the binary operation before WRITE i update the frame word in place.
+ * READ R1, [F0]
+ * ADD R2, R1, 5
+ * WRITE [F0], R2
+ * -----------------
+ * ADD [F0], [F0], 5
+ */
+static size_t fuse_update(IUnit* unit, size_t begin, size_t i, const Live* live) {
+	INode* const n = &unit->nodes[i];
+	if (!(n->dkind == IO_FRAME && n->move.index == IREG_NONE && n->skind == IO_REG && !is_live(live, n->move.src)))
+		return i;
+	const size_t j = prev_node(unit, begin, i);
+	const size_t k = j == SIZE_MAX ? SIZE_MAX : prev_node(unit, begin, j);
+	if (k == SIZE_MAX) return i;
+	INode* const op = &unit->nodes[j];
+	INode* const rd = &unit->nodes[k];
+	if (!(is_binary(op->type) && op->dkind == IO_REG && op->skind != IO_FRAME && op->binary.dest == n->move.src
+	&& is_frame_read(rd) && rd->move.src == n->move.dest))
+		return i;
+	const ireg_t v = rd->move.dest;
+	if (op->binary.left != v && commutes(op->type) && op->skind == IO_REG && op->binary.right == v) {
+		op->binary.right = op->binary.left;
+		op->binary.left = v;
+	}
+	if (op->binary.left != v || (op->skind == IO_REG && op->binary.right == v)
+	|| (v != op->binary.dest && is_live(live, v)))
+		return i;
+	op->dkind = IO_FRAME;
+	op->binary.dest = op->binary.left = n->move.dest;
+	inode_remove(n);
+	inode_remove(rd);
+	return j;
+}
+/*
+ * Lets node i read the frame word that the READ right before it loads.
+ * READ R1, [F0]
+ * CMP R1, 0
+ * ------------
+ * CMP [F0], 0
+ */
+static void fuse_read(IUnit* unit, size_t begin, size_t i, const Live* live) {
+	INode* const n = &unit->nodes[i];
+	const size_t k = prev_node(unit, begin, i);
+	if (k == SIZE_MAX || !is_frame_read(&unit->nodes[k])) return;
+	const ireg_t v = unit->nodes[k].move.dest;
+	const ireg_t f = unit->nodes[k].move.src;
+	if (is_live(live, v) && inode_def(n) != v) return;
+	switch (n->type) {
+	case IN_ADD:
+	case IN_SUB:
+	case IN_AND:
+	case IN_OR:
+	case IN_XOR:
+		if (n->dkind != IO_REG || n->skind != IO_REG) return;
+		if (n->binary.right == v && n->binary.left != v) n->binary.right = f;
+		else if (commutes(n->type) && n->binary.left == v && n->binary.right != v)
+			n->binary.left = n->binary.right, n->binary.right = f;
+		else return;
+		n->skind = IO_FRAME;
+		break;
+	case IN_CMP:
+		if (n->skind == IO_REG && n->move.src == v && n->move.dest != v)
+			n->skind = IO_FRAME, n->move.src = f;
+		else if (n->dkind == IO_REG && n->move.dest == v && !(n->skind == IO_REG && n->move.src == v))
+			n->dkind = IO_FRAME, n->move.dest = f;
+		else return;
+		n->move.index = IREG_NONE;
+		break;
+	case IN_PUSH:
+		if (n->skind != IO_REG || n->reg != v) return;
+		n->skind = IO_FRAME, n->reg = f;
+		break;
+	default: return;
+	}
+	inode_remove(&unit->nodes[k]);
+}
+// Removes the nodes whose results are never read, then fuses frame reads into their users if fuse.
+static void fold_backward(IUnit* unit, const CFG* cfg, Live* live, bool fuse) {
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		++live->epoch;
+		for (size_t w = 0; w < live->lv.words; ++w) {
+			for (uint64_t bits = live_out(&live->lv, b)[w]; bits; bits &= bits - 1)
+				live->mark[live->exposed[w * 64 + __builtin_ctzll(bits)]] = live->epoch;
+		}
+		for (size_t i = bb->end; i-- > bb->begin; ) {
+			INode* n = &unit->nodes[i];
+			if (n->type == IN_DEAD) continue;
+			ireg_t d = inode_def(n);
+			if (d != IREG_NONE && !has_effect(n->type) && !is_live(live, d)) {
+				inode_remove(n);
+				continue;
+			}
+			if (fuse && n->type == IN_WRITE) {
+				i = fuse_update(unit, bb->begin, i, live);
+				n = &unit->nodes[i];
+			}
+			else if (fuse) fuse_read(unit, bb->begin, i, live);
+			d = inode_def(n);
+			if (d != IREG_NONE) live->mark[d] = 0;
+			ireg_t uses[2];
+			const int nu = inode_uses(n, uses);
+			for (int j = 0; j < nu; ++j)
+				live->mark[uses[j]] = live->epoch;
+		}
+	}
+}
+
+void iunit_fold_operands(IUnit* unit) {
+	fold_forward(unit);
+	CFG* cfg = build_cfg(unit);
+	Live live;
+	compute_live(unit, cfg, &live);
+	fold_backward(unit, cfg, &live, false);     // the fusions only look at adjacent nodes
+	fold_backward(unit, cfg, &live, true);
+	free_live(&live);
+	free_cfg(cfg);
+	iunit_compact(unit);
+}
@@ -0,0 +1,23 @@
+#ifndef BENC_IFOLD_H
+#define BENC_IFOLD_H
+#include "igen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Folds constants and the words of parameters and locals into the operands
+ * of the nodes that use them, see enum IOperandKind. For targets that encode
+ * immediates and memory operands in their instructions, like x86.
+ * Runs after the optimizations, right before register allocation.
+ */
+void iunit_fold_operands(IUnit* unit);
+// Returns the number of the IO_FRAME operand for name, or IREG_NONE if it isn't a parameter or local.
+ireg_t iunit_frame_index(const IUnit* unit, const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_IFOLD_H
@@ -1,96 +1,87 @@
-#define __STDC_WANT_LIB_EXT2__ 1
 #include <stdlib.h>
 #include <string.h>
 #include "igen.h"
 #include "buf.h"
 #include "parser.h"
+#include "diag.h"
 
-static IUnit* unit;
-static INode* nodes = NULL;
-static ireg_t reg = 0;
-static unsigned lbl = 0;
-static void igen_init(void) {
-	nodes = alloc(INode);
-	nodes->type = IN_NOP;
-	nodes->next = nodes->prev = NULL;
-	reg = 0;
-	lbl = 0;
+// The state of the generation of one unit.
+typedef struct IGen {
+	const Ast* ast;
+	IUnit* unit;
+	INode* nodes;
+	ireg_t reg;                 // the first free register of the statement
+	unsigned lbl;               // the last label
+} IGen;
+static INode* emit(IGen* g, enum INodeType type) {
+	buf_push(g->nodes, (INode){ .type = type });
+	return buf_last(g->nodes);
 }
 
-#define push(x) (nodes = inode_insert(nodes, x))
-static void gen_expr(const Expression* expr);
-static void gen_lv(const LValue* lv) {
+static void gen_expr(IGen* g, AstRef expr);
+static void gen_lv(IGen* g, AstRef r) {
+	const LValue* lv = ast_lv(g->ast, r);
 	INode* n;
 	switch (lv->type) {
-	case LV_PAREN:  gen_lv(lv->lv); break;
+	case LV_PAREN:  gen_lv(g, lv->lv); break;
 	case LV_NAME:
-		n = alloc(INode);
-		n->type = IN_LDA;
-		n->lda.dest = reg++;
+		n = emit(g, IN_LDA);
+		n->lda.dest = g->reg++;
 		n->lda.name = lv->name;
-		push(n);
 		break;
-	case LV_DEREF:  gen_expr(lv->expr); break;
+	case LV_DEREF:  gen_expr(g, lv->expr); break;
 	case LV_ASSIGN:
-		gen_expr(lv->binary.right);
-		gen_lv(lv->binary.left);
-		n = alloc(INode);
-		n->type = IN_WRITE;
-		n->move.dest = reg - 1;
-		n->move.src = reg - 2;
-		push(n);
-		n = alloc(INode);
-		n->type = IN_MOVE;
-		n->move.dest = reg - 2;
-		n->move.src = reg - 1;
-		push(n);
-		--reg;
+		gen_expr(g, lv->binary.right);
+		gen_lv(g, lv->binary.left);
+		n = emit(g, IN_WRITE);
+		n->move.dest = g->reg - 1;
+		n->move.src = g->reg - 2;
+		n = emit(g, IN_MOVE);
+		n->move.dest = g->reg - 2;
+		n->move.src = g->reg - 1;
+		--g->reg;
 		break;
 	case LV_AT:
-		gen_lv(lv->binary.left);
-		gen_expr(lv->binary.right);
-		n = alloc(INode);
-		n->type = IN_ADJOFF;
-		n->reg = reg - 1;
-		push(n);
+		gen_lv(g, lv->binary.left);
+		gen_expr(g, lv->binary.right);
+		n = emit(g, IN_ADJOFF);
+		n->move.dest = n->move.src = g->reg - 1;
 		
-		n = alloc(INode);
-		n->type = IN_ADD;
-		n->move.dest = reg - 2;
-		n->move.src = reg - 1;
-		push(n);
-		--reg;
+		n = emit(g, IN_ADD);
+		n->binary.dest = g->reg - 2;
+		n->binary.left = g->reg - 2;
+		n->binary.right = g->reg - 1;
+		--g->reg;
 		break;
 	}
 }
-static void gen_expr(const Expression* expr) {
+static void gen_expr(IGen* g, AstRef r) {
+	const Expression* expr = ast_expr(g->ast, r);
+	const AstList* params;
 	INode* n;
 	switch (expr->type) {
-	case EXPR_PAREN: gen_expr(expr->expr); break;
+	case EXPR_PAREN: gen_expr(g, expr->expr); break;
 	case EXPR_NUMBER:
-		n = alloc(INode);
-		n->type = IN_LDC;
-		n->ldc.dest = reg++;
+		n = emit(g, IN_LDC);
+		n->ldc.dest = g->reg++;
 		n->ldc.num = expr->num;
-		push(n);
 		break;
 	case EXPR_UNARY:
-		gen_expr(expr->unary.expr);
-		if (expr->unary.op.type != TK_PLUS) {
-			n = alloc(INode);
-			switch (expr->binary.op.type) {
+		gen_expr(g, expr->expr);
+		if (expr->op != TK_PLUS) {
+			n = emit(g, IN_NOP);
+			switch (expr->op) {
 			case TK_MINUS:  n->type = IN_NEG;   break;
 			default:        n->type = IN_NOP;   break;
 			}
-			n->reg = reg - 1;
-			push(n);
+			n->move.dest = n->move.src = g->reg - 1;
 		}
 		break;
 	case EXPR_BINARY:
-		gen_expr(expr->binary.left);
-		gen_expr(expr->binary.right);
-		n = alloc(INode);
-		switch (expr->binary.op.type) {
+		gen_expr(g, expr->binary.left);
+		gen_expr(g, expr->binary.right);
+		n = emit(g, IN_NOP);
+		switch (expr->op) {
 		case TK_PLUS:   n->type = IN_ADD;   break;
 		case TK_MINUS:  n->type = IN_SUB;   break;
 		case TK_AND:    n->type = IN_AND;   break;
@@ -98,53 +89,45 @@ static void gen_expr(const Expression* expr) {
 		case TK_XOR:    n->type = IN_XOR;   break;
 		default:        n->type = IN_NOP;   break;
 		}
-		n->binary.dest = reg - 2;
-		n->binary.left = reg - 2;
-		n->binary.right = reg - 1;
-		push(n);
-		--reg;
+		n->binary.dest = g->reg - 2;
+		n->binary.left = g->reg - 2;
+		n->binary.right = g->reg - 1;
+		--g->reg;
 		break;
-	case EXPR_ADDROF: gen_lv(expr->lv); break;
+	case EXPR_ADDROF: gen_lv(g, expr->lv); break;
 	case EXPR_LVALUE:
-		gen_lv(expr->lv);
-		n = alloc(INode);
-		n->type = IN_READ;
-		n->move.dest = reg - 1;
-		n->move.src = reg - 1;
-		push(n);
+		gen_lv(g, expr->lv);
+		n = emit(g, IN_READ);
+		n->move.dest = g->reg - 1;
+		n->move.src = g->reg - 1;
 		break;
 	case EXPR_FCALL:
-		for (size_t i = buf_len(expr->fcall.params); i; --i) {
-			gen_expr(expr->fcall.params[i - 1]);
-			n = alloc(INode);
-			n->type = IN_PUSH;
-			n->reg = --reg;
-			push(n);
+		params = &g->ast->lists[expr->fcall.params];
+		for (size_t i = params->len; i; --i) {
+			gen_expr(g, ast_list(g->ast, *params)[i - 1]);
+			n = emit(g, IN_PUSH);
+			n->reg = --g->reg;
 		}
-		gen_lv(expr->lv);
-		n = alloc(INode);
-		n->type = IN_CALL;
-		n->fcall.dest = reg - 1;
-		n->fcall.pcount = buf_len(expr->fcall.params);
-		push(n);
-		reg = 1;
+		gen_lv(g, expr->fcall.func);
+		n = emit(g, IN_CALL);
+		n->fcall.dest = n->fcall.ret = g->reg - 1;
+		n->fcall.pcount = params->len;
 		break;
 	case EXPR_STRING:
-		n = alloc(INode);
-		n->type = IN_LDS;
-		n->lda.dest = reg++;
+		n = emit(g, IN_LDS);
+		n->lda.dest = g->reg++;
 		n->lda.name = expr->buf;
-		push(n);
 		break;
 	}
 }
 static bool iunit_is_declared(const IUnit* unit, const char* localvar) {
 	for (size_t i = 0; i < buf_len(unit->decls); ++i) {
-		if (strcmp(unit->decls[i].name, localvar) == 0) return true;
+		if (unit->decls[i].name == localvar) return true;
 	}
 	return false;
 }
-static void gen_bool(const BoolValue* bv) {
+static void gen_bool(IGen* g, AstRef r) {
+	const BoolValue* bv = ast_bool(g->ast, r);
 	INode* n;
 	switch (bv->type) {
 	// LDA R0, a
@@ -154,40 +137,28 @@ static void gen_bool(const BoolValue* bv) {
 	// ...
 	// .l1:
 	case BOOL_EXPR:
-		gen_expr(bv->expr);
-		n = alloc(INode);
-		n->type = IN_LDC;
-		n->ldc.dest = reg;
+		gen_expr(g, bv->expr);
+		n = emit(g, IN_LDC);
+		n->ldc.dest = g->reg;
 		n->ldc.num = 0;
-		push(n);
-		n = alloc(INode);
-		n->type = IN_CMP;
-		n->move.dest = reg - 1;
-		n->move.src = reg;
-		push(n);
-		n = alloc(INode);
-		n->type = IN_JE;
-		n->label = ++lbl;
-		push(n);
-		--reg;
+		n = emit(g, IN_CMP);
+		n->move.dest = g->reg - 1;
+		n->move.src = g->reg;
+		n = emit(g, IN_JE);
+		n->label = ++g->lbl;
+		--g->reg;
 		break;
 	case BOOL_NOT:
-		gen_expr(bv->expr);
-		n = alloc(INode);
-		n->type = IN_LDC;
-		n->ldc.dest = reg;
+		gen_expr(g, bv->expr);
+		n = emit(g, IN_LDC);
+		n->ldc.dest = g->reg;
 		n->ldc.num = 0;
-		push(n);
-		n = alloc(INode);
-		n->type = IN_CMP;
-		n->move.dest = reg - 1;
-		n->move.src = reg;
-		push(n);
-		n = alloc(INode);
-		n->type = IN_JNE;
-		n->label = ++lbl;
-		push(n);
-		--reg;
+		n = emit(g, IN_CMP);
+		n->move.dest = g->reg - 1;
+		n->move.src = g->reg;
+		n = emit(g, IN_JNE);
+		n->label = ++g->lbl;
+		--g->reg;
 		break;
 	/*
 	 *  LDA R0, a
@@ -198,58 +169,55 @@ static void gen_bool(const BoolValue* bv) {
 	 *  .l1:
 	 */
 	case BOOL_BINARY:
-		gen_expr(bv->binary.left);
-		gen_expr(bv->binary.right);
-		n = alloc(INode);
-		n->type = IN_CMP;
-		n->move.dest = reg - 1;
-		n->move.src = reg - 2;
-		push(n);
-		n = alloc(INode);
-		switch (bv->binary.op.type) {
+		gen_expr(g, bv->binary.left);
+		gen_expr(g, bv->binary.right);
+		n = emit(g, IN_CMP);
+		n->move.dest = g->reg - 1;
+		n->move.src = g->reg - 2;
+		n = emit(g, IN_NOP);
+		switch (bv->op) {
 		case TK_EQEQ:   n->type = IN_JNE; break;
 		case TK_GR:     n->type = IN_JG; break;
 		case TK_LE:     n->type = IN_JL; break;
 		default:        puts("an error occurred!"); break;
 		}
-		n->label = ++lbl;
-		push(n);
+		n->label = ++g->lbl;
 		break;
 	}
 }
-static void gen_stmt(const Statement* st) {
+static void gen_stmt(IGen* g, AstRef r) {
+	const Statement* st = ast_stmt(g->ast, r);
+	const struct VarDecl* decls;
+	size_t row, col;
 	unsigned tl;
 	bool success, b;
 	INode* n;
-	n = alloc(INode);
-	n->type = IN_BEG_STMT;
-	push(n);
-	reg = 0;
+	n = emit(g, IN_BEG_STMT);
+	g->reg = 0;
 	switch (st->type) {
 	case ST_NOP: // optional
-		n = alloc(INode);
-		n->type = IN_NOP;
-		push(n);
+		n = emit(g, IN_NOP);
 		break;
-	case ST_EXPR: gen_expr(st->expr); break;
+	case ST_EXPR: gen_expr(g, st->expr); break;
 	case ST_RETURN:
-		gen_expr(st->expr);
-		n = alloc(INode);
-		n->type = IN_RETURN;
-		push(n);
+		gen_expr(g, st->expr);
+		n = emit(g, IN_RETURN);
+		n->reg = g->reg - 1;
 		break;
 	case ST_COMP:
 		// TODO: some sort of begin_scope & end_scope
-		for (size_t i = 0; i < buf_len(st->stmts); ++i)
-			gen_stmt(st->stmts[i]);
+		for (size_t i = 0; i < st->stmts.len; ++i)
+			gen_stmt(g, ast_list(g->ast, st->stmts)[i]);
 		break;
 	case ST_VARDECL:
-		for (size_t i = 0; i < buf_len(st->var_decls); ++i) {
-			if (iunit_is_declared(unit, st->var_decls[i].name)) {
-				printf("%zu:%zu: variable %s already declared!\n", st->row, st->col, st->var_decls[i].name);
-				exit(1);
+		decls = g->ast->decls + st->var_decls.begin;
+		for (size_t i = 0; i < st->var_decls.len; ++i) {
+			if (iunit_is_declared(g->unit, decls[i].name)) {
+				locate(g->ast->lines, st->pos, &row, &col);
+				fprintf(diag_out(), "%zu:%zu: variable %s already declared!\n", row, col, decls[i].name);
+				diag_fatal();
 			}
-			buf_push(unit->decls, st->var_decls[i]);
+			buf_push(g->unit->decls, decls[i]);
 		}
 		break;
 	/*
@@ -262,106 +230,96 @@ static void gen_stmt(const Statement* st) {
 	 * .l1:
 	 */
 	case ST_IF:
-		b = eval_bool(st->ifstmt.cond, &success);
+		b = eval_bool(g->ast, st->ifstmt.cond, &success);
 		if (success) {
-			if (b) gen_stmt(st->ifstmt.true_case);
-			else if (st->ifstmt.false_case)
-				gen_stmt(st->ifstmt.false_case);
+			if (b) gen_stmt(g, st->ifstmt.true_case);
+			else if (st->ifstmt.false_case != AST_NULL)
+				gen_stmt(g, st->ifstmt.false_case);
 			return;
 		}
-		gen_bool(st->ifstmt.cond);
-		tl = lbl;
-		gen_stmt(st->ifstmt.true_case);
-		if (st->ifstmt.false_case) {
-			n = alloc(INode);
-			n->type = IN_JMP;
-			n->label = ++lbl;
-			push(n);
-			n = alloc(INode);
-			n->type = IN_LABEL;
+		gen_bool(g, st->ifstmt.cond);
+		tl = g->lbl;
+		gen_stmt(g, st->ifstmt.true_case);
+		if (st->ifstmt.false_case != AST_NULL) {
+			n = emit(g, IN_JMP);
+			n->label = ++g->lbl;
+			n = emit(g, IN_LABEL);
 			n->label = tl++;
-			push(n);
-			gen_stmt(st->ifstmt.false_case);
+			gen_stmt(g, st->ifstmt.false_case);
 		}
-		n = alloc(INode);
-		n->type = IN_LABEL;
+		n = emit(g, IN_LABEL);
 		n->label = tl;
-		push(n);
 		break;
 	case ST_WHILE:
-		b = eval_bool(st->whileloop.cond, &success);
+		b = eval_bool(g->ast, st->whileloop.cond, &success);
 		if (success) {
 			if (b) {
-				n = alloc(INode);
-				n->type = IN_LABEL;
-				n->label = tl = ++lbl;
-				push(n);
-				gen_stmt(st->whileloop.body);
-				n = alloc(INode);
-				n->type = IN_JMP;
+				n = emit(g, IN_LABEL);
+				n->label = tl = ++g->lbl;
+				gen_stmt(g, st->whileloop.body);
+				n = emit(g, IN_JMP);
 				n->label = tl;
-				push(n);
 			}
 			return;
 		}
-		n = alloc(INode);
-		n->type = IN_LABEL;
-		n->label = tl = ++lbl;
-		push(n);
-		gen_bool(st->whileloop.cond);
-		gen_stmt(st->whileloop.body);
-		n = alloc(INode);
-		n->type = IN_JMP;
+		n = emit(g, IN_LABEL);
+		n->label = tl = ++g->lbl;
+		gen_bool(g, st->whileloop.cond);
+		gen_stmt(g, st->whileloop.body);
+		n = emit(g, IN_JMP);
 		n->label = tl;
-		push(n);
-		n = alloc(INode);
-		n->type = IN_LABEL;
+		n = emit(g, IN_LABEL);
 		n->label = tl + 1;
-		push(n);
 		break;
 	}
-	n = alloc(INode);
-	n->type = IN_END_STMT;
-	push(n);
+	n = emit(g, IN_END_STMT);
 }
-static void gen_func(const Function* func) {
+static void gen_func(IGen* g, const Function* func) {
 	switch (func->type) {
-	case FT_SIMPLE: gen_expr(func->value); break;
+	case FT_SIMPLE:
+		gen_expr(g, func->value);
+		emit(g, IN_RETURN)->reg = g->reg - 1;
+		break;
 	case FT_COMPLEX:
-		for (size_t i = 0; i < buf_len(func->body); ++i)
-			gen_stmt(func->body[i]), reg = 0;
+		for (size_t i = 0; i < func->body.len; ++i)
+			gen_stmt(g, ast_list(g->ast, func->body)[i]), g->reg = 0;
+		const size_t len = buf_len(g->nodes);
+		if (len < 2 || g->nodes[len - 2].type != IN_RETURN)
+			emit(g, IN_RETURN)->reg = IREG_NONE;
 		break;
 	}
-	INode* const last = inode_last(nodes);
-	if (!last->prev || last->prev->type != IN_RETURN) {
-		INode* n = alloc(INode);
-		n->type = IN_RETURN;
-		push(n);
-	}
 }
-#undef push
 
-INode* igen_expr(const Expression* expr) {
-	igen_init();
-	gen_expr(expr);
-	return inode_remove_first(nodes);
+INode* igen_expr(const Ast* ast, AstRef expr) {
+	IGen g = { .ast = ast };
+	gen_expr(&g, expr);
+	return g.nodes;
+}
+IUnit* igen_func(const Ast* ast, const Function* func) {
+	IGen g = { .ast = ast, .unit = alloc(IUnit) };
+	g.unit->name = func->name;
+	g.unit->paramnames = NULL;
+	for (size_t i = 0; i < func->paramnames.len; ++i)
+		buf_push(g.unit->paramnames, ast->names[func->paramnames.begin + i]);
+	gen_func(&g, func);
+	g.unit->nodes = g.nodes;
+	return g.unit;
 }
-IUnit* igen_func(const Function* func) {
-	unit = alloc(IUnit);
-	unit->name = strdup(func->name);
-	unit->paramnames = NULL;
-	for (size_t i = 0; i < buf_len(func->paramnames); ++i)
-		buf_push(unit->paramnames, func->paramnames[i]);
-	igen_init();
-	gen_func(func);
-	unit->nodes = inode_remove_first(nodes);
-	return unit;
+typedef struct IGenTask {
+	const Program* prog;
+	IProgram* ip;
+} IGenTask;
+static void igen_task(void* arg, size_t i) {
+	const IGenTask* t = arg;
+	t->ip->units[i] = igen_func(&t->prog->ast, &t->prog->funcs[i]);
 }
-IProgram* igen_prog(const Program* prog) {
+IProgram* igen_prog(const Program* prog, Pool* pool) {
 	IProgram* ip = alloc(IProgram);
 	ip->externs = prog->externs;
 	for (size_t i = 0; i < buf_len(prog->funcs); ++i)
-		buf_push(ip->units, igen_func(prog->funcs[i]));
+		buf_push(ip->units, NULL);
+	IGenTask t = { prog, ip };
+	pool_for(pool, buf_len(prog->funcs), igen_task, &t);
 	return ip;
 }
 const char* inode_names[NUM_INODES] = {
@@ -370,82 +328,168 @@ const char* inode_names[NUM_INODES] = {
 	"CALL", "READ", "WRITE", "PUSH",
 	"ADJOFF", "RETURN", "CMP", "LABEL",
 	"JMP", "JE", "JNE", "JG", "JL",
-	"LDS",
+	"LDS", "PHI", "SPILL", "RELOAD",
 };
-void print_inode(const INode* node, FILE* f) {
+static void print_reg(ireg_t r, OBuf* ob) {
+	ob_char(ob, 'R');
+	ob_uint(ob, r);
+}
+static void print_operand(const INode* node, uint8_t kind, ireg_t field, ireg_t index, OBuf* ob) {
+	switch (kind) {
+	case IO_IMM:    ob_int(ob, (int32_t)field); break;
+	case IO_FRAME:
+		ob_str(ob, "[F");
+		ob_uint(ob, field);
+		if (index != IREG_NONE) {
+			ob_str(ob, " + R");
+			ob_uint(ob, index);
+			if (node->scaled) ob_str(ob, "*W");
+		}
+		ob_char(ob, ']');
+		break;
+	default:        print_reg(field, ob); break;
+	}
+}
+// Prints ` Ra, Rb`.
+static void print_regs(ireg_t a, ireg_t b, OBuf* ob) {
+	ob_char(ob, ' ');
+	print_reg(a, ob);
+	ob_str(ob, ", ");
+	print_reg(b, ob);
+}
+void print_inode(const INode* node, OBuf* ob) {
 	if (node->type >= NUM_INODES) return;
 	else if (node->type == IN_LABEL) {
-		fprintf(f, ".l%u:\n", node->label);
+		ob_str(ob, ".l");
+		ob_uint(ob, node->label);
+		ob_str(ob, ":\n");
 		return;
 	}
-	fputs(inode_names[node->type], f);
+	ob_str(ob, inode_names[node->type]);
 	switch (node->type) {
 	case IN_READ:
 	case IN_WRITE:
 	case IN_CMP:
-	case IN_MOVE:   fprintf(f, " R%u, R%u", node->move.dest, node->move.src); break;
-	case IN_LDC:    fprintf(f, " R%u, %jd", node->ldc.dest, node->ldc.num); break;
-	case IN_LDA:    fprintf(f, " R%u, %s", node->lda.dest, node->lda.name); break;
+		ob_char(ob, ' ');
+		print_operand(node, node->dkind, node->move.dest, node->type == IN_WRITE ? node->move.index : IREG_NONE, ob);
+		ob_str(ob, ", ");
+		print_operand(node, node->skind, node->move.src, node->type == IN_READ ? node->move.index : IREG_NONE, ob);
+		break;
+	case IN_MOVE:   print_regs(node->move.dest, node->move.src, ob); break;
+	case IN_LDC:
+		ob_char(ob, ' ');
+		print_reg(node->ldc.dest, ob);
+		ob_str(ob, ", ");
+		ob_int(ob, node->ldc.num);
+		break;
+	case IN_LDA:
+		ob_char(ob, ' ');
+		print_reg(node->lda.dest, ob);
+		ob_str(ob, ", ");
+		ob_str(ob, node->lda.name);
+		break;
 	case IN_ADD:
 	case IN_SUB:
 	case IN_AND:
 	case IN_OR:
 	case IN_XOR:
-		fprintf(f, " R%u, R%u, R%u", node->binary.dest,
-				node->binary.left, node->binary.right);
+		ob_char(ob, ' ');
+		print_operand(node, node->dkind, node->binary.dest, IREG_NONE, ob);
+		ob_str(ob, ", ");
+		print_operand(node, node->dkind, node->binary.left, IREG_NONE, ob);
+		ob_str(ob, ", ");
+		print_operand(node, node->skind, node->binary.right, IREG_NONE, ob);
 		break;
-	case IN_PUSH:
 	case IN_ADJOFF:
-	case IN_NEG:    fprintf(f, " R%u", node->reg); break;
+	case IN_NEG:    print_regs(node->move.dest, node->move.src, ob); break;
+	case IN_PUSH:
+		ob_char(ob, ' ');
+		print_operand(node, node->skind, node->reg, IREG_NONE, ob);
+		break;
+	case IN_RETURN:
+		if (node->reg != IREG_NONE) ob_char(ob, ' '), print_reg(node->reg, ob);
+		break;
 	case IN_CALL:
-		fprintf(f, " R%u, %u", node->fcall.dest, node->fcall.pcount);
+		print_regs(node->fcall.ret, node->fcall.dest, ob);
+		ob_str(ob, ", ");
+		ob_uint(ob, node->fcall.pcount);
+		break;
+	case IN_LDS:
+		ob_char(ob, ' ');
+		print_reg(node->lda.dest, ob);
+		ob_str(ob, ", \"");
+		ob_str(ob, node->lda.name);
+		ob_char(ob, '"');
+		break;
+	case IN_PHI:
+		ob_char(ob, ' ');
+		print_reg(node->phi.dest, ob);
+		for (size_t i = 0; i < buf_len(node->phi.args); ++i)
+			ob_str(ob, ", "), print_reg(node->phi.args[i], ob);
+		break;
+	case IN_SPILL:
+		ob_str(ob, " [");
+		ob_uint(ob, node->spill.slot);
+		ob_str(ob, "], ");
+		print_reg(node->spill.reg, ob);
+		break;
+	case IN_RELOAD:
+		ob_char(ob, ' ');
+		print_reg(node->spill.reg, ob);
+		ob_str(ob, ", [");
+		ob_uint(ob, node->spill.slot);
+		ob_char(ob, ']');
 		break;
 	case IN_JE:
 	case IN_JG:
 	case IN_JL:
 	case IN_JNE:
 	case IN_JMP:
-		fprintf(f, " .l%u", node->label);
+		ob_str(ob, " .l");
+		ob_uint(ob, node->label);
 		break;
 	default: break;
 	}
-	fputc('\n', f);
+	ob_char(ob, '\n');
 }
-static void print_decl(const struct VarDecl* decl, FILE* f) {
-	fputs(decl->name, f);
+static void print_decl(const struct VarDecl* decl, OBuf* ob) {
+	ob_str(ob, decl->name);
 	if (decl->has_value)
-		fprintf(f, "=%jd", decl->value);
+		ob_char(ob, '='), ob_int(ob, decl->value);
 }
-void print_iunit(const IUnit* unit, FILE* f) {
-	fprintf(f, "unit %s (", unit->name);
+void print_iunit(const IUnit* unit, OBuf* ob) {
+	ob_str(ob, "unit ");
+	ob_str(ob, unit->name);
+	ob_str(ob, " (");
 	if (unit->paramnames) {
-		fputs(unit->paramnames[0], f);
+		ob_str(ob, unit->paramnames[0]);
 		for (size_t i = 1; i < buf_len(unit->paramnames); ++i)
-			fprintf(f, ", %s", unit->paramnames[i]);
+			ob_str(ob, ", "), ob_str(ob, unit->paramnames[i]);
 	}
-	fputs(") [", f);
+	ob_str(ob, ") [");
 	if (unit->decls) {
-		print_decl(&unit->decls[0], f);
+		print_decl(&unit->decls[0], ob);
 		for (size_t i = 1; i < buf_len(unit->decls); ++i)
-			fputc(',', f), print_decl(unit->decls+i, f);
+			ob_char(ob, ','), print_decl(unit->decls+i, ob);
 	}
-	fputs("]:\n", f);
-	print_inodes(unit->nodes, f);
-	fprintf(f, "end unit %s\n", unit->name);
+	ob_str(ob, "]:\n");
+	for (size_t i = 0; i < buf_len(unit->nodes); ++i)
+		print_inode(&unit->nodes[i], ob);
+	ob_str(ob, "end unit ");
+	ob_str(ob, unit->name);
+	ob_char(ob, '\n');
 }
-void print_iprog(const IProgram* prog, FILE* f) {
+int print_iprog(const IProgram* prog, FILE* f) {
+	OBuf ob;
+	ob_init(&ob, f);
 	for (size_t i = 0; i < buf_len(prog->units); ++i)
-		print_iunit(prog->units[i], f);
-}
-void free_inode(INode* node) {
-	free(node);
+		print_iunit(prog->units[i], &ob);
+	return ob_flush(&ob);
 }
 void free_iunit(IUnit* unit) {
-	free(unit->name);
-	for (size_t i = 0; i < buf_len(unit->paramnames); ++i)
-		free(unit->paramnames[i]);
 	buf_free(unit->paramnames);
-	free_inodes(unit->nodes);
+	buf_free(unit->nodes);
+	buf_free(unit->decls);
 	free(unit);
 }
 void free_iprog(IProgram* prog) {
@@ -453,8 +497,16 @@ void free_iprog(IProgram* prog) {
 		free_iunit(prog->units[i]);
 	buf_free(prog->units);
 }
-IProgram* optimize_iprog(IProgram* prog) {
-	for (size_t i = 0; i < buf_len(prog->units); ++i)
-		prog->units[i] = optimize_iunit(prog->units[i]);
+typedef struct OptimizeTask {
+	IProgram* prog;
+	unsigned level;
+} OptimizeTask;
+static void optimize_task(void* arg, size_t i) {
+	const OptimizeTask* t = arg;
+	t->prog->units[i] = optimize_iunit(t->prog->units[i], t->level);
+}
+IProgram* optimize_iprog(IProgram* prog, unsigned level, Pool* pool) {
+	OptimizeTask t = { prog, level };
+	pool_for(pool, buf_len(prog->units), optimize_task, &t);
 	return prog;
 }
\ No newline at end of file
@@ -1,16 +1,21 @@
 #ifndef BENC_IGEN_H
 #define BENC_IGEN_H
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include "parser.h"
+#include "buf.h"
+#include "obuf.h"
+#include "pool.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define alloc(t) ((t*)calloc(1, sizeof(t)))
-typedef uint16_t ireg_t;
+typedef uint32_t ireg_t;
+#define IREG_NONE 0xffffffff
 
 enum INodeType {
 	IN_NOP,
@@ -37,15 +42,24 @@ enum INodeType {
 	IN_JG,
 	IN_JL,
 	IN_LDS,
+	IN_PHI,
+	IN_SPILL,
+	IN_RELOAD,
 	
 	NUM_INODES,
 	IN_BEG_STMT,
 	IN_END_STMT,
+	IN_DEAD,        // tombstone of a removed node, see iunit_compact()
+};
+enum IOperandKind {
+	IO_REG,         // a register
+	IO_IMM,         // a 32-bit constant stored in place of the register
+	IO_FRAME,       // the word of a parameter or local, numbered parameters first, see ifold.h
 };
 typedef struct INode {
 	enum INodeType type;
-	struct INode* next;
-	struct INode* prev;
+	uint8_t dkind, skind;       // enum IOperandKind of the destination and source operands
+	bool scaled;                // the index of an IO_FRAME operand counts words, not bytes
 	
 	union {
 		ireg_t reg;
@@ -53,6 +67,7 @@ typedef struct INode {
 		struct {
 			ireg_t dest;
 			ireg_t src;
+			ireg_t index;       // added to the IO_FRAME address of IN_READ/IN_WRITE, IREG_NONE if none
 		} move;
 		struct {
 			ireg_t dest;
@@ -63,143 +78,92 @@ typedef struct INode {
 		} binary;
 		struct {
 			ireg_t dest;
-			char* name;
+			const char* name;   // interned for LDA
 		} lda;
 		struct {
-			ireg_t dest;
+			ireg_t dest;        // address of the callee
+			ireg_t ret;
 			uint8_t pcount;
 		} fcall;
+		struct {
+			ireg_t dest;
+			ireg_t* args;       // buf, one per predecessor in CFG order, see issa.c
+		} phi;
+		struct {
+			ireg_t reg;
+			unsigned slot;      // stack slot, see IUnit.num_slots
+		} spill;
 	};
 } INode;
 typedef struct IUnit {
-	char* name;
-	char** paramnames;
-	INode* nodes;
+	const char* name;
+	const char** paramnames;
+	INode* nodes;               // buf
 	struct VarDecl* decls;
+	unsigned num_slots;         // stack slots for spilled registers, see iralloc.h
+	unsigned moves_removed;
 } IUnit;
+typedef struct IRegInfo {     // register file of a target
+	unsigned num;               // R0 .. R(num-1)
+	uint32_t call_clobbers;     // mask of the registers that IN_CALL doesn't preserve
+} IRegInfo;
 typedef struct IProgram {
 	IUnit** units;
-	char** externs;
+	const char** externs;
 } IProgram;
 extern const char* inode_names[NUM_INODES];
 
-INode* igen_expr(const Expression* expr);
-IUnit* igen_func(const Function* func);
-IProgram* igen_prog(const Program* prog);
-void print_inode(const INode* node, FILE* f);
-void print_iunit(const IUnit* unit, FILE* f);
-void print_iprog(const IProgram* prog, FILE* f);
+INode* igen_expr(const Ast* ast, AstRef expr);
+IUnit* igen_func(const Ast* ast, const Function* func);
+// Generates the units of prog on the threads of pool, which may be NULL.
+IProgram* igen_prog(const Program* prog, Pool* pool);
+void print_inode(const INode* node, OBuf* ob);
+void print_iunit(const IUnit* unit, OBuf* ob);
+// Returns 0 if the whole program was written to f.
+int print_iprog(const IProgram* prog, FILE* f);
 
-IUnit* optimize_iunit(IUnit* unit);
-IProgram* optimize_iprog(IProgram* prog);
+IUnit* optimize_iunit(IUnit* unit, unsigned level);
+IProgram* optimize_iprog(IProgram* prog, unsigned level, Pool* pool);
 
 
-void free_inode(INode* node);            // Frees a single inode
 void free_iunit(IUnit* unit);
 void free_iprog(IProgram* prog);
-static void free_inodes(INode* node) {   // Frees all inodes
-	if (!node) return;
-	while (node) {
-		INode* const next = node->next;
-		free_inode(node);
-		node = next;
-	}
-}
-static void print_inodes(const INode* nodes, FILE* f) {
-	if (!nodes) return;
-	for (; nodes; nodes = nodes->next)
-		print_inode(nodes, f);
-}
 
-static INode* inode_last(INode* nodes) {
-	if (!nodes) return NULL;
-	INode* last = NULL;
-	for (INode* n = nodes; n; last = n, n = n->next);
-	return last;
-}
-static INode* inode_first(INode* nodes) {
-	if (!nodes) return NULL;
-	INode* prev = NULL;
-	for (INode* n = nodes; n; prev = n, n = n->prev);
-	return prev;
-}
-static INode* inode_get(INode* nodes, size_t index) {
-	if (!nodes) return NULL;
-	INode* n = nodes;
-	for (size_t i = 0; i < index; ++i, n = n->next) {
-		if (!n) return NULL;
+/*
+ * The nodes of an IUnit are stored contiguously.
+ * Optimizations remove nodes by turning them into IN_DEAD tombstones,
+ * iunit_compact() squeezes them out again.
+ */
+#define inode_count(unit) buf_len((unit)->nodes)
+static INode* inode_at(IUnit* unit, size_t i, int off) {   // `off` live nodes away from i
+	const size_t len = inode_count(unit);
+	if (i >= len) return NULL;
+	while (off > 0) {
+		if (++i >= len) return NULL;
+		if (unit->nodes[i].type != IN_DEAD) --off;
 	}
-	return n;
-}
-
-static INode* inode_insert(INode* node, INode* x) {
-	if (!node || !x) return NULL;
-	x->next = node->next;
-	if (x->next) x->next->prev = x;
-	x->prev = node;
-	node->next = x;
-	return x;
-}
-static INode* inode_insert_at(INode* nodes, INode* x, size_t index) {
-	if (!nodes || !x) return NULL;
-	INode* n = inode_get(nodes, index);
-	if (!n) return NULL;
-	x->next = n->next;
-	if (x->next) x->next->prev = x;
-	x->prev = n;
-	n->next = x;
-	return nodes;
-}
-static INode* inode_append(INode* nodes, INode* x) {
-	if (!x) return NULL;
-	INode* last;
-	if (!nodes) last = alloc(INode);
-	else last = inode_last(nodes);
-	last->next = x;
-	x->prev = last;
-	return inode_last(x);
-}
-static INode* inode_remove_first(INode* nodes) {
-	if (!nodes) return NULL;
-	INode* const first = inode_first(nodes);
-	INode* const next = first->next;
-	next->prev = NULL;
-	free_inode(first);
-	return next;
-}
-static INode* inode_remove_last(INode* nodes) {
-	if (!nodes) return NULL;
-	INode* const last = inode_last(nodes);
-	INode* const prev = last->prev;
-	prev->next = NULL;
-	free_inode(last);
-	return prev;
-}
-static INode* inode_remove(INode* node) {
-	if (node->prev) node->prev->next = node->next;
-	if (node->next) node->next->prev = node->prev;
-	INode* const tmp = node->next;
-	//free_inode(node);
-	return tmp;
+	while (off < 0) {
+		if (i-- == 0) return NULL;
+		if (unit->nodes[i].type != IN_DEAD) ++off;
+	}
+	return &unit->nodes[i];
 }
-static INode* inode_remove_at(INode* nodes, size_t index) {
-	inode_remove(inode_get(nodes, index));
-	return nodes;
+static void inode_remove(INode* node) {
+	node->type = IN_DEAD;
 }
-static INode* inode_remove_range(INode* begin, INode* end) {
-	INode* prev = begin->prev;
-	INode* next = end->next;
-	if (prev) prev->next = next;
-	if (next) next->prev = prev;
-	for (INode* n = begin; n != next; n = n->next)
-		free_inode(n);
-	return prev ? prev : next;
+static void iunit_compact(IUnit* unit) {
+	size_t j = 0;
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		if (unit->nodes[i].type != IN_DEAD)
+			unit->nodes[j++] = unit->nodes[i];
+	}
+	if (unit->nodes) buf__hdr(unit->nodes)->size = j;
 }
-static INode* inode_search(INode* nodes, enum INodeType type) {
-	for (INode* n = nodes; n; n = n->next) {
-		if (n->type == type) return n;
+static size_t inode_search(const IUnit* unit, size_t i, enum INodeType type) {
+	for (; i < inode_count(unit); ++i) {
+		if (unit->nodes[i].type == type) return i;
 	}
-	return NULL;
+	return SIZE_MAX;
 }
 
 #ifdef __cplusplus
@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "intern.h"
+#include "arena.h"
+
+struct InternEntry {
+	const char* str;
+	size_t len;
+	uint64_t hash;
+};
+
+static Arena arena = { 0 };
+static struct InternEntry* entries = NULL;
+static size_t num_entries = 0, capacity = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;    // the parsers of -j share the table
+
+static uint64_t hash_str(const char* str, size_t len) {
+	uint64_t h = 14695981039346656037u;     // FNV-1a
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)str[i]) * 1099511628211u;
+	return h;
+}
+static void grow(void) {
+	const size_t new_cap = capacity ? capacity * 2 : 1024;
+	struct InternEntry* new_entries = calloc(new_cap, sizeof(struct InternEntry));
+	if (!new_entries) abort();
+	for (size_t i = 0; i < capacity; ++i) {
+		if (!entries[i].str) continue;
+		size_t j = entries[i].hash & (new_cap - 1);
+		while (new_entries[j].str) j = (j + 1) & (new_cap - 1);
+		new_entries[j] = entries[i];
+	}
+	free(entries);
+	entries = new_entries;
+	capacity = new_cap;
+}
+
+const char* intern(const char* str, size_t len) {
+	const uint64_t h = hash_str(str, len);
+	pthread_mutex_lock(&lock);
+	if (2 * (num_entries + 1) > capacity) grow();
+	size_t i = h & (capacity - 1);
+	for (; entries[i].str; i = (i + 1) & (capacity - 1)) {
+		if (entries[i].hash == h && entries[i].len == len && memcmp(entries[i].str, str, len) == 0) {
+			pthread_mutex_unlock(&lock);
+			return entries[i].str;
+		}
+	}
+	char* copy = arena_alloc(&arena, len + 1);
+	if (!copy) abort();
+	memcpy(copy, str, len);
+	entries[i] = (struct InternEntry){ copy, len, h };
+	++num_entries;
+	pthread_mutex_unlock(&lock);
+	return copy;
+}
+const char* intern_str(const char* str) {
+	return intern(str, strlen(str));
+}
+void intern_free(void) {
+	free(entries);
+	entries = NULL;
+	num_entries = capacity = 0;
+	arena_free(&arena);
+}
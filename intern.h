@@ -0,0 +1,19 @@
+#ifndef BENC_INTERN_H
+#define BENC_INTERN_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns the unique copy of str, so that interned strings can be compared by their address.
+// Interned strings live until intern_free() is called, intern() may be called by several threads at once.
+const char* intern(const char* str, size_t len);
+const char* intern_str(const char* str);
+void intern_free(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_INTERN_H
@@ -1,5 +1,7 @@
 #include "iutil.h"
 #include "igen.h"
+#include "icfg.h"
+#include "issa.h"
 
 
 /// OPTIMIZATION FUNCTIONS
@@ -10,12 +12,10 @@
  * ---
  *
  */
-static bool remove_nops(INode* nodes) {
-	bool opt = false;
-	for (INode* n = nodes; n; n = n->next) {
-		if (n->type == IN_NOP) opt = true, inode_remove(n);
-	}
-	return opt;
+static bool remove_nop(IUnit* unit, size_t i) {
+	if (unit->nodes[i].type != IN_NOP) return false;
+	inode_remove(&unit->nodes[i]);
+	return true;
 }
 /*
  * Merges compile-time evaluateable expressions.
@@ -26,26 +26,26 @@ static bool remove_nops(INode* nodes) {
  * LDC R0, 5
  *
  */
-static bool const_eval(INode* nodes) {
-	bool opt = false;
-	for (INode* n = nodes; n; n = n->next) {
-		if (is_type(IN_LDC, -1, n) && is_type(IN_LDC, -2, n)) {
-			if (!is_binary(n->type)
-			|| n->prev->prev->ldc.dest + 1 != n->prev->ldc.dest
-			|| n->binary.left != n->prev->prev->ldc.dest
-			|| n->binary.right != n->prev->ldc.dest)
-				continue;
-			const ireg_t dest = n->binary.dest;
-			const uintmax_t r = perform_binary(n->type, n->prev->prev->ldc.num, n->prev->ldc.num);
-			inode_remove(n->prev->prev);
-			inode_remove(n->prev);
-			n->type = IN_LDC;
-			n->ldc.dest = dest;
-			n->ldc.num = r;
-			opt = true;
-		}
-	}
-	return opt;
+static bool const_eval(IUnit* unit, size_t i) {
+	INode* const n = &unit->nodes[i];
+	if (!is_binary(n->type) || !is_type(unit, i, -1, IN_LDC) || !is_type(unit, i, -2, IN_LDC))
+		return false;
+	INode* const a = inode_at(unit, i, -2);
+	INode* const b = inode_at(unit, i, -1);
+	if (a->ldc.dest + 1 != b->ldc.dest
+	|| n->binary.left != a->ldc.dest
+	|| n->binary.right != b->ldc.dest
+	|| n->binary.dest != n->binary.left
+	|| !is_dead_after(unit, i, b->ldc.dest))
+		return false;
+	const ireg_t dest = n->binary.dest;
+	const uintmax_t r = perform_binary(n->type, a->ldc.num, b->ldc.num);
+	inode_remove(a);
+	inode_remove(b);
+	n->type = IN_LDC;
+	n->ldc.dest = dest;
+	n->ldc.num = r;
+	return true;
 }
 /*
  * Merges compile-time evaluateable expressions.
@@ -57,21 +57,41 @@ static bool const_eval(INode* nodes) {
  * LDC R1, 1
  * ADD R0, R0, R1
  */
-static bool const_eval2(INode* nodes) {
-	bool opt = false;
-	for (INode* n = nodes; n; n = n->next) {
-		if (!(is_type(IN_LDC, 0, n)
-		&& is_binary_type(1, n)
-		&& is_type(IN_LDC, 2, n)
-		&& is_binary_type(3, n)))
-			continue;
-		const uintmax_t r = perform_binary(inode_get(n, 3)->type, n->ldc.num, inode_get(n, 2)->ldc.num);
-		n->ldc.num = r;
-		inode_remove_at(n, 2);
-		inode_remove_at(n, 2);
-		opt = true;
+static bool merge_consts(enum INodeType op1, enum INodeType op2, intmax_t a, intmax_t b, intmax_t* r) {
+	if ((op1 == IN_ADD || op1 == IN_SUB) && (op2 == IN_ADD || op2 == IN_SUB)) {
+		const intmax_t sum = (op1 == IN_ADD ? a : -a) + (op2 == IN_ADD ? b : -b);
+		*r = op1 == IN_ADD ? sum : -sum;
+		return true;
 	}
-	return opt;
+	else if (op1 == op2 && op1 != IN_SUB) {
+		*r = perform_binary(op1, a, b);
+		return true;
+	}
+	else return false;
+}
+static bool const_eval2(IUnit* unit, size_t i) {
+	INode* const n = &unit->nodes[i];
+	if (!(n->type == IN_LDC
+	&& is_binary_type(unit, i, 1)
+	&& is_type(unit, i, 2, IN_LDC)
+	&& is_binary_type(unit, i, 3)))
+		return false;
+	INode* const op1 = inode_at(unit, i, 1);
+	INode* const c2 = inode_at(unit, i, 2);
+	INode* const op2 = inode_at(unit, i, 3);
+	const ireg_t acc = op1->binary.dest;
+	if (op1->binary.left != acc || op1->binary.right != n->ldc.dest
+	|| c2->ldc.dest != n->ldc.dest || acc == n->ldc.dest
+	|| op2->binary.dest != acc || op2->binary.left != acc || op2->binary.right != c2->ldc.dest
+	|| !is_dead_after(unit, op2 - unit->nodes, c2->ldc.dest))
+		return false;
+	intmax_t r;
+	if (!merge_consts(op1->type, op2->type, n->ldc.num, c2->ldc.num, &r))
+		return false;
+	n->ldc.num = r;
+	inode_remove(c2);
+	inode_remove(op2);
+	return true;
 }
 /*
  * Merges compile-time evaluateable unary expressions.
@@ -80,16 +100,14 @@ static bool const_eval2(INode* nodes) {
  * ---------
  * LDC R1, -3
  */
-static bool const_unary(INode* nodes) {
-	bool opt = false;
-	for (INode* n = nodes; n; n = n->next) {
-		if (!(is_type(IN_LDC, 0, n)
-		&& is_unary_type(1, n))) continue;
-		n->ldc.num = perform_unary(n->next->type, n->ldc.num);
-		inode_remove(n->next);
-		opt = true;
-	}
-	return opt;
+static bool const_unary(IUnit* unit, size_t i) {
+	INode* const n = &unit->nodes[i];
+	if (!(n->type == IN_LDC && is_unary_type(unit, i, 1))) return false;
+	INode* const u = inode_at(unit, i, 1);
+	if (u->move.dest != n->ldc.dest || u->move.src != n->ldc.dest) return false;
+	n->ldc.num = perform_unary(u->type, n->ldc.num);
+	inode_remove(u);
+	return true;
 }
 /*
  * Removes code that does nothing.
@@ -100,16 +118,26 @@ static bool const_unary(INode* nodes) {
  * END
  * --------------
  */
-static bool remove_unused(INode* nodes) {
-	INode* first = inode_search(nodes, IN_BEG_STMT);
-	if (!first) return false;
-	INode* last = inode_search(first, IN_END_STMT);
-	if (!last) return false;
-	for (INode* n = first; n && n != last; n = n->next) {
-		if (has_effect(n->type)) return remove_unused(last);
+static bool remove_unused(IUnit* unit) {
+	bool opt = false;
+	size_t first = inode_search(unit, 0, IN_BEG_STMT);
+	while (first != SIZE_MAX) {
+		const size_t last = inode_search(unit, first, IN_END_STMT);
+		if (last == SIZE_MAX) break;
+		bool unused = true;
+		for (size_t i = first; i < last && unused; ++i) {
+			const INode* n = &unit->nodes[i];
+			if (has_effect(n->type)) unused = false;
+			else if (inode_def(n) != IREG_NONE && !is_dead_after(unit, last, inode_def(n))) unused = false;
+		}
+		if (unused) {
+			for (size_t i = first; i <= last; ++i)
+				inode_remove(&unit->nodes[i]);
+			opt = true;
+		}
+		first = inode_search(unit, last, IN_BEG_STMT);
 	}
-	inode_remove_range(first, last);
-	return true;
+	return opt;
 }
 /*
  * ...
@@ -120,18 +148,21 @@ static bool remove_unused(INode* nodes) {
  * ...
  * WRITE R1, R0
  */
-static bool remove_readback(INode* nodes) {
-	bool opt = false;
-	for (INode* n = nodes; n; n = n->next) {
-		if (is_type(IN_MOVE, 0, n)
-		&& is_type(IN_READ, 1, n)
-		&& is_type(IN_END_STMT, 2, n)) {
-			inode_remove(n->next);
-			inode_remove(n);
-			opt = true;
-		}
-	}
-	return opt;
+static bool remove_readback(IUnit* unit, size_t i) {
+	INode* const n = &unit->nodes[i];
+	if (!(n->type == IN_MOVE
+	&& is_type(unit, i, -1, IN_WRITE)
+	&& is_type(unit, i, 1, IN_READ)
+	&& is_type(unit, i, 2, IN_END_STMT)))
+		return false;
+	const INode* w = inode_at(unit, i, -1);
+	INode* const r = inode_at(unit, i, 1);
+	if (n->move.dest != w->move.src || n->move.src != w->move.dest
+	|| r->move.dest != n->move.dest || r->move.src != n->move.dest)
+		return false;
+	inode_remove(r);
+	inode_remove(n);
+	return true;
 }
 /*
  * LDA R0, a
@@ -156,69 +187,279 @@ static bool remove_readback(INode* nodes) {
  * LDC R0, 4
  * WRITE R1, R0
  */
-static bool register_caching(INode* nodes) {
+static bool register_caching(IUnit* unit) {
 	bool opt = false;
-	rcache_invlall();
-	for (INode* n = nodes; n; n = n->next) {
-		if (is_type(IN_LDA, 0, n)) {
-			if (is_type(IN_WRITE, 1, n)) {
-				bool b = rcache_write(n->next->move.src, n->lda.name);
-				bool c = rcache_addrof(n->next->move.dest, n->lda.name);
-				
-				if (is_type(IN_MOVE, 2, n) && is_type(IN_READ, 3, n)) {
-					const INode* tmp = inode_get(n, 2);
-					if (tmp->move.dest != (tmp->move.src - 1)) continue;
-					tmp = inode_get(n, 3);
-					if (tmp->move.dest != tmp->move.src) continue;
-					inode_remove_at(n, 2);
-					inode_remove_at(n, 2);
-				}
-				/*if (b) {
-					n = inode_remove(n);
-					n = inode_remove(n);
-				}*/  // CODE IS BUGGY
-				if (c) n = inode_remove(n);
+	reg_cache_entry rcache[RCACHE_NUM] = { 0 };
+	rcache_invlall(rcache);
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		INode* const n = &unit->nodes[i];
+		INode* const next = inode_at(unit, i, 1);
+		if (n->type == IN_LDA && next && next->type == IN_WRITE && next->move.dest == n->lda.dest) {
+			rcache_invlname(rcache, n->lda.name);
+			rcache_write(rcache, next->move.src, n->lda.name);
+			const bool c = rcache_addrof(rcache, next->move.dest, n->lda.name);
+
+			INode* const mv = inode_at(unit, i, 2);
+			INode* const rd = inode_at(unit, i, 3);
+			if (mv && rd && mv->type == IN_MOVE && rd->type == IN_READ
+			&& mv->move.dest == next->move.src && mv->move.src == next->move.dest
+			&& rd->move.dest == mv->move.dest && rd->move.src == rd->move.dest) {
+				inode_remove(mv);
+				inode_remove(rd);
+				opt = true;
 			}
-			else if (is_type(IN_READ, 1, n)) {
-				const ireg_t dest = n->next->move.dest;
-				ireg_t r = rcache_read(dest, n->lda.name);
-				if (r != 0xffff) {
-					n = inode_remove(n);
-					n = inode_remove(n);
-					if (r != dest) {
-						INode *tmp = alloc(INode);
-						tmp->type = IN_MOVE;
-						tmp->move.dest = dest;
-						tmp->move.src = r;
-						inode_insert(n->prev, tmp);
-					}
-					opt = true;
+			if (c) inode_remove(n), opt = true;
+			i = next - unit->nodes;
+		}
+		else if (n->type == IN_LDA && next && next->type == IN_READ
+				&& next->move.src == n->lda.dest && next->move.dest == n->lda.dest) {
+			const ireg_t dest = next->move.dest;
+			const ireg_t r = rcache_read(rcache, dest, n->lda.name);
+			if (r != IREG_NONE) {
+				inode_remove(n);
+				if (r != dest) {
+					next->type = IN_MOVE;
+					next->move.dest = dest;
+					next->move.src = r;
 				}
+				else inode_remove(next);
+				opt = true;
 			}
+			i = next - unit->nodes;
 		}
-		else if (is_type(IN_LDC, 0, n)) {
-			if (rcache_ldc(n->ldc.dest, n->ldc.num))
+		else if (n->type == IN_LDC) {
+			if (rcache_ldc(rcache, n->ldc.dest, n->ldc.num))
+				inode_remove(n), opt = true;
+		}
+		else if (n->type == IN_MOVE) {
+			if (!rcache_move(rcache, n->move.dest, n->move.src))
+				rcache_invl(rcache, n->move.dest);
+		}
+		else if (n->type == IN_CALL || n->type == IN_LABEL)
+			rcache_invlall(rcache);
+		else if (n->type == IN_WRITE)
+			rcache_invlnames(rcache);
+		else if (inode_def(n) != IREG_NONE)
+			rcache_invl(rcache, inode_def(n));
+	}
+	return opt;
+}
+/*
+ * Removes blocks that can't be reached from the entry.
+ * RETURN
+ * LDC R0, 1
+ * .l1:
+ * ...
+ * ---------
+ * RETURN
+ * ...
+ */
+static bool remove_unreachable(IUnit* unit) {
+	bool opt = false;
+	CFG* cfg = build_cfg(unit);
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		if (cfg_reachable(cfg, b)) continue;
+		for (size_t i = cfg->blocks[b].begin; i < cfg->blocks[b].end; ++i) {
+			INode* const n = &unit->nodes[i];
+			// keep the statement markers paired, remove_unused drops the empty statement
+			if (n->type != IN_BEG_STMT && n->type != IN_END_STMT)
 				inode_remove(n), opt = true;
 		}
-		else if (is_type(IN_MOVE, 0, n)) {
-			rcache_move(n->move.dest, n->move.src);
+	}
+	free_cfg(cfg);
+	return opt;
+}
+
+/// SSA OPTIMIZATION FUNCTIONS
+static void remove_phi(INode* n) {
+	buf_free(n->phi.args);
+	inode_remove(n);
+}
+static ireg_t find_repl(ireg_t* repl, ireg_t r) {
+	while (repl[r] != r) r = repl[r] = repl[repl[r]];
+	return r;
+}
+/*
+ * Replaces the uses of copies with their sources,
+ * also for phis whose arguments are all the same.
+ * MOVE R5, R3
+ * ADD R6, R4, R5
+ * --------------
+ * ADD R6, R4, R3
+ */
+static bool ssa_copy_prop(IUnit* unit) {
+	const ireg_t num = iunit_num_regs(unit);
+	ireg_t* repl = malloc(num * sizeof(ireg_t));
+	bool opt = false;
+	for (ireg_t r = 0; r < num; ++r)
+		repl[r] = r;
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		INode* const n = &unit->nodes[i];
+		if (n->type == IN_MOVE) {
+			repl[n->move.dest] = n->move.src;
+			inode_remove(n), opt = true;
+		}
+		else if (n->type == IN_PHI) {
+			ireg_t v = IREG_NONE;
+			size_t j;
+			for (j = 0; j < buf_len(n->phi.args); ++j) {
+				const ireg_t a = n->phi.args[j];
+				if (a == n->phi.dest || a == v) continue;
+				if (v != IREG_NONE) break;
+				v = a;
+			}
+			if (j == buf_len(n->phi.args) && v != IREG_NONE) {
+				repl[n->phi.dest] = v;
+				remove_phi(n), opt = true;
+			}
+		}
+	}
+	if (opt) {
+		for (size_t i = 0; i < inode_count(unit); ++i) {
+			INode* const n = &unit->nodes[i];
+			ireg_t* uses[2];
+			const int nu = inode_use_ptrs(n, uses);
+			for (int j = 0; j < nu; ++j)
+				*uses[j] = find_repl(repl, *uses[j]);
+			if (n->type == IN_PHI) {
+				for (size_t j = 0; j < buf_len(n->phi.args); ++j)
+					n->phi.args[j] = find_repl(repl, n->phi.args[j]);
+			}
+		}
+	}
+	free(repl);
+	return opt;
+}
+/*
+ * Removes nodes whose results are never read, in SSA form.
+ * LDC R4, 1
+ * MOVE R5, R4
+ * -----------
+ */
+static bool ssa_dce(IUnit* unit) {
+	const ireg_t num = iunit_num_regs(unit);
+	size_t* uses = calloc(num, sizeof(size_t));
+	size_t* defs = malloc(num * sizeof(size_t));
+	size_t* work = NULL;
+	bool opt = false;
+	for (ireg_t r = 0; r < num; ++r)
+		defs[r] = SIZE_MAX;
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		const INode* n = &unit->nodes[i];
+		ireg_t u[2];
+		const int nu = inode_uses(n, u);
+		for (int j = 0; j < nu; ++j)
+			++uses[u[j]];
+		if (n->type == IN_PHI) {
+			for (size_t j = 0; j < buf_len(n->phi.args); ++j)
+				++uses[n->phi.args[j]];
+		}
+		if (inode_def(n) != IREG_NONE) defs[inode_def(n)] = i;
+	}
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		const INode* n = &unit->nodes[i];
+		if (inode_def(n) != IREG_NONE && !uses[inode_def(n)]) buf_push(work, i);
+	}
+	while (buf_len(work)) {
+		INode* const n = &unit->nodes[*buf_last(work)];
+		buf_pop(work);
+		if (has_effect(n->type) || n->type == IN_DEAD) continue;
+		ireg_t u[2];
+		const int nu = inode_uses(n, u);
+		for (int j = 0; j < nu; ++j) {
+			if (!--uses[u[j]] && defs[u[j]] != SIZE_MAX) buf_push(work, defs[u[j]]);
+		}
+		if (n->type == IN_PHI) {
+			for (size_t j = 0; j < buf_len(n->phi.args); ++j) {
+				const ireg_t a = n->phi.args[j];
+				if (!--uses[a] && a != n->phi.dest && defs[a] != SIZE_MAX) buf_push(work, defs[a]);
+			}
+			remove_phi(n);
 		}
-		else if (is_type(IN_CALL, 0, n)
-				|| is_type(IN_LABEL, 0, n))
-			rcache_invlall();
+		else inode_remove(n);
+		opt = true;
 	}
+	free(uses);
+	free(defs);
+	buf_free(work);
 	return opt;
 }
 
+static bool run_pass(IUnit* unit, bool(*pass)(IUnit*)) {
+	if (!pass(unit)) return false;
+	iunit_compact(unit);
+	return true;
+}
+static void optimize_ssa(IUnit* unit) {
+	iunit_to_ssa(unit);
+	while (run_pass(unit, ssa_copy_prop) || run_pass(unit, ssa_dce));
+	iunit_from_ssa(unit);
+}
+
+/// PASS MANAGER
+/*
+ * Local passes look at the live nodes at most LOCAL_WINDOW away from node i.
+ * They are driven by a worklist: when one of them changes the unit, only the
+ * nodes around i are visited again. Global passes scan the whole unit once
+ * per round. Rounds repeat until nothing changes, at most MAX_ROUNDS times,
+ * and a round visits at most MAX_VISITS nodes per node of the unit, so the
+ * result doesn't depend on anything but the unit.
+ */
+#define LOCAL_WINDOW 3
+#define MAX_ROUNDS   16
+#define MAX_VISITS   16
+typedef bool(*local_pass)(IUnit*, size_t);
+typedef bool(*global_pass)(IUnit*);
+static const local_pass local_passes[] = {
+	remove_nop, const_eval, const_eval2, const_unary, remove_readback,
+};
+static const global_pass global_passes[] = {
+	remove_unreachable, register_caching, remove_unused,
+};
+#define arraylen(a) (sizeof(a) / sizeof((a)[0]))
 
-IUnit* optimize_iunit(IUnit* unit) {
-	while (remove_nops(unit->nodes)
-		|| register_caching(unit->nodes)
-        || const_eval(unit->nodes)
-		|| const_eval2(unit->nodes)
-		|| const_unary(unit->nodes)
-		|| remove_unused(unit->nodes)
-		|| remove_readback(unit->nodes)
-	);
+static void requeue(IUnit* unit, size_t i, size_t** work, bool* queued) {
+	for (int off = -LOCAL_WINDOW; off <= LOCAL_WINDOW; ++off) {
+		const INode* n = inode_at(unit, i, off);
+		if (!n || n->type == IN_DEAD) continue;
+		const size_t j = n - unit->nodes;
+		if (!queued[j]) queued[j] = true, buf_push(*work, j);
+	}
+}
+static bool run_local_passes(IUnit* unit) {
+	const size_t len = inode_count(unit);
+	size_t* work = NULL;
+	bool* queued = malloc(len);
+	size_t visits = MAX_VISITS * len;
+	bool opt = false;
+	for (size_t i = len; i; --i)           // popped in program order
+		buf_push(work, i - 1);
+	memset(queued, true, len);
+	while (buf_len(work) && visits--) {
+		const size_t i = *buf_last(work);
+		buf_pop(work);
+		queued[i] = false;
+		if (unit->nodes[i].type == IN_DEAD) continue;
+		for (size_t p = 0; p < arraylen(local_passes); ++p) {
+			if (!local_passes[p](unit, i)) continue;
+			requeue(unit, i, &work, queued);
+			opt = true;
+			break;
+		}
+	}
+	buf_free(work);
+	free(queued);
+	return opt;
+}
+static bool run_round(IUnit* unit) {
+	bool opt = run_local_passes(unit);
+	for (size_t p = 0; p < arraylen(global_passes); ++p)
+		opt |= global_passes[p](unit);
+	iunit_compact(unit);
+	return opt;
+}
+IUnit* optimize_iunit(IUnit* unit, unsigned level) {
+	for (unsigned round = 0; round < MAX_ROUNDS && run_round(unit); ++round);
+	if (level >= 2) optimize_ssa(unit);
 	return unit;
-}
\ No newline at end of file
+}
@@ -0,0 +1,689 @@
+#include <limits.h>
+#include <string.h>
+#include "iralloc.h"
+#include "icfg.h"
+#include "iutil.h"
+#include "buf.h"
+
+typedef struct VReg {
+	size_t start, end;          // live interval, start is SIZE_MAX if the register isn't used
+	size_t out_end;             // last position it is live out of a block at, SIZE_MAX if none
+	double weight;              // occurrences, weighted by loop depth
+	uint32_t allowed;           // registers it may get
+	ireg_t alias;               // register it was coalesced with, see find_alias()
+	ireg_t color;
+	bool prefer_r0;
+	bool spilled;
+	bool no_spill;              // temporary of a reload or spill
+} VReg;
+
+/// LIVE RANGES
+/*
+ * Renames the registers of unit, so that the ones that are live across
+ * blocks are R0 .. R(*num_global-1) and each value that stays in its block
+ * gets a name of its own. Registers that igen reuses for unrelated values
+ * no longer span the whole unit then. Returns the number of names.
+ */
+static ireg_t split_ranges(IUnit* unit, ireg_t* num_global) {
+	const ireg_t num = iunit_num_regs(unit);
+	const size_t len = inode_count(unit);
+	CFG* cfg = build_cfg(unit);
+	Liveness lv;
+	size_t* first = malloc(num * sizeof(size_t));  // block of the first occurrence
+	size_t* stamp = malloc(num * sizeof(size_t));  // block of the last def seen
+	bool* global = calloc(num, sizeof(bool));
+	ireg_t* map = malloc(num * sizeof(ireg_t));
+	bool* keep = calloc(len, sizeof(bool));        // def that reaches the end of its block
+	ireg_t g = 0;
+	for (ireg_t r = 0; r < num; ++r)
+		first[r] = stamp[r] = BLOCK_NONE;
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		for (size_t i = cfg->blocks[b].begin; i < cfg->blocks[b].end; ++i) {
+			const INode* n = &unit->nodes[i];
+			ireg_t regs[3];
+			int nr = inode_uses(n, regs);
+			for (int j = 0; j < nr; ++j) {
+				if (stamp[regs[j]] != b) global[regs[j]] = true;    // live in
+			}
+			if (inode_def(n) != IREG_NONE) stamp[regs[nr++] = inode_def(n)] = b;
+			for (int j = 0; j < nr; ++j) {
+				if (first[regs[j]] == BLOCK_NONE) first[regs[j]] = b;
+				else if (first[regs[j]] != b) global[regs[j]] = true;
+			}
+		}
+	}
+	for (ireg_t r = 0; r < num; ++r) {
+		if (global[r]) map[r] = g++;
+	}
+	for (ireg_t r = 0; r < num; ++r) {
+		if (!global[r]) map[r] = g + r;
+	}
+	for (size_t i = 0; i < len; ++i) {
+		INode* const n = &unit->nodes[i];
+		ireg_t* uses[2];
+		const int nu = inode_use_ptrs(n, uses);
+		for (int j = 0; j < nu; ++j)
+			*uses[j] = map[*uses[j]];
+		ireg_t* const d = inode_def_ptr(n);
+		if (d) *d = map[*d];
+	}
+
+	cfg_liveness(cfg, g, &lv);
+	for (ireg_t r = 0; r < g; ++r)
+		stamp[r] = BLOCK_NONE;
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		for (size_t i = cfg->blocks[b].end; i-- > cfg->blocks[b].begin; ) {
+			const ireg_t d = inode_def(&unit->nodes[i]);
+			if (d >= g || stamp[d] == b) continue;
+			stamp[d] = b;
+			keep[i] = regset_has(live_out(&lv, b), d);
+		}
+	}
+	ireg_t* cur = malloc((g + num) * sizeof(ireg_t));
+	size_t* cur_block = malloc((g + num) * sizeof(size_t));
+	ireg_t next = g;
+	for (ireg_t r = 0; r < g + num; ++r)
+		cur_block[r] = BLOCK_NONE;
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		for (size_t i = cfg->blocks[b].begin; i < cfg->blocks[b].end; ++i) {
+			INode* const n = &unit->nodes[i];
+			ireg_t* uses[2];
+			const int nu = inode_use_ptrs(n, uses);
+			for (int j = 0; j < nu; ++j) {
+				if (cur_block[*uses[j]] == b) *uses[j] = cur[*uses[j]];
+			}
+			ireg_t* const d = inode_def_ptr(n);
+			if (!d) continue;
+			cur[*d] = keep[i] ? *d : next++;
+			cur_block[*d] = b;
+			*d = cur[*d];
+		}
+	}
+	*num_global = g;
+	free(first);
+	free(stamp);
+	free(global);
+	free(map);
+	free(keep);
+	free(cur);
+	free(cur_block);
+	free_liveness(&lv);
+	free_cfg(cfg);
+	return next;
+}
+
+/// INTERVALS
+static void extend(VReg* v, size_t pos) {
+	if (v->start == SIZE_MAX || pos < v->start) v->start = pos;
+	if (pos > v->end) v->end = pos;
+}
+// Each register lives from its first to its last occurrence, extended over
+// the blocks it is live in. Occurrences in loops weigh 8 times as much per level.
+static void build_intervals(IUnit* unit, VReg* vr, ireg_t num_global, size_t** calls) {
+	CFG* cfg = build_cfg(unit);
+	Liveness lv;
+	for (size_t r = 0; r < buf_len(vr); ++r) {
+		VReg* const v = &vr[r];
+		v->start = v->out_end = SIZE_MAX;
+		v->end = 0;
+		v->weight = 0;
+		v->alias = r;
+		v->color = IREG_NONE;
+		v->prefer_r0 = v->spilled = false;
+	}
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		const unsigned depth = cfg_loop_depth(cfg, b);
+		const double w = (double)((uint64_t)1 << 3 * (depth < 8 ? depth : 8));
+		for (size_t i = bb->begin; i < bb->end; ++i) {
+			const INode* n = &unit->nodes[i];
+			ireg_t regs[3];
+			int nr = inode_uses(n, regs);
+			if (inode_def(n) != IREG_NONE) regs[nr++] = inode_def(n);
+			for (int j = 0; j < nr; ++j)
+				extend(&vr[regs[j]], i), vr[regs[j]].weight += w;
+			if (n->type == IN_CALL) {
+				buf_push(*calls, i);
+				vr[n->fcall.ret].prefer_r0 = true;
+			}
+			else if (n->type == IN_RETURN && n->reg != IREG_NONE)
+				vr[n->reg].prefer_r0 = true;
+		}
+	}
+	cfg_liveness(cfg, num_global, &lv);
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		if (bb->begin == bb->end) continue;
+		for (size_t w = 0; w < lv.words; ++w) {
+			for (uint64_t bits = live_in(&lv, b)[w]; bits; bits &= bits - 1)
+				extend(&vr[w * 64 + __builtin_ctzll(bits)], bb->begin);
+			for (uint64_t bits = live_out(&lv, b)[w]; bits; bits &= bits - 1) {
+				VReg* const v = &vr[w * 64 + __builtin_ctzll(bits)];
+				extend(v, bb->end - 1);
+				if (v->out_end == SIZE_MAX || bb->end - 1 > v->out_end) v->out_end = bb->end - 1;
+			}
+		}
+	}
+	free_liveness(&lv);
+	free_cfg(cfg);
+}
+static bool crosses_call(const size_t* calls, size_t start, size_t end) {
+	size_t lo = 0, hi = buf_len(calls);
+	while (lo < hi) {                                       // first call after start
+		const size_t mid = (lo + hi) / 2;
+		if (calls[mid] <= start) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < buf_len(calls) && calls[lo] < end;
+}
+// Whether spilling a frees registers more cheaply than spilling b.
+static bool cheaper(const VReg* a, const VReg* b) {
+	return a->weight * (b->end - b->start + 1) < b->weight * (a->end - a->start + 1);
+}
+
+/// LINEAR SCAN
+/*
+ * Visits the intervals in order of their start and gives each a register
+ * that no active interval holds. Registers that are live across a call
+ * avoid the call-clobbered ones. A result may take the register of an
+ * operand that dies at the same node, so the copy of a MOVE can be dropped;
+ * call results and return values prefer R0. If no register is free,
+ * the cheapest of the interval and the active ones is spilled.
+ * Returns whether everything fit.
+ */
+static bool linear_scan(IUnit* unit, VReg* vr, const size_t* calls, const IRegInfo* regs) {
+	const size_t len = inode_count(unit);
+	ireg_t** starting = calloc(len, sizeof(ireg_t*));      // registers by start position
+	ireg_t* active = NULL;
+	bool fits = true;
+	for (size_t r = 0; r < buf_len(vr); ++r) {
+		if (vr[r].start != SIZE_MAX) buf_push(starting[vr[r].start], r);
+	}
+	const uint32_t all = regs->num >= 32 ? UINT32_MAX : ((uint32_t)1 << regs->num) - 1;
+	uint32_t used = 0;
+	for (size_t pos = 0; pos < len; ++pos) {
+		for (size_t j = 0; j < buf_len(active); ) {
+			if (vr[active[j]].end < pos) {
+				used &= ~((uint32_t)1 << vr[active[j]].color);
+				active[j] = *buf_last(active);
+				buf_pop(active);
+			}
+			else ++j;
+		}
+		const INode* n = &unit->nodes[pos];
+		const ireg_t def = inode_def(n);
+		for (size_t i = 0; i < buf_len(starting[pos]); ++i) {
+			const ireg_t r = starting[pos][i];
+			VReg* const v = &vr[r];
+			uint32_t allowed = all;
+			if (crosses_call(calls, v->start, v->end)) allowed &= ~regs->call_clobbers;
+			// the result of n may reuse a register that n reads for the last time
+			uint32_t dying = 0;
+			for (size_t j = 0; j < buf_len(active) && r == def; ++j) {
+				const ireg_t s = active[j];
+				if (vr[s].end == pos && vr[s].out_end != pos && inode_uses_reg(n, s))
+					dying |= (uint32_t)1 << vr[s].color;
+			}
+			const uint32_t free = allowed & ~used;
+			ireg_t c = IREG_NONE;
+			dying &= allowed;
+			const ireg_t copied = n->type == IN_MOVE ? n->move.src : is_binary(n->type) ? n->binary.left : IREG_NONE;
+			if (r == def && copied != IREG_NONE && vr[copied].color != IREG_NONE
+			&& (dying & ((uint32_t)1 << vr[copied].color)))
+				c = vr[copied].color;       // no copy, or two-address form
+			else if (v->prefer_r0 && ((free | dying) & 1)) c = 0;
+			else if (free | dying) {
+				const uint32_t m = dying ? dying : free;
+				for (c = 0; !(m & ((uint32_t)1 << c)); ++c);
+			}
+			else {
+				size_t victim = v->no_spill ? SIZE_MAX : buf_len(active);
+				for (size_t j = 0; j < buf_len(active); ++j) {
+					const VReg* s = &vr[active[j]];
+					if (!s->no_spill && s->end > pos && ((allowed >> s->color) & 1)
+					&& (victim == SIZE_MAX || cheaper(s, victim < buf_len(active) ? &vr[active[victim]] : v)))
+						victim = j;
+				}
+				assert(victim != SIZE_MAX);
+				fits = false;
+				if (victim == buf_len(active)) {
+					v->spilled = true;
+					continue;
+				}
+				VReg* const s = &vr[active[victim]];
+				v->color = s->color;
+				s->color = IREG_NONE;
+				s->spilled = true;
+				active[victim] = r;
+				continue;
+			}
+			v->color = c;
+			if (used & ((uint32_t)1 << c)) {
+				for (size_t j = 0; j < buf_len(active); ++j) {
+					if (vr[active[j]].color == c) active[j] = r;
+				}
+			}
+			else {
+				used |= (uint32_t)1 << c;
+				buf_push(active, r);
+			}
+		}
+	}
+	for (size_t i = 0; i < len; ++i)
+		buf_free(starting[i]);
+	free(starting);
+	buf_free(active);
+	return fits;
+}
+
+/// GRAPH COLOURING
+/*
+ * Chaitin/Briggs: two registers interfere if one is written while the other
+ * is live, MOVEs are coalesced where that keeps the graph colourable (Briggs'
+ * test), nodes with fewer neighbours than allowed registers are removed
+ * one by one, and the rest are coloured in reverse order. A node that
+ * doesn't get a colour is spilled; the cheapest ones are removed first
+ * when nothing else can be, in the hope that they get one anyway.
+ */
+typedef struct Move {
+	double weight;
+	ireg_t dest, src;
+} Move;
+typedef struct Graph {
+	ireg_t** adj;               // bufs of neighbours, only for coalesced registers
+	uint64_t* edges;            // hash set of min << 32 | max
+	size_t cap, len;
+	Move* moves;                // buf, by decreasing weight
+	ireg_t** partners;          // bufs of registers each one is moved to or from
+} Graph;
+#define EDGE_NONE UINT64_MAX
+static size_t edge_hash(uint64_t e, size_t cap) {
+	return (e * 0x9E3779B97F4A7C15u >> 20) & (cap - 1);
+}
+static bool graph_has(const Graph* g, ireg_t a, ireg_t b) {
+	const uint64_t e = a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+	for (size_t i = edge_hash(e, g->cap); g->edges[i] != EDGE_NONE; i = (i + 1) & (g->cap - 1)) {
+		if (g->edges[i] == e) return true;
+	}
+	return false;
+}
+static void graph_insert(Graph* g, uint64_t e) {
+	size_t i = edge_hash(e, g->cap);
+	while (g->edges[i] != EDGE_NONE) i = (i + 1) & (g->cap - 1);
+	g->edges[i] = e;
+	++g->len;
+}
+static void graph_add(Graph* g, ireg_t a, ireg_t b) {
+	if (a == b || graph_has(g, a, b)) return;
+	if (2 * (g->len + 1) > g->cap) {
+		uint64_t* const old = g->edges;
+		const size_t cap = g->cap;
+		g->cap *= 2;
+		g->len = 0;
+		g->edges = malloc(g->cap * sizeof(uint64_t));
+		memset(g->edges, 0xff, g->cap * sizeof(uint64_t));
+		for (size_t i = 0; i < cap; ++i) {
+			if (old[i] != EDGE_NONE) graph_insert(g, old[i]);
+		}
+		free(old);
+	}
+	graph_insert(g, a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a);
+	buf_push(g->adj[a], b);
+	buf_push(g->adj[b], a);
+}
+static void free_graph(Graph* g, size_t num) {
+	for (size_t r = 0; r < num; ++r) {
+		buf_free(g->adj[r]);
+		buf_free(g->partners[r]);
+	}
+	free(g->adj);
+	free(g->partners);
+	free(g->edges);
+	buf_free(g->moves);
+}
+static ireg_t find_alias(VReg* vr, ireg_t r) {
+	while (vr[r].alias != r) r = vr[r].alias = vr[vr[r].alias].alias;
+	return r;
+}
+static unsigned popcount(uint32_t x) {
+	unsigned n = 0;
+	for (; x; x &= x - 1) ++n;
+	return n;
+}
+static int cmp_moves(const void* a, const void* b) {
+	const double x = ((const Move*)a)->weight, y = ((const Move*)b)->weight;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Walks each block backwards from its live-out set, adding an edge from every def
+// to everything live after it. The source of a MOVE doesn't interfere with its dest.
+static void build_graph(IUnit* unit, VReg* vr, ireg_t num_global, const IRegInfo* regs, Graph* g) {
+	const size_t num = buf_len(vr);
+	const uint32_t all = regs->num >= 32 ? UINT32_MAX : ((uint32_t)1 << regs->num) - 1;
+	CFG* cfg = build_cfg(unit);
+	Liveness lv;
+	ireg_t* live = NULL;                                // sparse set
+	size_t* index = malloc(num * sizeof(size_t));
+	g->adj = calloc(num, sizeof(ireg_t*));
+	g->partners = calloc(num, sizeof(ireg_t*));
+	g->cap = 1024;
+	g->len = 0;
+	g->edges = malloc(g->cap * sizeof(uint64_t));
+	memset(g->edges, 0xff, g->cap * sizeof(uint64_t));
+	g->moves = NULL;
+	for (size_t r = 0; r < num; ++r) {
+		VReg* const v = &vr[r];
+		v->weight = 0;
+		v->allowed = all;
+		v->alias = r;
+		v->color = IREG_NONE;
+		v->prefer_r0 = v->spilled = false;
+		index[r] = SIZE_MAX;
+	}
+#define live_add(r) (index[r] == SIZE_MAX ? (index[r] = buf_len(live), buf_push(live, r), 0) : 0)
+#define live_remove(r) (index[r] != SIZE_MAX ? (index[*buf_last(live)] = index[r], \
+		live[index[r]] = *buf_last(live), buf_pop(live), index[r] = SIZE_MAX) : 0)
+	cfg_liveness(cfg, num_global, &lv);
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		const unsigned depth = cfg_loop_depth(cfg, b);
+		const double weight = (double)((uint64_t)1 << 3 * (depth < 8 ? depth : 8));
+		for (size_t j = 0; j < buf_len(live); ++j)
+			index[live[j]] = SIZE_MAX;
+		if (live) buf__hdr(live)->size = 0;
+		for (size_t w = 0; w < lv.words; ++w) {
+			for (uint64_t bits = live_out(&lv, b)[w]; bits; bits &= bits - 1)
+				live_add(w * 64 + __builtin_ctzll(bits));
+		}
+		for (size_t i = bb->end; i-- > bb->begin; ) {
+			const INode* n = &unit->nodes[i];
+			const ireg_t d = inode_def(n);
+			ireg_t uses[2];
+			const int nu = inode_uses(n, uses);
+			if (n->type == IN_CALL) {
+				for (size_t j = 0; j < buf_len(live); ++j) {
+					if (live[j] != d) vr[live[j]].allowed &= ~regs->call_clobbers;
+				}
+				vr[n->fcall.ret].prefer_r0 = true;
+			}
+			else if (n->type == IN_RETURN && n->reg != IREG_NONE)
+				vr[n->reg].prefer_r0 = true;
+			if (d != IREG_NONE) {
+				for (size_t j = 0; j < buf_len(live); ++j) {
+					if (!(n->type == IN_MOVE && live[j] == n->move.src)) graph_add(g, d, live[j]);
+				}
+				live_remove(d);
+				vr[d].weight += weight;
+			}
+			if (n->type == IN_MOVE && d != n->move.src)
+				buf_push(g->moves, ((Move){ weight, d, n->move.src }));
+			else if (is_binary(n->type) && d != IREG_NONE && d != n->binary.left) {
+				// not coalesced, but the same colour saves the copy of the two-address form
+				buf_push(g->partners[d], n->binary.left);
+				buf_push(g->partners[n->binary.left], d);
+			}
+			for (int j = 0; j < nu; ++j)
+				live_add(uses[j]), vr[uses[j]].weight += weight;
+		}
+	}
+#undef live_add
+#undef live_remove
+	if (g->moves) qsort(g->moves, buf_len(g->moves), sizeof(Move), cmp_moves);
+	for (size_t i = 0; i < buf_len(g->moves); ++i) {
+		buf_push(g->partners[g->moves[i].dest], g->moves[i].src);
+		buf_push(g->partners[g->moves[i].src], g->moves[i].dest);
+	}
+	buf_free(live);
+	free(index);
+	free_liveness(&lv);
+	free_cfg(cfg);
+}
+// Briggs' test: the merged node has fewer neighbours that can't be removed on their own than registers.
+static bool can_coalesce(const Graph* g, const VReg* vr, ireg_t a, ireg_t b) {
+	const unsigned k = popcount(vr[a].allowed & vr[b].allowed);
+	unsigned significant = 0;
+	for (int i = 0; i < 2; ++i) {
+		const ireg_t x = i ? b : a, y = i ? a : b;
+		for (size_t j = 0; j < buf_len(g->adj[x]); ++j) {
+			const ireg_t n = g->adj[x][j];
+			const bool both = graph_has(g, y, n);
+			if (i && both) continue;
+			if (buf_len(g->adj[n]) - both >= popcount(vr[n].allowed) && ++significant >= k)
+				return false;
+		}
+	}
+	return k != 0;
+}
+static void coalesce(Graph* g, VReg* vr) {
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i = 0; i < buf_len(g->moves); ++i) {
+			ireg_t a = find_alias(vr, g->moves[i].dest), b = find_alias(vr, g->moves[i].src);
+			if (a == b || graph_has(g, a, b) || !can_coalesce(g, vr, a, b)) continue;
+			if (vr[b].no_spill && !vr[a].no_spill) {
+				const ireg_t t = a;
+				a = b, b = t;
+			}
+			// merge b into a
+			for (size_t j = 0; j < buf_len(g->adj[b]); ++j) {
+				ireg_t* const adj = g->adj[g->adj[b][j]];
+				for (size_t k = 0; k < buf_len(adj); ++k) {
+					if (adj[k] == b) {
+						adj[k] = *buf_last(adj);
+						buf_pop(adj);
+						break;
+					}
+				}
+				graph_add(g, a, g->adj[b][j]);
+			}
+			buf_free(g->adj[b]);
+			for (size_t j = 0; j < buf_len(g->partners[b]); ++j)
+				buf_push(g->partners[a], g->partners[b][j]);
+			vr[a].allowed &= vr[b].allowed;
+			vr[a].weight += vr[b].weight;
+			vr[a].prefer_r0 |= vr[b].prefer_r0;
+			vr[a].no_spill &= vr[b].no_spill;
+			vr[b].alias = a;
+			changed = true;
+		}
+	}
+}
+// Returns false if a temporary didn't get a register.
+static bool color_graph(Graph* g, VReg* vr) {
+	const size_t num = buf_len(vr);
+	unsigned* degree = malloc(num * sizeof(unsigned));
+	bool* removed = calloc(num, sizeof(bool));
+	ireg_t* low = NULL;                 // removable nodes
+	ireg_t* high = NULL;                // candidates for spilling
+	ireg_t* stack = NULL;
+	bool success = true;
+	for (ireg_t r = 0; r < num; ++r) {
+		if (find_alias(vr, r) != r) continue;
+		degree[r] = buf_len(g->adj[r]);
+		if (degree[r] < popcount(vr[r].allowed)) buf_push(low, r);
+		else buf_push(high, r);
+	}
+	for (;;) {
+		while (buf_len(low)) {
+			const ireg_t r = *buf_last(low);
+			buf_pop(low);
+			if (removed[r]) continue;
+			removed[r] = true;
+			buf_push(stack, r);
+			for (size_t j = 0; j < buf_len(g->adj[r]); ++j) {
+				const ireg_t n = g->adj[r][j];
+				if (!removed[n] && degree[n]-- == popcount(vr[n].allowed)) buf_push(low, n);
+			}
+		}
+		ireg_t best = IREG_NONE;
+		size_t k = 0;
+		for (size_t j = 0; j < buf_len(high); ++j) {
+			const ireg_t r = high[j];
+			if (removed[r]) continue;
+			high[k++] = r;
+			if (best == IREG_NONE || (vr[best].no_spill && !vr[r].no_spill)
+			|| (vr[best].no_spill == vr[r].no_spill && vr[r].weight * degree[best] < vr[best].weight * degree[r]))
+				best = r;
+		}
+		if (high) buf__hdr(high)->size = k;
+		if (best == IREG_NONE) break;
+		buf_push(low, best);
+	}
+	while (buf_len(stack)) {
+		const ireg_t r = *buf_last(stack);
+		buf_pop(stack);
+		uint32_t free = vr[r].allowed;
+		for (size_t j = 0; j < buf_len(g->adj[r]); ++j) {
+			const ireg_t c = vr[g->adj[r][j]].color;
+			if (c != IREG_NONE) free &= ~((uint32_t)1 << c);
+		}
+		if (!free) {
+			vr[r].spilled = true;
+			if (vr[r].no_spill) success = false;
+			continue;
+		}
+		ireg_t c = IREG_NONE;
+		for (size_t j = 0; j < buf_len(g->partners[r]) && c == IREG_NONE; ++j) {
+			const ireg_t p = vr[find_alias(vr, g->partners[r][j])].color;
+			if (p != IREG_NONE && ((free >> p) & 1)) c = p;
+		}
+		if (c == IREG_NONE && vr[r].prefer_r0 && (free & 1)) c = 0;
+		if (c == IREG_NONE) for (c = 0; !((free >> c) & 1); ++c);
+		vr[r].color = c;
+	}
+	free(degree);
+	free(removed);
+	buf_free(low);
+	buf_free(high);
+	buf_free(stack);
+	return success;
+}
+
+/// SPILL CODE
+static ireg_t new_temp(VReg** vr) {
+	const ireg_t t = buf_len(*vr);
+	buf_push(*vr, (VReg){ .alias = t, .no_spill = true });
+	return t;
+}
+/*
+ * Gives the spilled registers a stack slot each (coalesced ones share it)
+ * and replaces their occurrences with temporaries that are reloaded right
+ * before and stored right after. With R5 and R6 spilled:
+ * MOVE R5, R3
+ * ADD R6, R5, R4
+ * --------------
+ * SPILL [0], R3
+ * RELOAD R7, [0]
+ * ADD R8, R7, R4
+ * SPILL [1], R8
+ */
+static void insert_spill_code(IUnit* unit, VReg** vr) {
+	const size_t num = buf_len(*vr);
+	unsigned* slot = malloc(num * sizeof(unsigned));
+	INode* nodes = NULL;
+	for (ireg_t r = 0; r < num; ++r)
+		slot[r] = UINT_MAX;
+	for (ireg_t r = 0; r < num; ++r) {
+		const ireg_t a = find_alias(*vr, r);
+		if (!(*vr)[a].spilled) continue;
+		if (slot[a] == UINT_MAX) slot[a] = unit->num_slots++;
+		slot[r] = slot[a];
+	}
+#define spilled(r) ((r) < num && slot[r] != UINT_MAX)
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		INode n = unit->nodes[i];
+		if (n.type == IN_MOVE && (spilled(n.move.dest) || spilled(n.move.src))) {
+			ireg_t src = n.move.src;
+			if (spilled(src) && spilled(n.move.dest) && slot[src] == slot[n.move.dest]) continue;
+			if (spilled(src)) {
+				const ireg_t t = spilled(n.move.dest) ? new_temp(vr) : n.move.dest;
+				buf_push(nodes, (INode){ .type = IN_RELOAD, .spill = { t, slot[src] } });
+				src = t;
+			}
+			if (spilled(n.move.dest))
+				buf_push(nodes, (INode){ .type = IN_SPILL, .spill = { src, slot[n.move.dest] } });
+			continue;
+		}
+		ireg_t* uses[2];
+		ireg_t orig[2], temp[2];
+		const int nu = inode_use_ptrs(&n, uses);
+		for (int j = 0; j < nu; ++j) {
+			orig[j] = *uses[j];
+			if (!spilled(orig[j])) continue;
+			if (j == 1 && orig[0] == orig[1]) {
+				*uses[1] = temp[0];
+				continue;
+			}
+			temp[j] = new_temp(vr);
+			buf_push(nodes, (INode){ .type = IN_RELOAD, .spill = { temp[j], slot[orig[j]] } });
+			*uses[j] = temp[j];
+		}
+		ireg_t* const d = inode_def_ptr(&n);
+		if (d && spilled(*d)) {
+			const unsigned s = slot[*d];
+			*d = new_temp(vr);
+			buf_push(nodes, n);
+			buf_push(nodes, (INode){ .type = IN_SPILL, .spill = { *d, s } });
+		}
+		else buf_push(nodes, n);
+	}
+#undef spilled
+	buf_free(unit->nodes);
+	unit->nodes = nodes;
+	free(slot);
+}
+// Renames the registers to their colours and drops the copies that became no-ops.
+static void apply_colors(IUnit* unit, VReg* vr) {
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		INode* const n = &unit->nodes[i];
+		ireg_t* uses[2];
+		const int nu = inode_use_ptrs(n, uses);
+		for (int j = 0; j < nu; ++j)
+			*uses[j] = vr[find_alias(vr, *uses[j])].color;
+		ireg_t* const d = inode_def_ptr(n);
+		if (d) *d = vr[find_alias(vr, *d)].color;
+		if (n->type == IN_MOVE && n->move.dest == n->move.src) {
+			inode_remove(n);
+			++unit->moves_removed;
+		}
+	}
+	iunit_compact(unit);
+}
+
+#define MAX_COLOR_ROUNDS 8
+void iunit_alloc_regs(IUnit* unit, const IRegInfo* regs, enum RegAlloc how) {
+	ireg_t num_global;
+	VReg* vr = NULL;
+	const ireg_t num = split_ranges(unit, &num_global);
+	for (ireg_t r = 0; r < num; ++r)
+		buf_push(vr, (VReg){ .alias = r, .no_spill = false });
+	// temporaries are never spilled, so every round spills fewer of the others
+	for (unsigned round = 0; how == RA_COLORING; ++round) {
+		Graph g;
+		build_graph(unit, vr, num_global, regs, &g);
+		coalesce(&g, vr);
+		const bool colored = color_graph(&g, vr);
+		free_graph(&g, buf_len(vr));
+		bool spilled = false;
+		for (size_t r = 0; r < buf_len(vr) && !spilled; ++r)
+			spilled = vr[r].spilled;
+		if (!spilled) {
+			apply_colors(unit, vr);
+			buf_free(vr);
+			return;
+		}
+		if (!colored || round + 1 == MAX_COLOR_ROUNDS) break;  // leave the rest to linear scan
+		insert_spill_code(unit, &vr);
+	}
+	size_t* calls = NULL;
+	for (;;) {
+		if (calls) buf__hdr(calls)->size = 0;
+		build_intervals(unit, vr, num_global, &calls);
+		if (linear_scan(unit, vr, calls, regs)) break;
+		insert_spill_code(unit, &vr);
+	}
+	apply_colors(unit, vr);
+	buf_free(vr);
+	buf_free(calls);
+}
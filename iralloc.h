@@ -0,0 +1,27 @@
+#ifndef BENC_IRALLOC_H
+#define BENC_IRALLOC_H
+#include "igen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum RegAlloc {
+	RA_LINEAR,                  // linear scan over live intervals
+	RA_COLORING,                // graph colouring, slower but coalesces more copies
+};
+
+/*
+ * Maps the registers of unit onto the register file of a target.
+ * Registers that don't fit are kept in stack slots, IN_SPILL stores
+ * a register to its slot and IN_RELOAD loads it back right before a use.
+ * The target reserves IUnit.num_slots words in the frame for them.
+ * IUnit.moves_removed counts the copies that the allocation made redundant.
+ */
+void iunit_alloc_regs(IUnit* unit, const IRegInfo* regs, enum RegAlloc how);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_IRALLOC_H
@@ -0,0 +1,314 @@
+#include <string.h>
+#include "issa.h"
+#include "icfg.h"
+#include "iutil.h"
+#include "buf.h"
+
+static void push_unique(size_t** set, size_t x) {
+	for (size_t i = 0; i < buf_len(*set); ++i) {
+		if ((*set)[i] == x) return;
+	}
+	buf_push(*set, x);
+}
+static unsigned max_label(const IUnit* unit) {
+	unsigned max = 0;
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		const INode* n = &unit->nodes[i];
+		if ((n->type == IN_LABEL || is_jump(n->type)) && n->label > max) max = n->label;
+	}
+	return max;
+}
+
+/// SSA CONSTRUCTION
+// The entry block is a merge point as well, if it is the header of a loop.
+static size_t** dominance_frontiers(const CFG* cfg) {
+	size_t** df = calloc(buf_len(cfg->blocks), sizeof(size_t*));
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		if (buf_len(bb->preds) + (b == 0) < 2 || !cfg_reachable(cfg, b)) continue;
+		for (size_t i = 0; i < buf_len(bb->preds); ++i) {
+			if (!cfg_reachable(cfg, bb->preds[i])) continue;
+			for (size_t r = bb->preds[i]; r != bb->idom && r != BLOCK_NONE; r = cfg->blocks[r].idom)
+				push_unique(&df[r], b);
+		}
+	}
+	return df;
+}
+static bool drop_unreachable(IUnit* unit, const CFG* cfg) {
+	bool changed = false;
+	for (size_t b = 0; b < buf_len(cfg->blocks); ++b) {
+		if (cfg_reachable(cfg, b)) continue;
+		for (size_t i = cfg->blocks[b].begin; i < cfg->blocks[b].end; ++i)
+			inode_remove(&unit->nodes[i]), changed = true;
+	}
+	iunit_compact(unit);
+	return changed;
+}
+// Pruned SSA: a register only gets a phi where it is live.
+static void insert_phis(IUnit* unit, const CFG* cfg, ireg_t num) {
+	const size_t num_blocks = buf_len(cfg->blocks);
+	size_t** df = dominance_frontiers(cfg);
+	size_t** defs = calloc(num, sizeof(size_t*));          // blocks that write each register
+	ireg_t** phis = calloc(num_blocks, sizeof(ireg_t*));   // registers that need a phi in each block
+	size_t* placed = calloc(num_blocks, sizeof(size_t));   // r + 1 if block has a phi for r
+	size_t* queued = calloc(num_blocks, sizeof(size_t));
+	size_t* work = NULL;
+	Liveness lv;
+	cfg_liveness(cfg, num, &lv);
+	for (size_t b = 0; b < num_blocks; ++b) {
+		for (size_t i = cfg->blocks[b].begin; i < cfg->blocks[b].end; ++i) {
+			const ireg_t d = inode_def(&unit->nodes[i]);
+			if (d != IREG_NONE && (!defs[d] || *buf_last(defs[d]) != b))
+				buf_push(defs[d], b);
+		}
+	}
+	for (ireg_t r = 0; r < num; ++r) {
+		for (size_t i = 0; i < buf_len(defs[r]); ++i) {
+			queued[defs[r][i]] = r + 1;
+			buf_push(work, defs[r][i]);
+		}
+		while (buf_len(work)) {
+			const size_t b = *buf_last(work);
+			buf_pop(work);
+			for (size_t i = 0; i < buf_len(df[b]); ++i) {
+				const size_t d = df[b][i];
+				if (placed[d] == r + 1 || !regset_has(live_in(&lv, d), r)) continue;
+				placed[d] = r + 1;
+				buf_push(phis[d], r);
+				if (queued[d] != r + 1) queued[d] = r + 1, buf_push(work, d);
+			}
+		}
+	}
+
+	INode* nodes = NULL;
+	for (size_t b = 0; b < num_blocks; ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		size_t i = bb->begin;
+		if (i < bb->end && unit->nodes[i].type == IN_LABEL)
+			buf_push(nodes, unit->nodes[i++]);
+		for (size_t j = 0; j < buf_len(phis[b]); ++j) {
+			INode n = { .type = IN_PHI, .phi = { phis[b][j], NULL } };
+			for (size_t k = 0; k < buf_len(bb->preds); ++k)
+				buf_push(n.phi.args, phis[b][j]);
+			buf_push(nodes, n);
+		}
+		for (; i < bb->end; ++i)
+			buf_push(nodes, unit->nodes[i]);
+	}
+	buf_free(unit->nodes);
+	unit->nodes = nodes;
+
+	for (size_t b = 0; b < num_blocks; ++b) {
+		buf_free(df[b]);
+		buf_free(phis[b]);
+	}
+	for (ireg_t r = 0; r < num; ++r)
+		buf_free(defs[r]);
+	free(df);
+	free(defs);
+	free(phis);
+	free(placed);
+	free(queued);
+	buf_free(work);
+	free_liveness(&lv);
+}
+
+typedef struct Renamer {
+	ireg_t** stacks;            // current SSA names of each original register
+	ireg_t* pushed;             // original registers in the order their stacks were pushed
+	ireg_t next;
+} Renamer;
+static ireg_t new_name(Renamer* rn, ireg_t r) {
+	buf_push(rn->stacks[r], rn->next);
+	buf_push(rn->pushed, r);
+	return rn->next++;
+}
+static ireg_t cur_name(Renamer* rn, ireg_t r) {
+	return buf_len(rn->stacks[r]) ? *buf_last(rn->stacks[r]) : new_name(rn, r);   // undefined value
+}
+static void rename_block(Renamer* rn, const CFG* cfg, size_t b) {
+	const BasicBlock* bb = &cfg->blocks[b];
+	for (size_t i = bb->begin; i < bb->end; ++i) {
+		INode* const n = &cfg->unit->nodes[i];
+		ireg_t* uses[2];
+		const int nu = n->type == IN_PHI ? 0 : inode_use_ptrs(n, uses);
+		for (int j = 0; j < nu; ++j)
+			*uses[j] = cur_name(rn, *uses[j]);
+		ireg_t* const d = inode_def_ptr(n);
+		if (d) *d = new_name(rn, *d);
+	}
+	for (size_t i = 0; i < buf_len(bb->succs); ++i) {
+		const BasicBlock* sb = &cfg->blocks[bb->succs[i]];
+		const size_t j = cfg_pred_index(cfg, bb->succs[i], b);
+		for (size_t k = sb->begin; k < sb->end; ++k) {
+			INode* const n = &cfg->unit->nodes[k];
+			if (n->type == IN_PHI) n->phi.args[j] = cur_name(rn, n->phi.args[j]);
+			else if (n->type != IN_LABEL) break;
+		}
+	}
+}
+// Walks the dominator tree without recursion, long functions make it deep.
+static void rename_regs(const CFG* cfg, ireg_t num) {
+	const size_t num_blocks = buf_len(cfg->blocks);
+	size_t** children = calloc(num_blocks, sizeof(size_t*));
+	size_t* stack = NULL;       // pairs of (block, length of rn.pushed before it or SIZE_MAX)
+	Renamer rn = { calloc(num, sizeof(ireg_t*)), NULL, 0 };
+	for (size_t b = 1; b < num_blocks; ++b) {
+		if (cfg->blocks[b].idom != BLOCK_NONE)
+			buf_push(children[cfg->blocks[b].idom], b);
+	}
+	buf_push(stack, 0);
+	buf_push(stack, SIZE_MAX);
+	while (buf_len(stack)) {
+		const size_t b = stack[buf_len(stack) - 2];
+		const size_t mark = *buf_last(stack);
+		buf_pop(stack);
+		buf_pop(stack);
+		if (mark != SIZE_MAX) {
+			while (buf_len(rn.pushed) > mark) {
+				buf_pop(rn.stacks[*buf_last(rn.pushed)]);
+				buf_pop(rn.pushed);
+			}
+			continue;
+		}
+		buf_push(stack, b);
+		buf_push(stack, buf_len(rn.pushed));
+		rename_block(&rn, cfg, b);
+		for (size_t i = buf_len(children[b]); i; --i) {
+			buf_push(stack, children[b][i - 1]);
+			buf_push(stack, SIZE_MAX);
+		}
+	}
+	for (size_t b = 0; b < num_blocks; ++b)
+		buf_free(children[b]);
+	for (ireg_t r = 0; r < num; ++r)
+		buf_free(rn.stacks[r]);
+	free(children);
+	free(rn.stacks);
+	buf_free(rn.pushed);
+	buf_free(stack);
+}
+void iunit_to_ssa(IUnit* unit) {
+	CFG* cfg = build_cfg(unit);
+	if (drop_unreachable(unit, cfg)) {
+		free_cfg(cfg);
+		cfg = build_cfg(unit);
+	}
+	const ireg_t num = iunit_num_regs(unit);
+	insert_phis(unit, cfg, num);
+	free_cfg(cfg);
+	cfg = build_cfg(unit);
+	rename_regs(cfg, num);
+	free_cfg(cfg);
+}
+
+/// SSA DESTRUCTION
+/*
+ * Emits the parallel copy dst[i] <- src[i] as a sequence of moves.
+ * A copy can go once its destination isn't read by another pending copy,
+ * cycles are broken with a temporary.
+ */
+static void emit_parallel_copy(INode** out, ireg_t* dst, ireg_t* src, size_t num, ireg_t* next) {
+	size_t pending = num;
+	while (pending) {
+		size_t i, j;
+		for (i = 0; i < pending; ++i) {
+			for (j = 0; j < pending && (j == i || src[j] != dst[i]); ++j);
+			if (j == pending) break;
+		}
+		if (i == pending) {
+			const ireg_t tmp = (*next)++;
+			buf_push(*out, (INode){ .type = IN_MOVE, .move = { tmp, dst[0] } });
+			for (j = 1; j < pending; ++j) {
+				if (src[j] == dst[0]) src[j] = tmp;
+			}
+			continue;
+		}
+		if (dst[i] != src[i]) buf_push(*out, (INode){ .type = IN_MOVE, .move = { dst[i], src[i] } });
+		dst[i] = dst[--pending];
+		src[i] = src[pending];
+	}
+}
+/*
+ * Replaces the phis with copies on the incoming edges.
+ * Critical edges get their own block for the copies:
+ * the fall-through edge of a conditional jump right after it,
+ * the taken edge a new label at the end of the unit that jumps to the phi's block.
+ */
+void iunit_from_ssa(IUnit* unit) {
+	CFG* cfg = build_cfg(unit);
+	const size_t num_blocks = buf_len(cfg->blocks);
+	INode** at_end = calloc(num_blocks, sizeof(INode*));   // copies before the block's jump
+	INode** after = calloc(num_blocks, sizeof(INode*));    // copies after the block's jump
+	INode* tail = NULL;
+	ireg_t* dst = NULL;
+	ireg_t* src = NULL;
+	ireg_t next = iunit_num_regs(unit);
+	unsigned lbl = max_label(unit);
+	for (size_t b = 0; b < num_blocks; ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		size_t first = bb->begin;
+		if (first < bb->end && unit->nodes[first].type == IN_LABEL) ++first;
+		if (first >= bb->end || unit->nodes[first].type != IN_PHI || !cfg_reachable(cfg, b)) continue;
+		for (size_t j = 0; j < buf_len(bb->preds); ++j) {
+			const size_t p = bb->preds[j];
+			const BasicBlock* pb = &cfg->blocks[p];
+			if (!cfg_reachable(cfg, p)) continue;
+			if (dst) buf__hdr(dst)->size = buf__hdr(src)->size = 0;
+			for (size_t i = first; i < bb->end && unit->nodes[i].type == IN_PHI; ++i) {
+				buf_push(dst, unit->nodes[i].phi.dest);
+				buf_push(src, unit->nodes[i].phi.args[j]);
+			}
+			INode** out = &at_end[p];
+			if (buf_len(pb->succs) > 1) {
+				INode* const jmp = &unit->nodes[pb->end - 1];
+				if (jmp->label < buf_len(cfg->label_map) && cfg->label_map[jmp->label] == b) {
+					buf_push(tail, (INode){ .type = IN_LABEL, .label = ++lbl });
+					emit_parallel_copy(&tail, dst, src, buf_len(dst), &next);
+					buf_push(tail, (INode){ .type = IN_JMP, .label = jmp->label });
+					jmp->label = lbl;
+					continue;
+				}
+				out = &after[p];
+			}
+			emit_parallel_copy(out, dst, src, buf_len(dst), &next);
+		}
+	}
+
+	INode* nodes = NULL;
+	for (size_t b = 0; b < num_blocks; ++b) {
+		const BasicBlock* bb = &cfg->blocks[b];
+		const bool jumps = bb->begin < bb->end && is_jump(unit->nodes[bb->end - 1].type);
+		for (size_t i = bb->begin; i < bb->end; ++i) {
+			INode* const n = &unit->nodes[i];
+			if (n->type == IN_PHI) {
+				buf_free(n->phi.args);
+				continue;
+			}
+			if (jumps && i == bb->end - 1) {
+				for (size_t k = 0; k < buf_len(at_end[b]); ++k)
+					buf_push(nodes, at_end[b][k]);
+			}
+			buf_push(nodes, *n);
+		}
+		if (!jumps) {
+			for (size_t k = 0; k < buf_len(at_end[b]); ++k)
+				buf_push(nodes, at_end[b][k]);
+		}
+		for (size_t k = 0; k < buf_len(after[b]); ++k)
+			buf_push(nodes, after[b][k]);
+		buf_free(at_end[b]);
+		buf_free(after[b]);
+	}
+	for (size_t k = 0; k < buf_len(tail); ++k)
+		buf_push(nodes, tail[k]);
+	buf_free(unit->nodes);
+	unit->nodes = nodes;
+
+	free(at_end);
+	free(after);
+	buf_free(tail);
+	buf_free(dst);
+	buf_free(src);
+	free_cfg(cfg);
+}
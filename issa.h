@@ -0,0 +1,24 @@
+#ifndef BENC_ISSA_H
+#define BENC_ISSA_H
+#include <stdbool.h>
+#include "igen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * In SSA form every register of an IUnit is written by exactly one node.
+ * IN_PHI nodes at the start of a block (after its label) select the value
+ * that flows in from each predecessor; their args are in the order of
+ * BasicBlock.preds. Passes that work on the SSA form mustn't change the
+ * control flow, the unit can't be translated before iunit_from_ssa().
+ */
+void iunit_to_ssa(IUnit* unit);
+void iunit_from_ssa(IUnit* unit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_ISSA_H
@@ -0,0 +1,136 @@
+#include <string.h>
+#include "istr.h"
+#include "buf.h"
+
+typedef struct Literal {
+	const char* str;
+	uint32_t len;
+	uint32_t index;             // in IStrPool.strs
+} Literal;
+
+// Orders by the reversed strings, so that a string comes right before those that end with it.
+static int cmp_reversed(const void* a, const void* b) {
+	const Literal* x = a;
+	const Literal* y = b;
+	for (size_t i = x->len, j = y->len; i && j; ) {
+		const unsigned char c = x->str[--i], d = y->str[--j];
+		if (c != d) return c < d ? -1 : 1;
+	}
+	return (x->len > y->len) - (x->len < y->len);
+}
+typedef struct Label {
+	uint32_t off;
+	uint32_t num;
+} Label;
+static int cmp_off(const void* a, const void* b) {
+	const uint32_t x = ((const Label*)a)->off, y = ((const Label*)b)->off;
+	return (x > y) - (x < y);
+}
+static bool ends_with(const Literal* s, const Literal* tail) {
+	return s->len >= tail->len && memcmp(s->str + s->len - tail->len, tail->str, tail->len) == 0;
+}
+static uint64_t hash_str(const char* str, size_t len) {
+	uint64_t h = 14695981039346656037u;     // FNV-1a
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)str[i]) * 1099511628211u;
+	return h;
+}
+// Returns the slot of str in pool->table, which is empty if the pool doesn't have it.
+static size_t find(const IStrPool* pool, const char* str, size_t len) {
+	size_t i = hash_str(str, len) & (pool->capacity - 1);
+	for (; pool->table[i]; i = (i + 1) & (pool->capacity - 1)) {
+		const struct IStr* s = &pool->strs[pool->table[i] - 1];
+		if (s->len == len && memcmp(s->str, str, len) == 0) break;
+	}
+	return i;
+}
+static void grow(IStrPool* pool) {
+	const size_t old_cap = pool->capacity;
+	uint32_t* const old = pool->table;
+	pool->capacity = old_cap ? old_cap * 2 : 256;
+	pool->table = calloc(pool->capacity, sizeof(uint32_t));
+	if (!pool->table) abort();
+	for (size_t i = 0; i < old_cap; ++i) {
+		if (!old[i]) continue;
+		const struct IStr* s = &pool->strs[old[i] - 1];
+		pool->table[find(pool, s->str, s->len)] = old[i];
+	}
+	free(old);
+}
+
+unsigned istr_pool_add(IStrPool* pool, const char* str) {
+	assert(!pool->data);
+	if (2 * (buf_len(pool->strs) + 1) > pool->capacity) grow(pool);
+	const size_t len = strlen(str);
+	const size_t i = find(pool, str, len);
+	if (pool->table[i]) return pool->table[i] - 1;
+	char* copy = arena_alloc(&pool->arena, len + 1);
+	if (!copy) abort();
+	memcpy(copy, str, len);
+	buf_push(pool->strs, (struct IStr){ copy, len, 0 });
+	pool->table[i] = buf_len(pool->strs);
+	return buf_len(pool->strs) - 1;
+}
+void istr_pool_build(IStrPool* pool, const IProgram* prog) {
+	for (size_t u = 0; u < buf_len(prog->units); ++u) {
+		const IUnit* unit = prog->units[u];
+		for (size_t i = 0; i < buf_len(unit->nodes); ++i) {
+			if (unit->nodes[i].type == IN_LDS) istr_pool_add(pool, unit->nodes[i].lda.name);
+		}
+	}
+}
+void istr_pool_layout(IStrPool* pool) {
+	if (pool->data || !pool->strs) return;
+	Literal* lits = NULL;
+	for (size_t i = 0; i < buf_len(pool->strs); ++i)
+		buf_push(lits, (Literal){ pool->strs[i].str, pool->strs[i].len, i });
+	qsort(lits, buf_len(lits), sizeof(*lits), cmp_reversed);
+
+	// from the back, every literal either ends the one before it or starts a new run of bytes
+	uint32_t off = 0;
+	for (size_t i = buf_len(lits); i--; ) {
+		if (i + 1 < buf_len(lits) && ends_with(&lits[i + 1], &lits[i]))
+			off += lits[i + 1].len - lits[i].len;
+		else {
+			off = buf_len(pool->data);
+			for (size_t j = 0; j <= lits[i].len; ++j)
+				buf_push(pool->data, lits[i].str[j]);
+		}
+		pool->strs[lits[i].index].off = off;
+	}
+	buf_free(lits);
+}
+uint32_t istr_pool_off(const IStrPool* pool, const char* str) {
+	assert(pool->data);
+	const size_t i = find(pool, str, strlen(str));
+	assert(pool->table[i]);
+	return pool->strs[pool->table[i] - 1].off;
+}
+void istr_pool_print(IStrPool* pool, OBuf* ob) {
+	istr_pool_layout(pool);
+	// equal literals are added once, so no two labels are at the same offset
+	Label* labels = NULL;
+	for (size_t i = 0; i < buf_len(pool->strs); ++i)
+		buf_push(labels, (Label){ pool->strs[i].off, i });
+	if (labels) qsort(labels, buf_len(labels), sizeof(*labels), cmp_off);
+	size_t label = 0;
+	for (size_t i = 0; i < buf_len(pool->data); ++i) {
+		if (label < buf_len(labels) && labels[label].off == i) {
+			if (i) ob_char(ob, '\n');
+			ob_str(ob, "__str");
+			ob_uint(ob, labels[label++].num);
+			ob_str(ob, ": db ");
+		}
+		else ob_str(ob, ", ");
+		ob_hex8(ob, pool->data[i]);
+	}
+	if (pool->data) ob_char(ob, '\n');
+	buf_free(labels);
+}
+void istr_pool_free(IStrPool* pool) {
+	buf_free(pool->strs);
+	free(pool->table);
+	arena_free(&pool->arena);
+	buf_free(pool->data);
+	*pool = (IStrPool){ 0 };
+}
@@ -0,0 +1,45 @@
+#ifndef BENC_ISTR_H
+#define BENC_ISTR_H
+#include "igen.h"
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The string literals of a program, each stored once for all units:
+ * equal literals share their bytes, and so do literals that are the tail
+ * of a longer one, like "World" in "Hello World".
+ * Literals are numbered in the order they are added, literal i has the label __str<i>.
+ * The pool keeps copies, so units can be freed once their literals are added.
+ */
+typedef struct IStrPool {
+	struct IStr {
+		const char* str;        // copy in arena
+		uint32_t len;
+		uint32_t off;           // in data, set by istr_pool_layout()
+	}* strs;                    // buf, literal i
+	uint32_t* table;            // hash table of the index + 1 of strs, 0 if empty
+	size_t capacity;            // of table, a power of two
+	Arena arena;
+	char* data;                 // buf, the literals with their terminating zeros
+} IStrPool;
+
+// Returns the number of the literal str, adds it if the pool doesn't have it yet.
+unsigned istr_pool_add(IStrPool* pool, const char* str);
+// Adds the IN_LDS literals of prog, in the order of the units.
+void istr_pool_build(IStrPool* pool, const IProgram* prog);
+// Puts the literals into data, nothing may be added afterwards.
+void istr_pool_layout(IStrPool* pool);
+// Returns the offset of the literal str in pool->data, it must have been added.
+uint32_t istr_pool_off(const IStrPool* pool, const char* str);
+// Lays the pool out and writes it as NASM data to the current section, with the labels of the literals.
+void istr_pool_print(IStrPool* pool, OBuf* ob);
+void istr_pool_free(IStrPool* pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_ISTR_H
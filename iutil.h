@@ -28,6 +28,7 @@ static bool has_effect(enum INodeType t) {
 	case IN_PUSH:
 	case IN_CALL:
 	case IN_WRITE:
+	case IN_SPILL:
 	case IN_RETURN:
 	case IN_CMP:
 	case IN_LABEL:
@@ -56,53 +57,139 @@ static intmax_t perform_unary(enum INodeType t, intmax_t a) {
 	default:     return 0;
 	}
 }
-static bool is_type(enum INodeType type, int off, INode* n) {
-	if (!n) return false;
-	if (!off) return n->type == type;
-	INode* tmp = n;
-	if (off > 0)
-		for (int i = 0; i < off; ++i) {
-			tmp = tmp->next;
-			if (!tmp) return false;
-		}
-	else
-		for (int i = 0; i < -off; ++i) {
-			tmp = tmp->prev;
-			if (!tmp) return false;
-		}
-	return tmp->type == type;
-}
-static bool is_binary_type(int off, INode* n) {
-	if (!n) return false;
-	if (!off) return is_binary(n->type);
-	INode* tmp = n;
-	if (off > 0)
-		for (int i = 0; i < off; ++i) {
-			tmp = tmp->next;
-			if (!tmp) return false;
-		}
-	else
-		for (int i = 0; i < -off; ++i) {
-			tmp = tmp->prev;
-			if (!tmp) return false;
-		}
-	return is_binary(tmp->type);
-}
-static bool is_unary_type(int off, INode* n) {
-	if (!n) return false;
-	if (!off) return is_unary(n->type);
-	INode* tmp = n;
-	if (off > 0)
-		for (int i = 0; i < off; ++i) {
-			tmp = tmp->next;
-			if (!tmp) return false;
+static bool is_type(IUnit* unit, size_t i, int off, enum INodeType type) {
+	const INode* n = inode_at(unit, i, off);
+	return n && n->type == type;
+}
+static bool is_binary_type(IUnit* unit, size_t i, int off) {
+	const INode* n = inode_at(unit, i, off);
+	return n && is_binary(n->type);
+}
+static bool is_unary_type(IUnit* unit, size_t i, int off) {
+	const INode* n = inode_at(unit, i, off);
+	return n && is_unary(n->type);
+}
+// Returns the field of n that holds the register it writes, or NULL.
+static ireg_t* inode_def_ptr(INode* n) {
+	switch (n->type) {
+	case IN_MOVE:
+	case IN_READ:
+	case IN_NEG:
+	case IN_ADJOFF: return &n->move.dest;
+	case IN_LDC:    return &n->ldc.dest;
+	case IN_ADD:
+	case IN_SUB:
+	case IN_AND:
+	case IN_OR:
+	case IN_XOR:    return n->dkind == IO_REG ? &n->binary.dest : NULL;
+	case IN_LDA:
+	case IN_LDS:    return &n->lda.dest;
+	case IN_CALL:   return &n->fcall.ret;
+	case IN_PHI:    return &n->phi.dest;
+	case IN_RELOAD: return &n->spill.reg;
+	default:        return NULL;
+	}
+}
+// Stores the register of an operand of kind `kind` in uses, if it has one, see enum IOperandKind.
+static int operand_use_ptr(uint8_t kind, ireg_t* field, ireg_t* index, ireg_t* uses[2], int num) {
+	if (kind == IO_REG) uses[num++] = field;
+	else if (kind == IO_FRAME && index && *index != IREG_NONE) uses[num++] = index;
+	return num;
+}
+// Stores the fields of n that hold the registers it reads in uses and returns their number.
+// The arguments of IN_PHI aren't included, they are read on the incoming edges.
+static int inode_use_ptrs(INode* n, ireg_t* uses[2]) {
+	switch (n->type) {
+	case IN_MOVE:
+	case IN_NEG:
+	case IN_ADJOFF: uses[0] = &n->move.src; return 1;
+	case IN_READ:   return operand_use_ptr(n->skind, &n->move.src, &n->move.index, uses, 0);
+	case IN_WRITE:
+	case IN_CMP: {
+		ireg_t* const index = n->type == IN_WRITE ? &n->move.index : NULL;
+		const int num = operand_use_ptr(n->dkind, &n->move.dest, index, uses, 0);
+		return operand_use_ptr(n->skind, &n->move.src, NULL, uses, num);
+	}
+	case IN_ADD:
+	case IN_SUB:
+	case IN_AND:
+	case IN_OR:
+	case IN_XOR: {
+		const int num = operand_use_ptr(n->dkind, &n->binary.left, NULL, uses, 0);
+		return operand_use_ptr(n->skind, &n->binary.right, NULL, uses, num);
+	}
+	case IN_PUSH:   return operand_use_ptr(n->skind, &n->reg, NULL, uses, 0);
+	case IN_SPILL:  uses[0] = &n->spill.reg; return 1;
+	case IN_CALL:   uses[0] = &n->fcall.dest; return 1;
+	case IN_RETURN:
+		if (n->reg == IREG_NONE) return 0;
+		uses[0] = &n->reg;
+		return 1;
+	default:        return 0;
+	}
+}
+// Returns the register written by n, or IREG_NONE.
+static ireg_t inode_def(const INode* n) {
+	const ireg_t* d = inode_def_ptr((INode*)n);
+	return d ? *d : IREG_NONE;
+}
+// Stores the registers read by n in uses and returns their number.
+static int inode_uses(const INode* n, ireg_t uses[2]) {
+	ireg_t* ptrs[2];
+	const int num = inode_use_ptrs((INode*)n, ptrs);
+	for (int i = 0; i < num; ++i)
+		uses[i] = *ptrs[i];
+	return num;
+}
+// Returns the number of registers used by unit, one past the highest one.
+static ireg_t iunit_num_regs(IUnit* unit) {
+	ireg_t num = 0;
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		INode* const n = &unit->nodes[i];
+		ireg_t* uses[2];
+		const int nu = inode_use_ptrs(n, uses);
+		for (int j = 0; j < nu; ++j) {
+			if (*uses[j] >= num) num = *uses[j] + 1;
 		}
-	else
-		for (int i = 0; i < -off; ++i) {
-			tmp = tmp->prev;
-			if (!tmp) return false;
+		if (inode_def(n) != IREG_NONE && inode_def(n) >= num) num = inode_def(n) + 1;
+		if (n->type == IN_PHI) {
+			for (size_t j = 0; j < buf_len(n->phi.args); ++j) {
+				if (n->phi.args[j] >= num) num = n->phi.args[j] + 1;
+			}
 		}
-	return is_unary(tmp->type);
+	}
+	return num;
+}
+static bool inode_uses_reg(const INode* n, ireg_t r) {
+	ireg_t uses[2];
+	const int num = inode_uses(n, uses);
+	for (int i = 0; i < num; ++i) {
+		if (uses[i] == r) return true;
+	}
+	return false;
+}
+static bool is_jump(enum INodeType t) {
+	switch (t) {
+	case IN_JMP:
+	case IN_JE:
+	case IN_JNE:
+	case IN_JG:
+	case IN_JL:  return true;
+	default:     return false;
+	}
+}
+// Whether the value of r after node i is never read.
+// Conservatively assumes r is live at labels and jumps.
+static bool is_dead_after(IUnit* unit, size_t i, ireg_t r) {
+	for (++i; i < inode_count(unit); ++i) {
+		const INode* n = &unit->nodes[i];
+		if (n->type == IN_DEAD) continue;
+		if (inode_uses_reg(n, r)) return false;
+		if (n->type == IN_RETURN) return true;
+		if (n->type == IN_LABEL || is_jump(n->type)) return false;
+		if (inode_def(n) == r) return true;
+	}
+	return true;
 }
 
 
@@ -118,38 +205,38 @@ typedef struct reg_cache_entry {
 	};
 } reg_cache_entry;
 
-#define RCACHE_NUM 64
-static struct reg_cache_entry rcache[RCACHE_NUM] = { 0 };
-static void rcache_invl(ireg_t e) {
+#define RCACHE_NUM 64          // entries of the array the caller passes as rcache
+static void rcache_invl(reg_cache_entry* rcache, ireg_t e) {
 	if (e < RCACHE_NUM) rcache[e].valid = false;
 }
-static void rcache_invlall(void) {
+static void rcache_invlall(reg_cache_entry* rcache) {
 	for (uint8_t i = 0; i < RCACHE_NUM; ++i)
 		rcache[i].valid = false;
 }
-static bool rcache_addrof(ireg_t e, const char* name) {
+static bool rcache_addrof(reg_cache_entry* rcache, ireg_t e, const char* name) {
 	if (e < RCACHE_NUM) {
-		if (rcache[e].valid && rcache[e].type == RCE_ADDROF_NAME && strcmp(name, rcache[e].name) == 0) return true;
+		if (rcache[e].valid && rcache[e].type == RCE_ADDROF_NAME && rcache[e].name == name) return true;
 		rcache[e].valid = true;
 		rcache[e].type = RCE_ADDROF_NAME;
 		rcache[e].name = name;
 	}
 	return false;
 }
-static bool rcache_write(ireg_t e, const char* name) {
+static bool rcache_write(reg_cache_entry* rcache, ireg_t e, const char* name) {
 	if (e < RCACHE_NUM) {
-		if (rcache[e].valid && rcache[e].type == RCE_NAME && strcmp(name, rcache[e].name) == 0) return true;
+		if (rcache[e].valid && rcache[e].type == RCE_NAME && rcache[e].name == name) return true;
 		rcache[e].valid = true;
 		rcache[e].type = RCE_NAME;
 		rcache[e].name = name;
 	}
 	return false;
 }
-static bool rcache_move(ireg_t d, ireg_t s) {
+static bool rcache_move(reg_cache_entry* rcache, ireg_t d, ireg_t s) {
 	if (d < RCACHE_NUM && s < RCACHE_NUM && rcache[s].valid) {
 		rcache[d].valid = true;
 		rcache[d].type = rcache[s].type;
 		switch (rcache[s].type) {
+		case RCE_ADDROF_NAME:
 		case RCE_NAME:  rcache[d].name = rcache[s].name; break;
 		case RCE_IMM:   rcache[d].value = rcache[s].value; break;
 		}
@@ -157,19 +244,29 @@ static bool rcache_move(ireg_t d, ireg_t s) {
 	}
 	return false;
 }
-static ireg_t rcache_read(ireg_t x, const char* name) {
-	if (x >= RCACHE_NUM) return 0xffff;
-	if (rcache[x].valid && (rcache[x].type = RCE_NAME) && strcmp(rcache[x].name, name) == 0) return x;
+static ireg_t rcache_read(reg_cache_entry* rcache, ireg_t x, const char* name) {
+	if (x >= RCACHE_NUM) return IREG_NONE;
+	if (rcache[x].valid && rcache[x].type == RCE_NAME && rcache[x].name == name) return x;
 	rcache[x].valid = true;
 	rcache[x].type = RCE_NAME;
 	rcache[x].name = name;
 	for (size_t i = 0; i < RCACHE_NUM; ++i) {
-		if (rcache[i].valid && i != x && rcache[i].type == RCE_NAME && strcmp(name, rcache[i].name) == 0)
+		if (rcache[i].valid && i != x && rcache[i].type == RCE_NAME && rcache[i].name == name)
 			return i;
 	}
-	return 0xffff;
+	return IREG_NONE;
+}
+static void rcache_invlnames(reg_cache_entry* rcache) {     // after a store through an unknown address
+	for (uint8_t i = 0; i < RCACHE_NUM; ++i) {
+		if (rcache[i].type == RCE_NAME) rcache[i].valid = false;
+	}
+}
+static void rcache_invlname(reg_cache_entry* rcache, const char* name) {
+	for (uint8_t i = 0; i < RCACHE_NUM; ++i) {
+		if (rcache[i].type == RCE_NAME && rcache[i].name == name) rcache[i].valid = false;
+	}
 }
-static bool rcache_ldc(ireg_t x, intmax_t val) {
+static bool rcache_ldc(reg_cache_entry* rcache, ireg_t x, intmax_t val) {
 	if (x >= RCACHE_NUM) return false;
 	if (rcache[x].valid && rcache[x].type == RCE_IMM && rcache[x].value == val) return true;
 	rcache[x].valid = true;
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <stdnoreturn.h>
+#include <string.h>
+#include <dlfcn.h>
+#include "ivm.h"
+#include "iutil.h"
+#include "ifold.h"
+#include "diag.h"
+
+#define IVM_REGS  (1 << 20)
+#define IVM_STACK (1 << 20)
+
+noreturn static void fail(const char* msg) {
+	fprintf(diag_out(), "ivm: %s\n", msg);
+	diag_fatal();
+}
+
+// Returns the address of the function or extern name, or 0.
+static intmax_t resolve(const IVm* vm, const char* name) {
+	for (size_t i = 0; i < vm->num_funcs; ++i) {
+		if (vm->funcs[i].name == name) return (intmax_t)(intptr_t)&vm->funcs[i];
+	}
+	return (intmax_t)(intptr_t)dlsym(RTLD_DEFAULT, name);
+}
+// Nodes without an instruction.
+static bool skipped(enum INodeType type) {
+	return type == IN_NOP || type == IN_DEAD || type == IN_BEG_STMT || type == IN_END_STMT;
+}
+static bool translate(IVm* vm, IVmFunc* fn, IUnit* unit, const char** undefined) {
+	size_t* labels = NULL;      // label -> index of the next instruction
+	size_t num = 0;
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		const INode* n = &unit->nodes[i];
+		if (n->type == IN_LABEL) {
+			while (buf_len(labels) <= n->label) buf_push(labels, 0);
+			labels[n->label] = num;
+		}
+		else if (!skipped(n->type)) ++num;
+	}
+	fn->name = unit->name;
+	fn->num_regs = iunit_num_regs(unit);
+	fn->num_decls = buf_len(unit->decls);
+	fn->decls = unit->decls;
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		const INode* n = &unit->nodes[i];
+		IVmInsn in = { .op = n->type, .a = IREG_NONE, .b = IREG_NONE, .c = IREG_NONE };
+		ireg_t frame;
+		switch (n->type) {
+		case IN_NOP:
+		case IN_DEAD:
+		case IN_BEG_STMT:
+		case IN_END_STMT:
+		case IN_LABEL:  continue;
+		case IN_LDC:    in.a = n->ldc.dest; in.k = n->ldc.num; break;
+		case IN_LDA:
+			in.a = n->lda.dest;
+			frame = iunit_frame_index(unit, n->lda.name);
+			if (frame == IREG_NONE) in.k = resolve(vm, n->lda.name);
+			else if (frame < buf_len(unit->paramnames)) in.op = IVM_LDF, in.k = frame;
+			else in.op = IVM_LDF, in.k = -(intmax_t)(frame - buf_len(unit->paramnames)) - 1;
+			if (frame == IREG_NONE && !in.k) {
+				*undefined = n->lda.name;
+				buf_free(labels);
+				return false;
+			}
+			break;
+		case IN_LDS:    in.a = n->lda.dest; in.k = (intmax_t)(intptr_t)n->lda.name; break;
+		case IN_ADD:
+		case IN_SUB:
+		case IN_AND:
+		case IN_OR:
+		case IN_XOR:    in.a = n->binary.dest; in.b = n->binary.left; in.c = n->binary.right; break;
+		case IN_MOVE:
+		case IN_NEG:
+		case IN_ADJOFF:
+		case IN_READ:
+		case IN_WRITE:
+		case IN_CMP:    in.a = n->move.dest; in.b = n->move.src; break;
+		case IN_PUSH:
+		case IN_RETURN: in.a = n->reg; break;
+		case IN_CALL:   in.a = n->fcall.ret; in.b = n->fcall.dest; in.pcount = n->fcall.pcount; break;
+		case IN_JMP:
+		case IN_JE:
+		case IN_JNE:
+		case IN_JG:
+		case IN_JL:     in.a = labels[n->label]; break;
+		default:        fail("unsupported instruction");
+		}
+		buf_push(fn->code, in);
+	}
+	buf_push(fn->code, (IVmInsn){ .op = IN_RETURN, .a = IREG_NONE });  // falling off the end
+	buf_free(labels);
+	return true;
+}
+
+IVm* ivm_load(const IProgram* prog, const char** undefined) {
+	IVm* vm = alloc(IVm);
+	vm->num_funcs = buf_len(prog->units);
+	vm->funcs = calloc(vm->num_funcs + 1, sizeof(IVmFunc));
+	for (size_t i = 0; i < vm->num_funcs; ++i)
+		vm->funcs[i].name = prog->units[i]->name;
+	for (size_t i = 0; i < vm->num_funcs; ++i) {
+		if (!translate(vm, &vm->funcs[i], prog->units[i], undefined)) {
+			ivm_free(vm);
+			return NULL;
+		}
+	}
+	vm->num_regs = IVM_REGS;
+	vm->regs = vm->rp = malloc(IVM_REGS * sizeof(intmax_t));
+	vm->stack_size = IVM_STACK;
+	vm->stack = malloc(IVM_STACK * sizeof(intmax_t));
+	return vm;
+}
+
+#define ARGS4(i)   a[i], a[i + 1], a[i + 2], a[i + 3]
+#define ARGS16(i)  ARGS4(i), ARGS4(i + 4), ARGS4(i + 8), ARGS4(i + 12)
+#define ARGS64(i)  ARGS16(i), ARGS16(i + 16), ARGS16(i + 32), ARGS16(i + 48)
+#define ARGS255    ARGS64(0), ARGS64(64), ARGS64(128), ARGS16(192), ARGS16(208), ARGS16(224), \
+	ARGS4(240), ARGS4(244), ARGS4(248), a[252], a[253], a[254]
+static intmax_t call_native(intmax_t addr, const intmax_t* args, unsigned n) {
+	intmax_t (*f)() = (intmax_t(*)())(intptr_t)addr;
+	const intmax_t* a = args;
+	switch (n) {
+	case 0:  return f();
+	case 1:  return f(a[0]);
+	case 2:  return f(a[0], a[1]);
+	case 3:  return f(a[0], a[1], a[2]);
+	case 4:  return f(a[0], a[1], a[2], a[3]);
+	case 5:  return f(a[0], a[1], a[2], a[3], a[4]);
+	case 6:  return f(a[0], a[1], a[2], a[3], a[4], a[5]);
+	case 7:  return f(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+	case 8:  return f(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+	case 9:  return f(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8]);
+	case 10: return f(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9]);
+	default: break;
+	}
+	// the caller removes the arguments on i386 and x86_64, so passing as many words as
+	// a call can have (IN_CALL's pcount is 8 bits) works for any function
+	intmax_t words[255] = { 0 };
+	memcpy(words, args, n * sizeof(*words));
+	a = words;
+	return f(ARGS255);
+}
+#undef ARGS4
+#undef ARGS16
+#undef ARGS64
+#undef ARGS255
+// Runs fn with its arguments at fp, dispatching with computed gotos on the opcodes.
+static intmax_t exec(IVm* vm, const IVmFunc* fn, intmax_t* fp) {
+	static const void* const ops[NUM_INODES + 1] = {
+		[IN_NOP] = &&op_nop, [IN_MOVE] = &&op_move, [IN_LDC] = &&op_ldc, [IN_ADD] = &&op_add,
+		[IN_SUB] = &&op_sub, [IN_AND] = &&op_and, [IN_OR] = &&op_or, [IN_XOR] = &&op_xor,
+		[IN_NEG] = &&op_neg, [IN_LDA] = &&op_ldc, [IN_CALL] = &&op_call, [IN_READ] = &&op_read,
+		[IN_WRITE] = &&op_write, [IN_PUSH] = &&op_push, [IN_ADJOFF] = &&op_adjoff,
+		[IN_RETURN] = &&op_return, [IN_CMP] = &&op_cmp, [IN_LABEL] = &&op_nop, [IN_JMP] = &&op_jmp,
+		[IN_JE] = &&op_je, [IN_JNE] = &&op_jne, [IN_JG] = &&op_jg, [IN_JL] = &&op_jl,
+		[IN_LDS] = &&op_ldc, [IN_PHI] = &&op_nop, [IN_SPILL] = &&op_nop, [IN_RELOAD] = &&op_nop,
+		[IVM_LDF] = &&op_ldf,
+	};
+	intmax_t* const r = vm->rp;
+	intmax_t* sp = fp - fn->num_decls;
+	if (r + fn->num_regs > vm->regs + vm->num_regs || sp < vm->stack) fail("stack overflow");
+	vm->rp += fn->num_regs;
+	for (size_t i = 0; i < fn->num_decls; ++i)
+		fp[-1 - (intptr_t)i] = fn->decls[i].has_value ? fn->decls[i].value : 0;
+
+	const IVmInsn* const code = fn->code;
+	const IVmInsn* ip = code;
+	uint64_t steps = 0;
+	intmax_t lhs = 0, rhs = 0, ret;
+#define DISPATCH() do { ++steps; goto *ops[ip->op]; } while (0)
+#define NEXT()     do { ++ip; DISPATCH(); } while (0)
+#define JUMP(c)    do { if (c) { ip = code + ip->a; DISPATCH(); } NEXT(); } while (0)
+	DISPATCH();
+
+op_nop:     NEXT();
+op_move:    r[ip->a] = r[ip->b]; NEXT();
+op_ldc:     r[ip->a] = ip->k; NEXT();
+op_ldf:     r[ip->a] = (intmax_t)(intptr_t)(fp + ip->k); NEXT();
+op_add:     r[ip->a] = r[ip->b] + r[ip->c]; NEXT();
+op_sub:     r[ip->a] = r[ip->b] - r[ip->c]; NEXT();
+op_and:     r[ip->a] = r[ip->b] & r[ip->c]; NEXT();
+op_or:      r[ip->a] = r[ip->b] | r[ip->c]; NEXT();
+op_xor:     r[ip->a] = r[ip->b] ^ r[ip->c]; NEXT();
+op_neg:     r[ip->a] = -r[ip->b]; NEXT();
+op_adjoff:  r[ip->a] = r[ip->b] * (intmax_t)sizeof(intmax_t); NEXT();
+op_read:    r[ip->a] = *(intmax_t*)(intptr_t)r[ip->b]; NEXT();
+op_write:   *(intmax_t*)(intptr_t)r[ip->a] = r[ip->b]; NEXT();
+op_push:
+	if (sp == vm->stack) fail("stack overflow");
+	*--sp = r[ip->a];
+	NEXT();
+op_cmp:     lhs = r[ip->a]; rhs = r[ip->b]; NEXT();
+op_jmp:     ip = code + ip->a; DISPATCH();
+op_je:      JUMP(lhs == rhs);
+op_jne:     JUMP(lhs != rhs);
+op_jg:      JUMP(lhs > rhs);
+op_jl:      JUMP(lhs < rhs);
+op_call: {
+	const intmax_t callee = r[ip->b];
+	const IVmFunc* f = (const IVmFunc*)(intptr_t)callee;
+	vm->steps += steps;
+	steps = 0;
+	if (f >= vm->funcs && f < vm->funcs + vm->num_funcs) ret = exec(vm, f, sp);
+	else ret = call_native(callee, sp, ip->pcount);
+	sp += ip->pcount;
+	r[ip->a] = ret;
+	NEXT();
+}
+op_return:
+	ret = ip->a == IREG_NONE ? 0 : r[ip->a];
+	vm->steps += steps;
+	vm->rp = r;
+	return ret;
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+}
+
+bool ivm_call(IVm* vm, const char* name, intmax_t* ret) {
+	for (size_t i = 0; i < vm->num_funcs; ++i) {
+		if (strcmp(vm->funcs[i].name, name) == 0) {
+			*ret = exec(vm, &vm->funcs[i], vm->stack + vm->stack_size);
+			return true;
+		}
+	}
+	return false;
+}
+void ivm_free(IVm* vm) {
+	for (size_t i = 0; i < vm->num_funcs; ++i)
+		buf_free(vm->funcs[i].code);
+	free(vm->funcs);
+	free(vm->regs);
+	free(vm->stack);
+	free(vm);
+}
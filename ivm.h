@@ -0,0 +1,51 @@
+#ifndef BENC_IVM_H
+#define BENC_IVM_H
+#include "igen.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IVM_LDF NUM_INODES      // address of the word k of the frame, IN_LDA of a parameter or local
+
+typedef struct IVmInsn {        // bytecode of an INode
+	uint8_t op;                 // enum INodeType or IVM_LDF
+	uint8_t pcount;             // of IN_CALL
+	ireg_t a, b, c;             // the registers in the order of INode, the target of jumps in a
+	intmax_t k;                 // IN_LDC, the address of IN_LDA and IN_LDS, the word of IVM_LDF
+} IVmInsn;
+typedef struct IVmFunc {
+	const char* name;
+	IVmInsn* code;              // buf
+	ireg_t num_regs;
+	size_t num_decls;
+	const struct VarDecl* decls;
+} IVmFunc;
+/*
+ * Runs the bytecode of an IProgram, without register allocation.
+ * Words are intmax_t and frames are laid out like on i386: the parameters
+ * at fp[0], fp[1], ... as pushed by the caller and the locals at fp[-1], fp[-2], ...
+ * Addresses are real pointers, so extern functions are called directly.
+ */
+typedef struct IVm {
+	IVmFunc* funcs;             // one per unit
+	size_t num_funcs;
+	intmax_t* regs;             // register windows of the active calls
+	intmax_t* rp;
+	size_t num_regs;
+	intmax_t* stack;            // frames and arguments, grows down
+	size_t stack_size;
+	uint64_t steps;             // instructions executed
+} IVm;
+
+// Translates prog to bytecode. Externs are resolved with dlsym(), returns NULL and sets *undefined if one is missing.
+IVm* ivm_load(const IProgram* prog, const char** undefined);
+// Calls the function name without arguments and stores its result in ret, returns false if there's none.
+bool ivm_call(IVm* vm, const char* name, intmax_t* ret);
+void ivm_free(IVm* vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_IVM_H
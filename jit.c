@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include "jit.h"
+#include "buf.h"
+
+#if defined(__x86_64__)
+#define HOST_MACHINE EM_X86_64
+#else
+#define HOST_MACHINE EM_NONE
+#endif
+
+#define align(n, a) (((n) + (a) - 1) / (a) * (a))
+
+static size_t rodata_off(const ElfObject* obj) {
+	return align(buf_len(obj->text), 16);
+}
+static uint8_t* sym_addr(const Jit* jit, const ElfObject* obj, const ElfSym* s) {
+	switch (s->section) {
+	case ELF_TEXT:   return jit->mem + s->value;
+	case ELF_RODATA: return jit->mem + rodata_off(obj) + s->value;
+	default:         return dlsym(RTLD_DEFAULT, s->name);
+	}
+}
+
+enum JitError jit_load(Jit* jit, const ElfObject* obj, const char** undefined) {
+	if (obj->machine != HOST_MACHINE) return JIT_MACHINE;
+	// one GOT entry for every symbol whose address is loaded from it
+	size_t* got = malloc((buf_len(obj->syms) + 1) * sizeof(size_t));
+	size_t num_got = 0;
+	for (size_t i = 0; i < buf_len(obj->syms); ++i)
+		got[i] = SIZE_MAX;
+	for (size_t i = 0; i < buf_len(obj->relas); ++i) {
+		const ElfRela* r = &obj->relas[i];
+		if (r->type == R_X86_64_GOTPCREL && got[r->sym] == SIZE_MAX) got[r->sym] = num_got++;
+	}
+	const size_t got_off = align(rodata_off(obj) + buf_len(obj->rodata), 8);
+	jit->size = got_off + num_got * 8;
+	jit->mem = mmap(NULL, jit->size ? jit->size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->mem == MAP_FAILED) {
+		jit->mem = NULL;
+		free(got);
+		return JIT_NOMEM;
+	}
+	if (obj->text) memcpy(jit->mem, obj->text, buf_len(obj->text));
+	if (obj->rodata) memcpy(jit->mem + rodata_off(obj), obj->rodata, buf_len(obj->rodata));
+
+	enum JitError err = JIT_OK;
+	uint64_t* const slots = (uint64_t*)(jit->mem + got_off);
+	for (size_t i = 0; i < buf_len(obj->syms) && !err; ++i) {
+		if (got[i] == SIZE_MAX) continue;
+		slots[got[i]] = (uint64_t)sym_addr(jit, obj, &obj->syms[i]);
+		if (!slots[got[i]]) err = JIT_UNDEFINED, *undefined = obj->syms[i].name;
+	}
+	for (size_t i = 0; i < buf_len(obj->relas) && !err; ++i) {
+		const ElfRela* r = &obj->relas[i];
+		uint8_t* const p = jit->mem + r->offset;
+		const uint8_t* s = r->type == R_X86_64_GOTPCREL ? (uint8_t*)&slots[got[r->sym]] : sym_addr(jit, obj, &obj->syms[r->sym]);
+		const int64_t v = (int64_t)(s + r->addend - p);
+		if (!s) err = JIT_UNDEFINED, *undefined = obj->syms[r->sym].name;
+		else if (v != (int32_t)v) err = JIT_NOMEM;     // out of the reach of rel32
+		else {
+			const int32_t v32 = v;
+			memcpy(p, &v32, 4);
+		}
+	}
+	free(got);
+	if (!err && mprotect(jit->mem, jit->size ? jit->size : 1, PROT_READ | PROT_EXEC) != 0) err = JIT_NOMEM;
+	if (err) jit_free(jit);
+	return err;
+}
+void* jit_symbol(const Jit* jit, const ElfObject* obj, const char* name) {
+	for (size_t i = 0; i < buf_len(obj->syms); ++i) {
+		if (obj->syms[i].section == ELF_TEXT && strcmp(obj->syms[i].name, name) == 0)
+			return jit->mem + obj->syms[i].value;
+	}
+	return NULL;
+}
+void jit_free(Jit* jit) {
+	if (jit->mem) munmap(jit->mem, jit->size ? jit->size : 1);
+	jit->mem = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef BENC_JIT_H
+#define BENC_JIT_H
+#include "elfobj.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum JitError {
+	JIT_OK,
+	JIT_MACHINE,                // the code isn't for this machine
+	JIT_UNDEFINED,              // a symbol isn't defined in the object nor in the running process
+	JIT_NOMEM,
+};
+typedef struct Jit {
+	uint8_t* mem;               // .text, .rodata and the GOT
+	size_t size;
+} Jit;
+
+/*
+ * Copies the sections of obj to executable memory and applies its relocations.
+ * Undefined symbols are looked up in the running process with dlsym(),
+ * on JIT_UNDEFINED *undefined is set to the name of the one that wasn't found.
+ */
+enum JitError jit_load(Jit* jit, const ElfObject* obj, const char** undefined);
+// Returns the address of the defined symbol name, or NULL.
+void* jit_symbol(const Jit* jit, const ElfObject* obj, const char* name);
+void jit_free(Jit* jit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_JIT_H
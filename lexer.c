@@ -1,57 +1,94 @@
+#include <stdnoreturn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include "lexer.h"
+#include "diag.h"
 #include "buf.h"
 
-static FILE* file = NULL;
-static int peekd = '\0';
-static Token token_peekd = { 0 };
-static size_t row, col;
-
-static int read(void) {
-	const int ch = fgetc(file);
-	if (ch == '\n') ++row, col = 0;
-	else ++col;
+static int peek(const Lexer* lx) {
+	return lx->pos < lx->len ? (unsigned char)lx->src[lx->pos] : EOF;
+}
+static int next(Lexer* lx) {
+	if (lx->pos >= lx->len) return EOF;
+	const int ch = (unsigned char)lx->src[lx->pos++];
+	if (ch == '\n') buf_push(lx->lines, lx->pos);
 	return ch;
 }
-static int peek(void) {
-	return peekd ? peekd : (peekd = read());
+
+static void lexer_reset(Lexer* lx, const char* buf, size_t len, bool mapped) {
+	lx->src = buf;
+	lx->len = len;
+	lx->mapped = mapped;
+	lx->pos = 0;
+	lx->lines = NULL;
+	buf_push(lx->lines, 0);
+	lx->peekd.type = TK_DUMMY;
+}
+bool lexer_init(Lexer* lx, FILE* f) {
+	char* buf = NULL;
+	size_t len = 0, cap = 0, n;
+	do {
+		if (len == cap) {
+			char* tmp = realloc(buf, cap = cap ? cap * 2 : 4096);
+			if (!tmp) return free(buf), false;
+			buf = tmp;
+		}
+		n = fread(buf + len, 1, cap - len, f);
+		len += n;
+	} while (n);
+	if (ferror(f)) return free(buf), false;
+	lexer_reset(lx, buf, len, false);
+	return true;
 }
-static int next(void) {
-	if (peekd) {
-		const int tmp = peekd;
-		peekd = '\0';
-		return tmp;
+bool lexer_open(Lexer* lx, const char* path) {
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	void* map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		// not mappable (empty file, pipe, ...), fall back to reading it
+		FILE* f = fdopen(fd, "r");
+		if (!f) return close(fd), false;
+		const bool success = lexer_init(lx, f);
+		fclose(f);
+		return success;
 	}
-	else return read();
+	close(fd);
+	lexer_reset(lx, map, st.st_size, true);
+	return true;
 }
-
-void lexer_init(FILE* f) {
-	lexer_free();
-	file = f;
-	peekd = '\0';
-	row = col = 0;
-	token_peekd.type = TK_DUMMY;
-}
-void lexer_free(void) {
-	if (file) fclose(file);
-}
-static Token lexer_impl(void);
-Token lexer_peek(void) {
-	return token_peekd.type ? token_peekd : (token_peekd = lexer_impl());
-}
-Token lexer_next(void) {
-	if (token_peekd.type) {
-		const Token tk = token_peekd;
-		token_peekd.type = TK_DUMMY;
+void lexer_free(Lexer* lx) {
+	if (!lx->src) return;
+	buf_free(lx->lines);
+	if (lx->mapped) munmap((void*)lx->src, lx->len);
+	else free((void*)lx->src);
+	lx->src = NULL;
+	lx->len = 0;
+}
+static Token lexer_impl(Lexer* lx);
+Token lexer_peek(Lexer* lx) {
+	return lx->peekd.type ? lx->peekd : (lx->peekd = lexer_impl(lx));
+}
+Token lexer_next(Lexer* lx) {
+	if (lx->peekd.type) {
+		const Token tk = lx->peekd;
+		lx->peekd.type = TK_DUMMY;
 		return tk;
 	}
-	else return lexer_impl();
+	else return lexer_impl(lx);
 }
-bool lexer_eof(void) {
-	while (isspace(peek())) next();
-	return peek() == EOF;
+bool lexer_eof(Lexer* lx) {
+	if (lx->peekd.type) return lx->peekd.type == TK_EOF;
+	while (isspace(peek(lx))) next(lx);
+	return peek(lx) == EOF;
 }
 
 static int escape_char(int ch) {
@@ -79,115 +116,140 @@ const char* tk_names[NUM_TOKEN_TYPES] = {
 	"if", "var", "else", "func", "while",
 	"return", "extern", "dummy",
 };
-static bool strieq(const char* s1, const char* s2) {
-	const size_t len = strlen(s1);
-	if (len != strlen(s2)) return false;
+/*
+ * Perfect hash over the keywords in tk_names: (4 * length + lower(first char)) % 16.
+ * Every identifier costs one hash and at most one case-insensitive compare.
+ */
+#define kw_hash(s, len) ((4 * (len) + ((s)[0] | 0x20)) & 15)
+static const enum TokenType kw_table[16] = {
+	[1] = KW_IF, [2] = KW_VAR, [5] = KW_ELSE, [6] = KW_FUNC,
+	[10] = KW_RETURN, [11] = KW_WHILE, [13] = KW_EXTERN,
+};
+static enum TokenType keyword(const char* s, size_t len) {
+	const enum TokenType kw = kw_table[kw_hash(s, len)];
+	if (!kw) return TK_NAME;
+	const char* name = tk_names[kw];
 	for (size_t i = 0; i < len; ++i) {
-		if (toupper(s1[i]) != toupper(s2[i])) return false;
+		if (!name[i] || toupper(name[i]) != toupper(s[i])) return TK_NAME;
 	}
-	return true;
+	return name[len] ? TK_NAME : kw;
 }
 void print_token(const Token tk, FILE* f) {
 	switch (tk.type) {
 	case TK_INTEGER:    fprintf(f, "%ju", tk.num); break;
-	case TK_NAME:       fputs(tk.text, f); break;
-	case TK_STRING:     fprintf(f, "\"%s\"", tk.text); break;
+	case TK_NAME:       fwrite(tk.text, 1, tk.len, f); break;
+	case TK_STRING:     fprintf(f, "\"%.*s\"", (int)tk.len, tk.text); break;
 	default:            fputs(tk_names[tk.type], f); break;
 	}
 }
 void print_token_info(const Token tk, FILE* f) {
-	fprintf(f, "Token{ .type=%s, .row=%zu, .col=%zu", tk_names[tk.type], tk.row, tk.col);
+	fprintf(f, "Token{ .type=%s, .pos=%u", tk_names[tk.type], tk.pos);
 	switch (tk.type) {
-	case TK_NAME:       fprintf(f, ", .name='%s'", tk.text); break;
+	case TK_NAME:       fprintf(f, ", .name='%.*s'", (int)tk.len, tk.text); break;
 	case TK_INTEGER:    fprintf(f, ", .value=%ju", tk.num); break;
 	default:            break;
 	}
 	fputs(" }", f);
 }
+void locate(const uint32_t* lines, uint32_t pos, size_t* row, size_t* col) {
+	size_t lo = 0, hi = buf_len(lines);
+	while (hi - lo > 1) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (lines[mid] <= pos) lo = mid;
+		else hi = mid;
+	}
+	*row = lo;
+	*col = pos - (lines ? lines[lo] : 0);
+}
+noreturn static void lexer_error(const Lexer* lx, uint32_t pos, const char* msg, ...) {
+	va_list ap;
+	size_t row, col;
+	locate(lx->lines, pos, &row, &col);
+	va_start(ap, msg);
+	FILE* const out = diag_out();
+	fprintf(out, "%zu:%zu: ", row, col);
+	vfprintf(out, msg, ap);
+	fputc('\n', out);
+	va_end(ap);
+	diag_fatal();
+}
+char* lexer_string(const Token tk) {
+	char* buf = NULL;
+	for (size_t i = 0; i < tk.len; ++i) {
+		if (tk.text[i] == '\\') buf_push(buf, escape_char(tk.text[++i]));
+		else buf_push(buf, tk.text[i]);
+	}
+	buf_push(buf, 0);
+	return buf;
+}
 
 inline static bool isname(int ch) {
 	return isalnum(ch) || (ch == '_');
 }
-static Token lexer_impl(void) {
-	while (isspace(peek())) next();
-	int ch = peek();
+static Token lexer_impl(Lexer* lx) {
+	while (isspace(peek(lx))) next(lx);
+	int ch = peek(lx);
 	if (isdigit(ch)) {
-		const size_t r = row, c = col;
+		const uint32_t begin = lx->pos;
 		uintmax_t num = 0;
-		while (isdigit(peek())) num = num * 10 + (next() - '0');
-		return (Token){ TK_INTEGER, r, c, num };
+		while (isdigit(peek(lx))) num = num * 10 + (next(lx) - '0');
+		return (Token){ TK_INTEGER, begin, num };
 	}
 	else if (isalpha(ch) || ch == '_') {
-		const size_t r = row, c = col;
-		char* buf = NULL;
-		while (isname(peek())) buf_push(buf, next());
-		buf_push(buf, 0);
-		for (size_t i = 0; i < NUM_KEYWORDS; ++i) {
-			if (strieq(tk_names[i + KW_IF], buf))
-				return (Token){ i + KW_IF, r, c, i };
-		}
-		char* str = malloc(buf_len(buf));
-		strncpy(str, buf, buf_len(buf));
-		buf_free(buf);
-		return (Token){ TK_NAME, r, c, .text = str };
+		const uint32_t begin = lx->pos;
+		while (isname(peek(lx))) next(lx);
+		const enum TokenType kw = keyword(lx->src + begin, lx->pos - begin);
+		if (kw != TK_NAME) return (Token){ kw, begin, kw - KW_IF };
+		return (Token){ TK_NAME, begin, .text = lx->src + begin, .len = lx->pos - begin };
 	}
 	else if (ch == '"') {
-		const size_t r = row, c = col;
-		char* buf = NULL;
-		next();
-		while ((ch = next()) != '"') {
-			if (ch == EOF) {
-				fprintf(stderr, "%zu:%zu: unterminated string\n", r, c);
-				exit(1);
-			}
-			else if (ch == '\\') buf_push(buf, escape_char(next()));
-			else buf_push(buf, ch);
+		const uint32_t quote = lx->pos;
+		next(lx);
+		const uint32_t begin = lx->pos;
+		while ((ch = next(lx)) != '"') {
+			if (ch == EOF) lexer_error(lx, quote, "unterminated string");
+			else if (ch == '\\') next(lx);
 		}
-		buf_push(buf, 0);
-		return (Token) { TK_STRING, r, c, .text = buf };
+		return (Token){ TK_STRING, quote, .text = lx->src + begin, .len = lx->pos - begin - 1 };
 	}
 	else if (ch == '\'') {
-		next();
-		ch = next();
+		const uint32_t begin = lx->pos;
+		next(lx);
+		ch = next(lx);
 		if (ch == '\\')
-			ch = escape_char(next());
-		if (next() != '\'') {
-			fprintf(stderr, "%zu:%zu: expected '\n", row, col);
-			exit(1);
-		}
-		return (Token){ TK_INTEGER, row, col, ch };
+			ch = escape_char(next(lx));
+		if (next(lx) != '\'') lexer_error(lx, lx->pos, "expected '");
+		return (Token){ TK_INTEGER, begin, ch };
 	}
 	
 	else {
-		const size_t r = row, c = col;
-		ch = next();
+		const uint32_t begin = lx->pos;
+		ch = next(lx);
 		switch (ch) {
-		case '+':   return (Token){ TK_PLUS, r, c };
-		case '-':   return (Token){ TK_MINUS, r, c };
-		case '*':   return (Token){ TK_STAR, r, c };
-		case '&':   return (Token){ TK_AND, r, c };
-		case '|':   return (Token){ TK_OR, r, c };
-		case '^':   return (Token){ TK_XOR, r, c };
+		case '+':   return (Token){ TK_PLUS, begin };
+		case '-':   return (Token){ TK_MINUS, begin };
+		case '*':   return (Token){ TK_STAR, begin };
+		case '&':   return (Token){ TK_AND, begin };
+		case '|':   return (Token){ TK_OR, begin };
+		case '^':   return (Token){ TK_XOR, begin };
 		case '=':
-			if (peek() == '=')
-					return next(), (Token){ TK_EQEQ, r, c};
-			else    return (Token){TK_EQUALS,r, c};
-		case '(':   return (Token){ TK_LPAREN, r, c };
-		case ')':   return (Token){ TK_RPAREN, r, c };
-		case '{':   return (Token){ TK_CLPAREN, r, c };
-		case '}':   return (Token){ TK_CRPAREN, r, c };
-		case '[':   return (Token){ TK_LBRACK, r, c };
-		case ']':   return (Token){ TK_RBRACK, r, c };
-		case ',':   return (Token){ TK_COMMA, r, c };
-		case ';':   return (Token){ TK_SEMICOLON, r, c };
-		case '>':   return (Token){ TK_GR, r, c };
-		case '<':   return (Token){ TK_LE, r, c };
-		case '!':   return (Token){ TK_NOT, r, c };
+			if (peek(lx) == '=')
+					return next(lx), (Token){ TK_EQEQ, begin };
+			else    return (Token){TK_EQUALS, begin };
+		case '(':   return (Token){ TK_LPAREN, begin };
+		case ')':   return (Token){ TK_RPAREN, begin };
+		case '{':   return (Token){ TK_CLPAREN, begin };
+		case '}':   return (Token){ TK_CRPAREN, begin };
+		case '[':   return (Token){ TK_LBRACK, begin };
+		case ']':   return (Token){ TK_RBRACK, begin };
+		case ',':   return (Token){ TK_COMMA, begin };
+		case ';':   return (Token){ TK_SEMICOLON, begin };
+		case '>':   return (Token){ TK_GR, begin };
+		case '<':   return (Token){ TK_LE, begin };
+		case '!':   return (Token){ TK_NOT, begin };
 		case 0:
-		case EOF:   return (Token){ TK_EOF, r, c };
-		default:
-			fprintf(stderr, "%zu:%zu: unknown input '%c'\n", r, c, ch);
-			exit(1);
+		case EOF:   return (Token){ TK_EOF, begin };
+		default:    lexer_error(lx, begin, "unknown input '%c'", ch);
 		}
 	}
 }
\ No newline at end of file
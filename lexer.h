@@ -37,22 +37,36 @@ enum TokenType {
 };
 typedef struct Token {
 	enum TokenType type;
-	size_t row, col;
+	uint32_t pos;           // offset into the source, see locate()
 	union {
 		uintmax_t num;
-		char* text;
+		struct {            // TK_NAME, TK_STRING: slice of the source buffer
+			const char* text; // not NUL-terminated, escapes are not decoded
+			size_t len;
+		};
 	};
 } Token;
 
+typedef struct Lexer {
+	const char* src;
+	size_t len, pos;
+	bool mapped;
+	Token peekd;
+	uint32_t* lines;        // offset of the first character of each line
+} Lexer;
+
 extern const char* tk_names[NUM_TOKEN_TYPES];
 
-void lexer_init(FILE* file);
-void lexer_free(void);
-Token lexer_peek(void);
-Token lexer_next(void);
-bool lexer_eof(void);
+bool lexer_init(Lexer* lx, FILE* file);         // reads the whole file into memory
+bool lexer_open(Lexer* lx, const char* path);   // memory-maps the file
+void lexer_free(Lexer* lx);
+Token lexer_peek(Lexer* lx);
+Token lexer_next(Lexer* lx);
+bool lexer_eof(Lexer* lx);
 void print_token(Token tk, FILE* file);
 void print_token_info(Token tk, FILE* file);
+void locate(const uint32_t* lines, uint32_t pos, size_t* row, size_t* col);
+char* lexer_string(Token tk);         // decoded TK_STRING as a buf
 
 #ifdef __cplusplus
 }
@@ -1,13 +1,23 @@
+#define _GNU_SOURCE
 #include <stdnoreturn.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "cmdopts.h"
 #include "target.h"
+#include "jit.h"
+#include "ivm.h"
+#include "intern.h"
+#include "diag.h"
+#include "cache.h"
+#include "frags.h"
+#include "benc.h"
 #include "buf.h"
 
-static void lexer_dump(void) {
-	while (!lexer_eof()) {
-		print_token(lexer_next(), stdout);
+static void lexer_dump(Lexer* lx) {
+	while (!lexer_eof(lx)) {
+		print_token(lexer_next(lx), stdout);
 	}
 	exit(0);
 }
@@ -17,6 +27,7 @@ static char* change_filename_suffix(const char* n, const char* suf) {
 	size_t i;
 	for (i = 0; n[i] && n[i] != '.'; ++i)
 		str[i] = n[i];
+	str[i] = '\0';
 	return strcat(str, suf);
 }
 static bool is_suffix(const char* n, const char* suf) {
@@ -26,43 +37,386 @@ static bool is_suffix(const char* n, const char* suf) {
 }
 noreturn static void error(const char* name, const char* msg, ...) {
 	va_list ap;
-	fprintf(stderr, "%s: fatal error: ", name);
+	FILE* const out = diag_out();
+	fprintf(out, "%s: fatal error: ", name);
 	va_start(ap, msg);
-	vfprintf(stderr, msg, ap);
+	vfprintf(out, msg, ap);
 	va_end(ap);
-	fputs(".\ncompilation terminated\n", stderr);
-	exit(1);
+	fputs(".\ncompilation terminated\n", out);
+	diag_fatal();
 }
 
-static void compile(const char* name, const char* srcfile, const Target* target, bool optimize, bool intermediate) {
-	FILE* src = fopen(srcfile, "r");
-	if (!src) error(name, "couldn't open file %s", srcfile);
-	char* outname = change_filename_suffix(srcfile, intermediate ? ".ic" : ".asm");
-	if (!outname) error(name, "out of memory");
-	FILE* out = fopen(outname, "w");
-	if (!out) error(name, "couldn't open file %s", outname);
-	lexer_init(src);
-	
-	Program* p = parse_prog();
-	if (!p) error(name, "couldn't parse program");
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+// Returns the number of threads for the units of one file, the files of -j share opts->jobs.
+static unsigned unit_threads(const cmdline_opts* opts) {
+	const size_t files = opts->run || opts->interp ? 1 : min(buf_len(opts->inputs), opts->jobs);
+	return opts->jobs / files;
+}
+// Parses the source of lexer and generates its intermediate code.
+static IProgram* gen_iprog(const char* name, Lexer* lexer, Program** p, const cmdline_opts* opts) {
+	Parser parser;
+	parser_init(&parser, lexer, NULL);
+	*p = parse_prog(&parser);
+	if (!*p) error(name, "couldn't parse program");
 	
-	IProgram* i = igen_prog(p);
+	Pool* pool = buf_len((*p)->funcs) > 1 ? pool_new(unit_threads(opts)) : NULL;
+	IProgram* i = igen_prog(*p, pool);
 	if (!i) error(name, "couldn't generate intermediate code");
 	
-	if (optimize) i = optimize_iprog(i);
+	if (opts->optimize) i = optimize_iprog(i, opts->optimize, pool);
 	if (!i) error(name, "couldn't optimize intermediate code");
+	pool_free(pool);
+	return i;
+}
+
+// What --stats reports about a file.
+typedef struct Stats {
+	size_t ast_nodes;
+	size_t ast_bytes;           // the most at once, of one function with --stream
+	struct UnitStats {
+		const char* name;
+		unsigned num_slots, moves_removed;
+	}* units;                   // buf
+	unsigned functions, reused; // with --incremental
+} Stats;
+static size_t ast_nodes(const Ast* ast) {
+	return buf_len(ast->lvs) + buf_len(ast->exprs) + buf_len(ast->bools) + buf_len(ast->stmts);
+}
+static void add_unit_stats(Stats* st, const IUnit* unit) {
+	buf_push(st->units, ((struct UnitStats){ unit->name, unit->num_slots, unit->moves_removed }));
+}
+
+// Appends what the assembly of func depends on to the buf *key: the function and whether each name it uses is a function.
+static void fragment_key(const Ast* ast, const Function* func, const AsmStream* s, char** key) {
+	encode_func(ast, func, key);
+	for (size_t i = 0; i < buf_len(ast->lvs); ++i) {
+		if (ast->lvs[i].type != LV_NAME) continue;
+		for (const char* c = ast->lvs[i].name; *c; ++c)
+			buf_push(*key, *c);
+		buf_push(*key, '\0');
+		buf_push(*key, asm_is_declared(s, ast->lvs[i].name));
+	}
+}
+
+/*
+ * Compiles the functions of lexer into out one at a time: each one is generated,
+ * optimized and written before the next one is parsed, and its AST and
+ * intermediate code are freed. Only the string literals are kept until the end.
+ * With frags, a function whose key has a fragment there reuses its assembly.
+ */
+static void compile_stream(const char* name, Lexer* lexer, const Target* target, const cmdline_opts* opts, FILE* out, FragStore* frags, Stats* st) {
+	Ast ast = { 0 };
+	Parser parser;
+	parser_init(&parser, lexer, &ast);
+	AsmStream s;
+	OBuf ob;
+	if (opts->intermediate) ob_init(&ob, out);
+	else asm_begin(&s, target, out, opts->optimize >= 3 ? RA_COLORING : RA_LINEAR);
+	// a fatal error drops the new fragments before it ends the compilation
+	jmp_buf fatal;
+	const Diag* const prev = diag_get();
+	const Diag d = { diag_out(), &fatal };
+	if (frags) {
+		if (setjmp(fatal)) {
+			frags_close(frags, false);
+			diag_set(prev);
+			diag_fatal();
+		}
+		diag_set(&d);
+	}
+	char* key = NULL;
 	
-	if (intermediate) print_iprog(i, out);
-	else if (target->gen_asm(i, out) != 0)
-		error(name, "couldn't generate assembly output");
-	printf("compiled %s -> %s.\n", srcfile, outname);
+	int err = 0;
+	while (!lexer_eof(lexer) && !err) {
+		const char* ext = parse_extern(&parser);
+		if (ext) {
+			if (!opts->intermediate) asm_extern(&s, ext);
+			continue;
+		}
+		clear_ast(&ast);
+		const Function func = parse_func(&parser);
+		st->ast_nodes += ast_nodes(&ast);
+		st->ast_bytes = max(st->ast_bytes, ast_size(&ast));
+		
+		AsmFragment f;
+		if (frags) {
+			asm_declare(&s, func.name);
+			if (key) buf__hdr(key)->size = 0;
+			fragment_key(&ast, &func, &s, &key);
+			++st->functions;
+			if (frags_find(frags, key, buf_len(key), &f)) {
+				asm_fragment(&s, &f);
+				frags_add(frags, key, buf_len(key), &f);
+				++st->reused;
+				continue;
+			}
+		}
+		IUnit* unit = igen_func(&ast, &func);
+		if (!unit) error(name, "couldn't generate intermediate code");
+		if (opts->optimize) unit = optimize_iunit(unit, opts->optimize);
+		if (!unit) error(name, "couldn't optimize intermediate code");
+		if (opts->intermediate) print_iunit(unit, &ob);
+		else if (frags) {
+			err = asm_unit_fragment(&s, unit, &f);
+			asm_fragment(&s, &f);
+			if (!err) frags_add(frags, key, buf_len(key), &f);
+			asm_fragment_free(&f);
+			add_unit_stats(st, unit);
+		}
+		else {
+			err = asm_unit(&s, unit);
+			add_unit_stats(st, unit);
+		}
+		free_iunit(unit);
+	}
+	buf_free(key);
+	free_ast(&ast);
+	if (opts->intermediate) {
+		if (ob_flush(&ob) != 0) error(name, "couldn't write intermediate code");
+	}
+	else if (asm_end(&s) != 0 || err) error(name, "couldn't generate assembly output");
+	if (frags) {
+		diag_set(prev);
+		frags_close(frags, true);
+	}
+}
+
+// Writes what selects the output of a file besides its source, which is hashed with it for the cache.
+static void cache_options(char* buf, size_t size, const Target* target, const cmdline_opts* opts) {
+	snprintf(buf, size, "benc %s -m %s -O%u %s%s", BENC_VERSION, target->name, opts->optimize,
+		opts->intermediate ? "-i" : opts->object ? "-c" : "-S", opts->stream ? " --stream" : "");
+}
+
+// Compiles srcfile, log gets what is reported on success. The output is looked up in and added to cache unless it is NULL.
+static void compile(const char* name, const char* srcfile, const Target* target, const cmdline_opts* opts, Cache* cache, FILE* log) {
+	Lexer lexer;
+	if (!lexer_open(&lexer, srcfile)) error(name, "couldn't open file %s", srcfile);
+	const bool object = opts->object && !opts->intermediate;
+	if (object && !target->gen_obj) error(name, "target %s can't output object files", target->name);
+	if (object && opts->stream) error(name, "%s can't output object files", opts->incremental ? "--incremental" : "--stream");
+	char* outname = change_filename_suffix(srcfile, opts->intermediate ? ".ic" : object ? ".o" : ".asm");
+	if (!outname) error(name, "out of memory");
+	char options[128];
+	cache_options(options, sizeof(options), target, opts);
+	const bool cached = cache && cache_get(cache, options, lexer.src, lexer.len, outname);
 	
+	Stats st = { 0 };
+	if (!cached) {
+		FILE* out = fopen(outname, object ? "wb" : "w");
+		if (!out) error(name, "couldn't open file %s", outname);
+		if (opts->stream && opts->incremental && !opts->intermediate) {
+			char* path = change_filename_suffix(srcfile, ".frg");
+			FragStore frags;
+			if (!path) error(name, "out of memory");
+			if (!frags_open(&frags, path, options)) error(name, "couldn't write file %s", path);
+			free(path);
+			compile_stream(name, &lexer, target, opts, out, &frags, &st);
+		}
+		else if (opts->stream) compile_stream(name, &lexer, target, opts, out, NULL, &st);
+		else {
+			Program* p;
+			IProgram* i = gen_iprog(name, &lexer, &p, opts);
+			const enum RegAlloc how = opts->optimize >= 3 ? RA_COLORING : RA_LINEAR;
+			if (opts->intermediate) {
+				if (print_iprog(i, out) != 0) error(name, "couldn't write intermediate code");
+			}
+			else if (object) {
+				ElfObject obj = { 0 };
+				if (target->gen_obj(i, &obj, how) != 0 || elf_write(&obj, out) != 0)
+					error(name, "couldn't generate object file");
+				elf_free(&obj);
+			}
+			else if (gen_asm(target, i, out, how) != 0)
+				error(name, "couldn't generate assembly output");
+			st.ast_nodes = ast_nodes(&p->ast);
+			st.ast_bytes = ast_size(&p->ast);
+			for (size_t j = 0; j < buf_len(i->units) && !opts->intermediate; ++j)
+				add_unit_stats(&st, i->units[j]);
+			free_iprog(i);
+			free_prog(p);
+		}
+		if (fclose(out) != 0) error(name, "couldn't write file %s", outname);
+		if (cache) cache_put(cache, options, lexer.src, lexer.len, outname);
+	}
+	fprintf(log, "compiled %s -> %s.\n", srcfile, outname);
+	if (opts->stats && cache) fprintf(log, "  cache: %s\n", cached ? "hit" : "miss");
+	if (opts->stats && !cached) {
+		fprintf(log, "  ast: %zu nodes, %zu bytes%s\n", st.ast_nodes, st.ast_bytes,
+			opts->stream ? " at most" : "");
+		if (opts->incremental && !opts->intermediate)
+			fprintf(log, "  incremental: %u of %u functions reused\n", st.reused, st.functions);
+		for (size_t j = 0; j < buf_len(st.units); ++j) {
+			fprintf(log, "  %s: %u spill slots, %u moves eliminated\n", st.units[j].name,
+				st.units[j].num_slots, st.units[j].moves_removed);
+		}
+	}
+	
+	buf_free(st.units);
+	free(outname);
+	lexer_free(&lexer);
+}
+
+// Compiles srcfile into memory and calls its main function, returns what it returned.
+static int run(const char* name, const char* srcfile, const Target* target, const cmdline_opts* opts) {
+	const double start = now();
+	Lexer lexer;
+	if (!lexer_open(&lexer, srcfile)) error(name, "couldn't open file %s", srcfile);
+	if (!target->gen_obj) error(name, "target %s can't generate machine code", target->name);
+	
+	Program* p;
+	IProgram* i = gen_iprog(name, &lexer, &p, opts);
+	ElfObject obj = { 0 };
+	if (target->gen_obj(i, &obj, opts->optimize >= 3 ? RA_COLORING : RA_LINEAR) != 0)
+		error(name, "couldn't generate machine code");
+	Jit jit;
+	const char* undefined = NULL;
+	switch (jit_load(&jit, &obj, &undefined)) {
+	case JIT_OK:        break;
+	case JIT_MACHINE:   error(name, "target %s doesn't run on this machine", target->name);
+	case JIT_UNDEFINED: error(name, "undefined symbol %s", undefined);
+	default:            error(name, "couldn't load the machine code");
+	}
+	intmax_t (*entry)(void) = (intmax_t(*)(void))jit_symbol(&jit, &obj, "main");
+	if (!entry) error(name, "%s has no main function", srcfile);
+	
+	const double compiled = now();
+	const intmax_t ret = entry();
+	const double ran = now();
+	fflush(stdout);
+	fprintf(stderr, "%s: compiled in %.3f ms, ran in %.3f ms, main returned %jd\n", srcfile,
+		(compiled - start) * 1e3, (ran - compiled) * 1e3, ret);
+	
+	jit_free(&jit);
+	elf_free(&obj);
 	free_iprog(i);
 	free_prog(p);
-	free(outname);
-	fclose(out);
-	fclose(src);
-	lexer_free();
+	lexer_free(&lexer);
+	return (int)ret;
+}
+
+// Interprets the bytecode of srcfile, starting at main, returns what main returned.
+static int interpret(const char* name, const char* srcfile, const cmdline_opts* opts) {
+	const double start = now();
+	Lexer lexer;
+	if (!lexer_open(&lexer, srcfile)) error(name, "couldn't open file %s", srcfile);
+	
+	Program* p;
+	IProgram* i = gen_iprog(name, &lexer, &p, opts);
+	const char* undefined = NULL;
+	IVm* vm = ivm_load(i, &undefined);
+	if (!vm) error(name, "undefined symbol %s", undefined);
+	
+	const double compiled = now();
+	intmax_t ret;
+	if (!ivm_call(vm, "main", &ret)) error(name, "%s has no main function", srcfile);
+	const double ran = now();
+	fflush(stdout);
+	fprintf(stderr, "%s: compiled in %.3f ms, ran in %.3f ms, %ju instructions executed, main returned %jd\n",
+		srcfile, (compiled - start) * 1e3, (ran - compiled) * 1e3, (uintmax_t)vm->steps, ret);
+	
+	ivm_free(vm);
+	free_iprog(i);
+	free_prog(p);
+	lexer_free(&lexer);
+	return (int)ret;
+}
+
+typedef struct Job {
+	const char* srcfile;
+	char* log;                  // what compile() reported, NULL if it failed to start
+	char* diag;                 // its errors
+	size_t log_len, diag_len;
+	bool failed, done;
+} Job;
+typedef struct JobQueue {
+	const char* name;
+	const Target* target;
+	const cmdline_opts* opts;
+	Cache* cache;
+	Job* jobs;
+	size_t num_jobs, next;      // next is the first job no worker took yet
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+} JobQueue;
+
+static void run_job(const JobQueue* q, Job* job) {
+	FILE* log = open_memstream(&job->log, &job->log_len);
+	FILE* diag = open_memstream(&job->diag, &job->diag_len);
+	if (!log || !diag) {
+		if (log) fclose(log);
+		if (diag) fclose(diag);
+		job->failed = true;
+		return;
+	}
+	jmp_buf fatal;
+	const Diag d = { diag, &fatal };
+	diag_set(&d);
+	if (!setjmp(fatal)) compile(q->name, job->srcfile, q->target, q->opts, q->cache, log);
+	else job->failed = true;
+	diag_set(NULL);
+	fclose(log);
+	fclose(diag);
+}
+static void* worker(void* arg) {
+	JobQueue* q = arg;
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		Job* job = q->next < q->num_jobs ? &q->jobs[q->next++] : NULL;
+		pthread_mutex_unlock(&q->lock);
+		if (!job) return NULL;
+		run_job(q, job);
+		pthread_mutex_lock(&q->lock);
+		job->done = true;
+		pthread_cond_broadcast(&q->done);
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+/*
+ * Compiles the inputs with opts->jobs threads. The reports of every file are held back
+ * until those of the files before it are printed, so the output doesn't depend on timing.
+ * Like without -j, the first file that fails ends the compiler.
+ */
+static void compile_parallel(const char* name, const Target* target, const cmdline_opts* opts, Cache* cache) {
+	JobQueue q = { .name = name, .target = target, .opts = opts, .cache = cache, .num_jobs = buf_len(opts->inputs) };
+	q.jobs = calloc(q.num_jobs, sizeof(Job));
+	if (!q.jobs) error(name, "out of memory");
+	for (size_t i = 0; i < q.num_jobs; ++i)
+		q.jobs[i].srcfile = opts->inputs[i];
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.done, NULL);
+	
+	const size_t num_threads = min(opts->jobs, q.num_jobs);
+	pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+	size_t started = 0;
+	while (threads && started < num_threads && pthread_create(&threads[started], NULL, worker, &q) == 0)
+		++started;
+	if (!started) error(name, "couldn't start a thread");
+	
+	for (size_t i = 0; i < q.num_jobs; ++i) {
+		Job* const job = &q.jobs[i];
+		pthread_mutex_lock(&q.lock);
+		while (!job->done) pthread_cond_wait(&q.done, &q.lock);
+		pthread_mutex_unlock(&q.lock);
+		fwrite(job->log, 1, job->log_len, stdout);
+		fflush(stdout);
+		fwrite(job->diag, 1, job->diag_len, stderr);
+		if (job->failed) {
+			if (!job->diag_len) error(name, "couldn't compile %s", job->srcfile);
+			exit(1);
+		}
+		free(job->log);
+		free(job->diag);
+	}
+	for (size_t i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(q.jobs);
+	pthread_cond_destroy(&q.done);
+	pthread_mutex_destroy(&q.lock);
 }
 
 int main(int argc, const char** argv) {
@@ -70,23 +424,52 @@ int main(int argc, const char** argv) {
 	cmdline_opts opts = parse_cmdline(argc, argv);
 	const Target* target = get_target_by_name(opts.target);
 	if (!target) error(argv[0], "target %s not found", opts.target);
-	for (size_t i = 0; i < buf_len(opts.inputs); ++i) {
-		compile(argv[0], opts.inputs[i], target, opts.optimize, opts.intermediate);
+	if (opts.run || opts.interp) {
+		int ret = 0;
+		for (size_t i = 0; i < buf_len(opts.inputs); ++i) {
+			ret = opts.interp ? interpret(argv[0], opts.inputs[i], &opts)
+				: run(argv[0], opts.inputs[i], target, &opts);
+		}
+		intern_free();
+		return ret;
 	}
+	Cache cache;
+	if (opts.cache && !cache_init(&cache, opts.cache, (uint64_t)opts.cache_size << 20))
+		error(argv[0], "couldn't use %s as the cache", opts.cache);
+	Cache* const c = opts.cache ? &cache : NULL;
+	if (opts.jobs > 1 && buf_len(opts.inputs) > 1)
+		compile_parallel(argv[0], target, &opts, c);
+	else {
+		for (size_t i = 0; i < buf_len(opts.inputs); ++i)
+			compile(argv[0], opts.inputs[i], target, &opts, c, stdout);
+	}
+	if (c) {
+		cache_trim(c);
+		if (opts.stats) {
+			printf("cache: %u hits, %u misses, %zu entries, %ju bytes, %u evicted\n", c->hits, c->misses,
+				c->entries, (uintmax_t)c->size, c->evicted);
+		}
+		cache_free(c);
+	}
+	intern_free();
 	puts("compiled all files successfully.");
 	return 0;
 #else
 	FILE* src = fopen("../test.b", "r");
 	FILE* out = fopen("../test.asm", "w");
 	FILE* ic = fopen("../test.ic", "w");
-	lexer_init(src);
-	lexer_dump();
-	Program* prog = parse_prog();
-	IProgram* ip = igen_prog(prog);
+	Lexer lexer;
+	Parser parser;
+	if (!src || !lexer_init(&lexer, src)) return 1;
+	fclose(src);
+	lexer_dump(&lexer);
+	parser_init(&parser, &lexer, NULL);
+	Program* prog = parse_prog(&parser);
+	IProgram* ip = igen_prog(prog, NULL);
 	print_iprog(ip, ic);
 	fputc('\n', ic);
-	optimize_iprog(ip);
+	optimize_iprog(ip, 2, NULL);
 	print_iprog(ip, ic);
-	get_target(TARGET_i386)->gen_asm(ip, out);
+	gen_asm(get_target(TARGET_i386), ip, out, RA_COLORING);
 #endif
 }
\ No newline at end of file
@@ -0,0 +1,78 @@
+#ifndef BENC_OBUF_H
+#define BENC_OBUF_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OBUF_SIZE (64 * 1024)
+
+/*
+ * Output buffer of the text writers, it only calls fwrite() on full blocks.
+ * The numbers are formatted by hand, none of the functions allocate.
+ */
+typedef struct OBuf {
+	FILE* f;
+	size_t len;
+	bool failed;                // an fwrite() failed
+	char data[OBUF_SIZE];
+} OBuf;
+
+inline static void ob_init(OBuf* ob, FILE* f) {
+	ob->f = f;
+	ob->len = 0;
+	ob->failed = false;
+}
+// Writes the buffered text to the file, returns 0 if everything was written.
+inline static int ob_flush(OBuf* ob) {
+	if (ob->len && fwrite(ob->data, 1, ob->len, ob->f) != ob->len) ob->failed = true;
+	ob->len = 0;
+	return ob->failed ? -1 : 0;
+}
+inline static void ob_write(OBuf* ob, const char* s, size_t n) {
+	if (n > OBUF_SIZE - ob->len) {
+		ob_flush(ob);
+		if (n >= OBUF_SIZE) {
+			if (fwrite(s, 1, n, ob->f) != n) ob->failed = true;
+			return;
+		}
+	}
+	memcpy(ob->data + ob->len, s, n);
+	ob->len += n;
+}
+inline static void ob_char(OBuf* ob, char c) {
+	if (ob->len == OBUF_SIZE) ob_flush(ob);
+	ob->data[ob->len++] = c;
+}
+inline static void ob_str(OBuf* ob, const char* s) {
+	ob_write(ob, s, strlen(s));
+}
+inline static void ob_uint(OBuf* ob, uintmax_t v) {
+	char tmp[24];
+	char* p = tmp + sizeof(tmp);
+	do *--p = '0' + v % 10; while (v /= 10);
+	ob_write(ob, p, tmp + sizeof(tmp) - p);
+}
+inline static void ob_int(OBuf* ob, intmax_t v) {
+	if (v < 0) {
+		ob_char(ob, '-');
+		ob_uint(ob, -(uintmax_t)v);
+	}
+	else ob_uint(ob, v);
+}
+// Writes 0xHH.
+inline static void ob_hex8(OBuf* ob, uint8_t v) {
+	static const char digits[] = "0123456789ABCDEF";
+	const char s[4] = { '0', 'x', digits[v >> 4], digits[v & 0xf] };
+	ob_write(ob, s, 4);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_OBUF_H
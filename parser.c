@@ -1,374 +1,341 @@
 #include <stdnoreturn.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include "parser.h"
+#include "diag.h"
+#include "intern.h"
 #include "buf.h"
 
-#define peek lexer_peek
-#define next lexer_next
+#define peek() lexer_peek(p->lexer)
+#define next() lexer_next(p->lexer)
 #define matches(x) (peek().type == x)
-#define getrow() (peek().row)
-#define getcol() (peek().col)
-#define alloc(t) ((t*)calloc(1, sizeof(t)))
-noreturn static void syntax_error(const char* msg, size_t row, size_t col, ...) {
+#define getpos() (peek().pos)
+#define push_node(arr, ...) (buf_push(p->ast->arr, __VA_ARGS__), (AstRef)(buf_len(p->ast->arr) - 1))
+#define push_lv(...) push_node(lvs, (LValue){ __VA_ARGS__ })
+#define push_expr(...) push_node(exprs, (Expression){ __VA_ARGS__ })
+#define push_bool(...) push_node(bools, (BoolValue){ __VA_ARGS__ })
+#define push_stmt(...) push_node(stmts, (Statement){ __VA_ARGS__ })
+noreturn static void syntax_error(const Parser* p, const char* msg, uint32_t pos, ...) {
 	va_list ap;
-	va_start(ap, col);
-	fprintf(stderr, "%zu:%zu: ", row, col);
-	vfprintf(stderr, msg, ap);
-	fputc('\n', stderr);
+	size_t row, col;
+	locate(p->lexer->lines, pos, &row, &col);
+	va_start(ap, pos);
+	FILE* const out = diag_out();
+	fprintf(out, "%zu:%zu: ", row, col);
+	vfprintf(out, msg, ap);
+	fputc('\n', out);
 	va_end(ap);
-	exit(1);
+	diag_fatal();
 }
-static bool match(enum TokenType type) {
+// Appends the temporary list to Ast.refs and frees it.
+static AstList push_list(Parser* p, AstRef* refs) {
+	const AstList l = { buf_len(p->ast->refs), buf_len(refs) };
+	for (size_t i = 0; i < buf_len(refs); ++i)
+		buf_push(p->ast->refs, refs[i]);
+	buf_free(refs);
+	return l;
+}
+static const char* intern_tk(Token tk) {
+	return intern(tk.text, tk.len);
+}
+static bool match(Parser* p, enum TokenType type) {
 	if (matches(type)) return next(), true;
 	else return false;
 }
-static Token expect(enum TokenType type) {
+static Token expect(Parser* p, enum TokenType type) {
 	if (matches(type)) return next();
-	else syntax_error("expected %s got %s", getrow(), getcol(), tk_names[type], tk_names[peek().type]);
+	else syntax_error(p, "expected %s got %s", getpos(), tk_names[type], tk_names[peek().type]);
 }
 
-void parser_init(void) {}
+void parser_init(Parser* p, Lexer* lexer, Ast* ast) {
+	p->lexer = lexer;
+	p->ast = ast;
+}
 
-static LValue* lv_prim(void) {
+static AstRef lv_prim(Parser* p) {
+	const uint32_t pos = getpos();
 	if (matches(TK_NAME)) {
-		LValue* lv = alloc(LValue);
-		lv->type = LV_NAME;
-		lv->row = getrow();
-		lv->col = getcol();
-		lv->name = next().text;
-		return lv;
-	}
-	else if (match(TK_LPAREN)) {
-		LValue* lv = alloc(LValue);
-		lv->type = LV_PAREN;
-		lv->row = getrow();
-		lv->col = getcol();
-		lv->lv = parse_lv();
-		expect(TK_RPAREN);
-		return lv;
-	}
-	else syntax_error("expected lvalue got %s", getrow(), getcol(), tk_names[peek().type]);
-}
-static LValue* lv_unary(void) {
-	if (matches(TK_STAR)) {
-		LValue* lv = alloc(LValue);
-		lv->type = LV_DEREF;
-		lv->row = getrow();
-		lv->col = getcol(); next();
-		lv->expr = parse_expr();
-		return lv;
-	}
-	else return lv_prim();
-}
-static LValue* lv_at(void) {
-	LValue* left = lv_unary();
-	while (match(TK_LBRACK)) {
-		LValue* lv = alloc(LValue);
-		lv->type = LV_AT;
-		lv->row = getrow();
-		lv->col = getcol();
-		lv->binary.left = left;
-		lv->binary.right = parse_expr();
-		left = lv;
-		expect(TK_RBRACK);
+		return push_lv(LV_NAME, pos, .name = intern_tk(next()));
+	}
+	else if (match(p, TK_LPAREN)) {
+		const AstRef lv = parse_lv(p);
+		expect(p, TK_RPAREN);
+		return push_lv(LV_PAREN, pos, .lv = lv);
+	}
+	else syntax_error(p, "expected lvalue got %s", pos, tk_names[peek().type]);
+}
+static AstRef lv_unary(Parser* p) {
+	const uint32_t pos = getpos();
+	if (match(p, TK_STAR)) {
+		const AstRef expr = parse_expr(p);
+		return push_lv(LV_DEREF, pos, .expr = expr);
+	}
+	else return lv_prim(p);
+}
+static AstRef lv_at(Parser* p) {
+	AstRef left = lv_unary(p);
+	uint32_t pos = getpos();
+	while (match(p, TK_LBRACK)) {
+		const AstRef right = parse_expr(p);
+		left = push_lv(LV_AT, pos, .binary = { left, right });
+		expect(p, TK_RBRACK);
+		pos = getpos();
 	}
 	return left;
 }
-LValue* parse_lv(void) {
-	LValue* left = lv_at();
-	while (match(TK_EQUALS)) {
-		LValue* lv = alloc(LValue);
-		lv->type = LV_ASSIGN;
-		lv->row = getrow();
-		lv->col = getcol();
-		lv->binary.left = left;
-		lv->binary.right = parse_expr();
-		left = lv;
+AstRef parse_lv(Parser* p) {
+	AstRef left = lv_at(p);
+	uint32_t pos = getpos();
+	while (match(p, TK_EQUALS)) {
+		const AstRef right = parse_expr(p);
+		left = push_lv(LV_ASSIGN, pos, .binary = { left, right });
+		pos = getpos();
 	}
 	return left;
 }
 
-static Expression* expr_prim(void) {
-	Expression* expr = alloc(Expression);
+static AstRef expr_prim(Parser* p) {
+	const uint32_t pos = getpos();
 	if (matches(TK_INTEGER)) {
-		expr->type = EXPR_NUMBER;
-		expr->num = next().num;
-		expr->row = getrow();
-		expr->col = getcol();
+		return push_expr(EXPR_NUMBER, 0, pos, .num = next().num);
 	}
 	else if (matches(TK_STRING)) {
-		expr->type = EXPR_STRING;
-		expr->buf = next().text;
-		expr->row = getrow();
-		expr->col = getcol();
-	}
-	else if (match(TK_LPAREN)) {
-		expr->type = EXPR_PAREN;
-		expr->row = getrow();
-		expr->col = getcol();
-		expr->expr = parse_expr();
-		expect(TK_RPAREN);
+		char* str = lexer_string(next());
+		char* copy = arena_alloc(&p->ast->strings, buf_len(str));
+		memcpy(copy, str, buf_len(str));
+		buf_free(str);
+		return push_expr(EXPR_STRING, 0, pos, .buf = copy);
+	}
+	else if (match(p, TK_LPAREN)) {
+		const AstRef expr = parse_expr(p);
+		expect(p, TK_RPAREN);
+		return push_expr(EXPR_PAREN, 0, pos, .expr = expr);
 	}
 	else {
-		expr->row = getrow();
-		expr->col = getcol();
-		LValue* lv = parse_lv();
-		if (match(TK_LPAREN)) {
-			expr->type = EXPR_FCALL;
-			expr->fcall.func = lv;
-			expr->fcall.params = NULL;
+		const AstRef lv = parse_lv(p);
+		if (match(p, TK_LPAREN)) {
+			AstRef* params = NULL;
 			if (!matches(TK_RPAREN)) {
 				do {
-					buf_push(expr->fcall.params, parse_expr());
+					buf_push(params, parse_expr(p));
 				}
-				while (match(TK_COMMA));
+				while (match(p, TK_COMMA));
 			}
-			expect(TK_RPAREN);
-		}
-		else {
-			expr->type = EXPR_LVALUE;
-			expr->lv = lv;
+			expect(p, TK_RPAREN);
+			buf_push(p->ast->lists, push_list(p, params));
+			return push_expr(EXPR_FCALL, 0, pos, .fcall = { lv, buf_len(p->ast->lists) - 1 });
 		}
+		else return push_expr(EXPR_LVALUE, 0, pos, .lv = lv);
 	}
-	return expr;
 }
-static Expression* expr_unary(void) {
+static AstRef expr_unary(Parser* p) {
+	const uint32_t pos = getpos();
 	if (matches(TK_MINUS) || matches(TK_PLUS)) {
-		Expression* expr = alloc(Expression);
-		expr->type = EXPR_UNARY;
-		expr->unary.op = next();
-		expr->row = getrow();
-		expr->col = getcol();
-		expr->unary.expr = expr_unary();
-		return expr;
-	}
-	else if (match(TK_AND)) {
-		Expression* expr = alloc(Expression);
-		expr->type = EXPR_ADDROF;
-		expr->row = getrow();
-		expr->col = getcol();
-		expr->lv = parse_lv();
-		return expr;
-	}
-	else return expr_prim();
-}
-static Expression* expr_bitwise(void) {
-	Expression* left = expr_unary();
+		const enum TokenType op = next().type;
+		const AstRef expr = expr_unary(p);
+		return push_expr(EXPR_UNARY, op, pos, .expr = expr);
+	}
+	else if (match(p, TK_AND)) {
+		const AstRef lv = parse_lv(p);
+		return push_expr(EXPR_ADDROF, 0, pos, .lv = lv);
+	}
+	else return expr_prim(p);
+}
+static AstRef expr_bitwise(Parser* p) {
+	AstRef left = expr_unary(p);
 	while (matches(TK_AND) || matches(TK_OR) || matches(TK_XOR)) {
-		Expression* expr = alloc(Expression);
-		expr->type = EXPR_BINARY;
-		expr->binary.op = next();
-		expr->row = getrow();
-		expr->col = getcol();
-		expr->binary.left = left;
-		expr->binary.right = expr_unary();
-		left = expr;
+		const Token op = next();
+		const AstRef right = expr_unary(p);
+		left = push_expr(EXPR_BINARY, op.type, op.pos, .binary = { left, right });
 	}
 	return left;
 }
-Expression* parse_expr(void) {
-	Expression* left = expr_bitwise();
+AstRef parse_expr(Parser* p) {
+	AstRef left = expr_bitwise(p);
 	while (matches(TK_PLUS) || matches(TK_MINUS)) {
-		Expression* expr = alloc(Expression);
-		expr->type = EXPR_BINARY;
-		expr->binary.op = next();
-		expr->row = getrow();
-		expr->col = getcol();
-		expr->binary.left = left;
-		expr->binary.right = expr_bitwise();
-		left = expr;
+		const Token op = next();
+		const AstRef right = expr_bitwise(p);
+		left = push_expr(EXPR_BINARY, op.type, op.pos, .binary = { left, right });
 	}
 	return left;
 }
-BoolValue* parse_bool(void) {
-	BoolValue* bv = alloc(BoolValue);
-	bv->row = getrow();
-	bv->col = getcol();
-	if (match(TK_NOT)) {
-		bv->type = BOOL_NOT;
-		bv->expr = parse_expr();
-	}
-	else {
-		Expression* left = parse_expr();
-		if (matches(TK_EQEQ) || matches(TK_GR) || matches(TK_LE)) {
-			bv->type = BOOL_BINARY;
-			bv->binary.op = next();
-			bv->binary.left = left;
-			bv->binary.right = parse_expr();
-		}
-		else {
-			bv->type = BOOL_EXPR;
-			bv->expr = left;
-		}
-	}
-	return bv;
-}
-Statement* parse_stmt(void) {
-	if (match(TK_SEMICOLON)) {
-		Statement* st = alloc(Statement);
-		st->type = ST_NOP;
-		st->row = getrow();
-		st->col = getcol();
-		return st;
-	}
-	else if (match(KW_RETURN)) {
-		Statement* st = alloc(Statement);
-		st->type = ST_RETURN;
-		st->row = getrow();
-		st->col = getcol();
-		st->expr = parse_expr();
-		expect(TK_SEMICOLON);
-		return st;
-	}
-	else if (match(KW_WHILE)) {
-		Statement* st = alloc(Statement);
-		st->type = ST_WHILE;
-		st->row = getrow();
-		st->col = getcol();
-		expect(TK_LPAREN);
-		st->whileloop.cond = parse_bool();
-		expect(TK_RPAREN);
-		st->whileloop.body = parse_stmt();
-		return st;
-	}
-	else if (match(KW_IF)) {
-		Statement* st = alloc(Statement);
-		st->type = ST_IF;
-		st->row = getrow();
-		st->col = getcol();
-		expect(TK_LPAREN);
-		st->ifstmt.cond = parse_bool();
-		expect(TK_RPAREN);
-		st->ifstmt.true_case = parse_stmt();
-		st->ifstmt.false_case = match(KW_ELSE) ? parse_stmt() : NULL;
-		return st;
-	}
-	else if (match(KW_VAR)) {
-		Statement* st = alloc(Statement);
-		st->type = ST_VARDECL;
-		st->row = getrow();
-		st->col = getcol();
-		st->var_decls = NULL;
+AstRef parse_bool(Parser* p) {
+	const uint32_t pos = getpos();
+	if (match(p, TK_NOT)) {
+		const AstRef expr = parse_expr(p);
+		return push_bool(BOOL_NOT, 0, pos, .expr = expr);
+	}
+	const AstRef left = parse_expr(p);
+	if (matches(TK_EQEQ) || matches(TK_GR) || matches(TK_LE)) {
+		const enum TokenType op = next().type;
+		const AstRef right = parse_expr(p);
+		return push_bool(BOOL_BINARY, op, pos, .binary = { left, right });
+	}
+	else return push_bool(BOOL_EXPR, 0, pos, .expr = left);
+}
+AstRef parse_stmt(Parser* p) {
+	const uint32_t pos = getpos();
+	if (match(p, TK_SEMICOLON)) {
+		return push_stmt(ST_NOP, pos);
+	}
+	else if (match(p, KW_RETURN)) {
+		const AstRef expr = parse_expr(p);
+		expect(p, TK_SEMICOLON);
+		return push_stmt(ST_RETURN, pos, .expr = expr);
+	}
+	else if (match(p, KW_WHILE)) {
+		expect(p, TK_LPAREN);
+		const AstRef cond = parse_bool(p);
+		expect(p, TK_RPAREN);
+		const AstRef body = parse_stmt(p);
+		return push_stmt(ST_WHILE, pos, .whileloop = { cond, body });
+	}
+	else if (match(p, KW_IF)) {
+		expect(p, TK_LPAREN);
+		const AstRef cond = parse_bool(p);
+		expect(p, TK_RPAREN);
+		const AstRef true_case = parse_stmt(p);
+		const AstRef false_case = match(p, KW_ELSE) ? parse_stmt(p) : AST_NULL;
+		return push_stmt(ST_IF, pos, .ifstmt = { cond, true_case, false_case });
+	}
+	else if (match(p, KW_VAR)) {
+		struct VarDecl* decls = NULL;
 		bool success = false;
 		do {
 			struct VarDecl decl;
-			decl.name = expect(TK_NAME).text;
-			decl.has_value = match(TK_EQUALS);
+			decl.name = intern_tk(expect(p, TK_NAME));
+			decl.has_value = match(p, TK_EQUALS);
 			if (decl.has_value) {
-				decl.value = eval_expr(parse_expr(), &success);
-				if (!success) syntax_error("expected constant expression", st->row, st->col);
+				decl.value = eval_expr(p->ast, parse_expr(p), &success);
+				if (!success) syntax_error(p, "expected constant expression", pos);
 			}
-			buf_push(st->var_decls, decl);
-		} while (match(TK_COMMA));
-		expect(TK_SEMICOLON);
-		return st;
-	}
-	else if (match(TK_CLPAREN)) {
-		Statement* st = alloc(Statement);
-		st->row = getrow();
-		st->col = getcol();
-		st->type = ST_COMP;
-		st->stmts = NULL;
-		while (!match(TK_CRPAREN))
-			buf_push(st->stmts, parse_stmt());
-		return st;
+			buf_push(decls, decl);
+		} while (match(p, TK_COMMA));
+		expect(p, TK_SEMICOLON);
+		const AstList l = { buf_len(p->ast->decls), buf_len(decls) };
+		for (size_t i = 0; i < buf_len(decls); ++i)
+			buf_push(p->ast->decls, decls[i]);
+		buf_free(decls);
+		return push_stmt(ST_VARDECL, pos, .var_decls = l);
+	}
+	else if (match(p, TK_CLPAREN)) {
+		AstRef* stmts = NULL;
+		while (!match(p, TK_CRPAREN))
+			buf_push(stmts, parse_stmt(p));
+		return push_stmt(ST_COMP, pos, .stmts = push_list(p, stmts));
 	}
 	else {
-		Statement* st = alloc(Statement);
-		st->row = getrow();
-		st->col = getcol();
-		st->type = ST_EXPR;
-		st->expr = parse_expr();
-		expect(TK_SEMICOLON);
-		return st;
-	}
-}
-Function* parse_func(void) {
-	expect(KW_FUNC);
-	Function* func = alloc(Function);
-	func->row = getrow();
-	func->col = getcol();
-	func->name = expect(TK_NAME).text;
-	func->paramnames = NULL;
-	expect(TK_LPAREN);
+		const AstRef expr = parse_expr(p);
+		expect(p, TK_SEMICOLON);
+		return push_stmt(ST_EXPR, pos, .expr = expr);
+	}
+}
+// Appends the lines the lexer found since the last call to p->ast->lines.
+static void add_lines(Parser* p) {
+	for (size_t i = buf_len(p->ast->lines); i < buf_len(p->lexer->lines); ++i)
+		buf_push(p->ast->lines, p->lexer->lines[i]);
+}
+const char* parse_extern(Parser* p) {
+	if (!match(p, KW_EXTERN)) return NULL;
+	const char* name = intern_tk(expect(p, TK_NAME));
+	expect(p, TK_SEMICOLON);
+	return name;
+}
+Function parse_func(Parser* p) {
+	Function func = { 0 };
+	expect(p, KW_FUNC);
+	func.pos = getpos();
+	func.name = intern_tk(expect(p, TK_NAME));
+	func.paramnames.begin = buf_len(p->ast->names);
+	expect(p, TK_LPAREN);
 	if (!matches(TK_RPAREN)) {
 		do {
-			buf_push(func->paramnames, expect(TK_NAME).text);
+			buf_push(p->ast->names, intern_tk(expect(p, TK_NAME)));
 		}
-		while (match(TK_COMMA));
+		while (match(p, TK_COMMA));
 	}
-	expect(TK_RPAREN);
-	if (match(TK_EQUALS)) {
-		func->type = FT_SIMPLE;
-		func->value = parse_expr();
-		expect(TK_SEMICOLON);
+	func.paramnames.len = buf_len(p->ast->names) - func.paramnames.begin;
+	expect(p, TK_RPAREN);
+	if (match(p, TK_EQUALS)) {
+		func.type = FT_SIMPLE;
+		func.value = parse_expr(p);
+		expect(p, TK_SEMICOLON);
 	}
 	else {
-		expect(TK_CLPAREN);
-		func->type = FT_COMPLEX;
-		func->body = NULL;
-		while (!match(TK_CRPAREN))
-			buf_push(func->body, parse_stmt());
-	}
+		AstRef* body = NULL;
+		expect(p, TK_CLPAREN);
+		func.type = FT_COMPLEX;
+		while (!match(p, TK_CRPAREN))
+			buf_push(body, parse_stmt(p));
+		func.body = push_list(p, body);
+	}
+	add_lines(p);
 	return func;
 }
-Program* parse_prog(void) {
-	Program* prog = alloc(Program);
-	while (!lexer_eof()) {
-		if (match(KW_EXTERN)) {
-			buf_push(prog->externs, expect(TK_NAME).text);
-			expect(TK_SEMICOLON);
-		}
-		else buf_push(prog->funcs, parse_func());
-	}
+Program* parse_prog(Parser* p) {
+	Program* prog = calloc(1, sizeof(Program));
+	if (!prog) return NULL;
+	Ast* const ast = p->ast;
+	p->ast = &prog->ast;
+	while (!lexer_eof(p->lexer)) {
+		const char* name = parse_extern(p);
+		if (name) buf_push(prog->externs, name);
+		else buf_push(prog->funcs, parse_func(p));
+	}
+	add_lines(p);
+	p->ast = ast;
 	return prog;
 }
 
-void print_lv(const LValue* lv, FILE* f) {
+void print_lv(const Ast* ast, AstRef r, FILE* f) {
+	const LValue* lv = ast_lv(ast, r);
 	switch (lv->type) {
 	case LV_NAME:   fputs(lv->name, f); break;
-	case LV_DEREF:  fputc('*', f), print_expr(lv->expr, f); break;
+	case LV_DEREF:  fputc('*', f), print_expr(ast, lv->expr, f); break;
 	case LV_ASSIGN:
-		print_lv(lv->binary.left, f);
+		print_lv(ast, lv->binary.left, f);
 		fputs(" = ", f);
-		print_expr(lv->binary.right, f);
+		print_expr(ast, lv->binary.right, f);
 		break;
 	case LV_AT:
-		print_lv(lv->binary.left, f);
+		print_lv(ast, lv->binary.left, f);
 		fputc('[', f);
-		print_expr(lv->binary.right, f);
+		print_expr(ast, lv->binary.right, f);
 		fputc(']', f);
 		break;
-	case LV_PAREN: fputc('(', f), print_lv(lv->lv, f), fputc(')', f); break;
+	case LV_PAREN: fputc('(', f), print_lv(ast, lv->lv, f), fputc(')', f); break;
 	}
 }
-void print_expr(const Expression* expr, FILE* f) {
+void print_expr(const Ast* ast, AstRef r, FILE* f) {
+	const Expression* expr = ast_expr(ast, r);
+	const AstList* params;
 	switch (expr->type) {
 	case EXPR_NUMBER:   fprintf(f, "%ju", expr->num); break;
-	case EXPR_LVALUE:   print_lv(expr->lv, f); break;
-	case EXPR_ADDROF:   fputc('&', f), print_lv(expr->lv, f); break;
+	case EXPR_LVALUE:   print_lv(ast, expr->lv, f); break;
+	case EXPR_ADDROF:   fputc('&', f), print_lv(ast, expr->lv, f); break;
 	case EXPR_PAREN:
 		fputc('(', f);
-		print_expr(expr->expr, f);
+		print_expr(ast, expr->expr, f);
 		fputc(')', f);
 		break;
 	case EXPR_UNARY:
-		print_token(expr->unary.op, f);
-		print_expr(expr->unary.expr, f);
+		fputs(tk_names[expr->op], f);
+		print_expr(ast, expr->expr, f);
 		break;
 	case EXPR_BINARY:
-		print_expr(expr->binary.left, f);
-		print_token(expr->binary.op, f);
-		print_expr(expr->binary.right, f);
+		print_expr(ast, expr->binary.left, f);
+		fputs(tk_names[expr->op], f);
+		print_expr(ast, expr->binary.right, f);
 		break;
 	case EXPR_FCALL:
-		print_lv(expr->fcall.func, f);
+		params = &ast->lists[expr->fcall.params];
+		print_lv(ast, expr->fcall.func, f);
 		fputc('(', f);
-		if (expr->fcall.params) {
-			print_expr(expr->fcall.params[0], f);
-			for (size_t i = 1; i < buf_len(expr->fcall.params); ++i)
-				fputs(", ", f), print_expr(expr->fcall.params[i], f);
+		if (params->len) {
+			print_expr(ast, ast_list(ast, *params)[0], f);
+			for (size_t i = 1; i < params->len; ++i)
+				fputs(", ", f), print_expr(ast, ast_list(ast, *params)[i], f);
 		}
 		fputc(')', f);
 		break;
@@ -377,40 +344,42 @@ void print_expr(const Expression* expr, FILE* f) {
 		break;
 	}
 }
-void print_bool(const BoolValue* bv, FILE* f) {
+void print_bool(const Ast* ast, AstRef r, FILE* f) {
+	const BoolValue* bv = ast_bool(ast, r);
 	switch (bv->type) {
 	case BOOL_NOT: fputc('!', f);
-	case BOOL_EXPR: print_expr(bv->expr, f); break;
+	case BOOL_EXPR: print_expr(ast, bv->expr, f); break;
 	case BOOL_BINARY:
-		print_expr(bv->binary.left, f);
-		fprintf(f, " %s ", tk_names[bv->binary.op.type]);
-		print_expr(bv->binary.right, f);
+		print_expr(ast, bv->binary.left, f);
+		fprintf(f, " %s ", tk_names[bv->op]);
+		print_expr(ast, bv->binary.right, f);
 		break;
 	}
 }
-void print_stmt(const Statement* stmt, FILE* f) {
+void print_stmt(const Ast* ast, AstRef r, FILE* f) {
+	const Statement* stmt = ast_stmt(ast, r);
 	switch (stmt->type) {
 	case ST_RETURN: fputs("return ", f);
-	case ST_EXPR: print_expr(stmt->expr, f);
+	case ST_EXPR: print_expr(ast, stmt->expr, f);
 	case ST_NOP: fputs(";\n", f); break;
 	case ST_WHILE:
 		fputs("while (", f);
-		print_bool(stmt->whileloop.cond, f);
+		print_bool(ast, stmt->whileloop.cond, f);
 		fputs(") ", f);
-		print_stmt(stmt->whileloop.body, f);
+		print_stmt(ast, stmt->whileloop.body, f);
 		break;
 	case ST_IF:
 		fputs("if (", f);
-		print_bool(stmt->ifstmt.cond, f);
+		print_bool(ast, stmt->ifstmt.cond, f);
 		fputs(") ", f);
-		print_stmt(stmt->ifstmt.true_case, f);
-		if (stmt->ifstmt.false_case)
-			fputs("else ", f), print_stmt(stmt->ifstmt.false_case, f);
+		print_stmt(ast, stmt->ifstmt.true_case, f);
+		if (stmt->ifstmt.false_case != AST_NULL)
+			fputs("else ", f), print_stmt(ast, stmt->ifstmt.false_case, f);
 		break;
 	case ST_COMP:
 		fputs("{\n", f);
-		for (size_t i = 0; i < buf_len(stmt->stmts); ++i)
-			print_stmt(stmt->stmts[i], f);
+		for (size_t i = 0; i < stmt->stmts.len; ++i)
+			print_stmt(ast, ast_list(ast, stmt->stmts)[i], f);
 		fputs("}\n", f);
 		break;
 	case ST_VARDECL:
@@ -418,20 +387,21 @@ void print_stmt(const Statement* stmt, FILE* f) {
 		break;
 	}
 }
-void print_func(const Function* func, FILE* f) {
+void print_func(const Ast* ast, const Function* func, FILE* f) {
+	const char** params = ast->names + func->paramnames.begin;
 	fprintf(f, "func %s(", func->name);
-	if (func->paramnames) {
-		fputs(func->paramnames[0], f);
-		for (size_t i = 1; i < buf_len(func->paramnames); ++i)
-			fprintf(f, ", %s", func->paramnames[i]);
+	if (func->paramnames.len) {
+		fputs(params[0], f);
+		for (size_t i = 1; i < func->paramnames.len; ++i)
+			fprintf(f, ", %s", params[i]);
 	}
 	fputs(") ", f);
 	switch (func->type) {
-	case FT_SIMPLE: fputs("= ", f), print_expr(func->value, f); break;
+	case FT_SIMPLE: fputs("= ", f), print_expr(ast, func->value, f); break;
 	case FT_COMPLEX:
 		fputs("{\n", f);
-		for (size_t i = 0; i < buf_len(func->body); ++i)
-			print_stmt(func->body[i], f);
+		for (size_t i = 0; i < func->body.len; ++i)
+			print_stmt(ast, ast_list(ast, func->body)[i], f);
 		fputc('}', f);
 		break;
 	default: break;
@@ -442,148 +412,214 @@ void print_prog(const Program* prog, FILE* f) {
 	for (size_t i = 0; i < buf_len(prog->externs); ++i)
 		fprintf(f, "extern %s;\n", prog->externs[i]);
 	for (size_t i = 0; i < buf_len(prog->funcs); ++i)
-		print_func(prog->funcs[i], f);
+		print_func(&prog->ast, &prog->funcs[i], f);
 }
 
-void free_lv(LValue* lv) {
+// Every node is encoded as its type and operator, then its fields and children in order.
+static void put_bytes(char** b, const void* p, size_t n) {
+	for (size_t i = 0; i < n; ++i)
+		buf_push(*b, ((const char*)p)[i]);
+}
+static void put_u32(char** b, uint32_t v) {
+	put_bytes(b, &v, sizeof(v));
+}
+static void put_str(char** b, const char* s) {
+	const uint32_t len = strlen(s);
+	put_u32(b, len);
+	put_bytes(b, s, len);
+}
+static void encode_expr(const Ast* ast, AstRef r, char** b);
+static void encode_lv(const Ast* ast, AstRef r, char** b) {
+	const LValue* lv = ast_lv(ast, r);
+	buf_push(*b, lv->type);
 	switch (lv->type) {
-	case LV_NAME:   free(lv->name); break;
+	case LV_NAME:   put_str(b, lv->name); break;
+	case LV_DEREF:  encode_expr(ast, lv->expr, b); break;
+	case LV_PAREN:  encode_lv(ast, lv->lv, b); break;
 	case LV_ASSIGN:
-	case LV_AT:     free_lv(lv->binary.left), free_expr(lv->binary.right); break;
-	case LV_DEREF:  free_expr(lv->expr); break;
-	case LV_PAREN:  free_lv(lv->lv); break;
+	case LV_AT:
+		encode_lv(ast, lv->binary.left, b);
+		encode_expr(ast, lv->binary.right, b);
+		break;
 	}
-	free(lv);
 }
-void free_expr(Expression* expr) {
+static void encode_expr(const Ast* ast, AstRef r, char** b) {
+	const Expression* expr = ast_expr(ast, r);
+	const AstList* params;
+	buf_push(*b, expr->type);
+	buf_push(*b, expr->op);
 	switch (expr->type) {
-	case EXPR_NUMBER:   break;
-	case EXPR_PAREN:    free_expr(expr->expr); break;
-	case EXPR_ADDROF:
-	case EXPR_LVALUE:   free_lv(expr->lv); break;
-	case EXPR_UNARY:    free_expr(expr->unary.expr); break;
-	case EXPR_BINARY:   free_expr(expr->binary.left), free_expr(expr->binary.right); break;
+	case EXPR_NUMBER:   put_bytes(b, &expr->num, sizeof(expr->num)); break;
+	case EXPR_LVALUE:
+	case EXPR_ADDROF:   encode_lv(ast, expr->lv, b); break;
+	case EXPR_PAREN:
+	case EXPR_UNARY:    encode_expr(ast, expr->expr, b); break;
+	case EXPR_BINARY:
+		encode_expr(ast, expr->binary.left, b);
+		encode_expr(ast, expr->binary.right, b);
+		break;
 	case EXPR_FCALL:
-		free_lv(expr->fcall.func);
-		for (size_t i = 0; i < buf_len(expr->fcall.params); ++i)
-			free_expr(expr->fcall.params[i]);
-		buf_free(expr->fcall.params);
+		params = &ast->lists[expr->fcall.params];
+		encode_lv(ast, expr->fcall.func, b);
+		put_u32(b, params->len);
+		for (size_t i = 0; i < params->len; ++i)
+			encode_expr(ast, ast_list(ast, *params)[i], b);
 		break;
-	case EXPR_STRING:   buf_free(expr->buf);
+	case EXPR_STRING:   put_str(b, expr->buf); break;
 	}
-	free(expr);
 }
-void free_bool(BoolValue* bv) {
+static void encode_bool(const Ast* ast, AstRef r, char** b) {
+	const BoolValue* bv = ast_bool(ast, r);
+	buf_push(*b, bv->type);
+	buf_push(*b, bv->op);
 	switch (bv->type) {
-	case BOOL_EXPR:
 	case BOOL_NOT:
-		free_expr(bv->expr);
-		break;
+	case BOOL_EXPR: encode_expr(ast, bv->expr, b); break;
 	case BOOL_BINARY:
-		free_expr(bv->binary.left);
-		free_expr(bv->binary.right);
+		encode_expr(ast, bv->binary.left, b);
+		encode_expr(ast, bv->binary.right, b);
 		break;
 	}
-	free(bv);
 }
-void free_stmt(Statement* stmt) {
+static void encode_stmt(const Ast* ast, AstRef r, char** b) {
+	const Statement* stmt = ast_stmt(ast, r);
+	const struct VarDecl* decls;
+	buf_push(*b, stmt->type);
 	switch (stmt->type) {
-	case ST_NOP: break;
+	case ST_NOP:    break;
 	case ST_RETURN:
-	case ST_EXPR:       free_expr(stmt->expr); break;
+	case ST_EXPR:   encode_expr(ast, stmt->expr, b); break;
 	case ST_WHILE:
-		free_bool(stmt->whileloop.cond);
-		free_stmt(stmt->whileloop.body);
+		encode_bool(ast, stmt->whileloop.cond, b);
+		encode_stmt(ast, stmt->whileloop.body, b);
 		break;
 	case ST_IF:
-		free_bool(stmt->ifstmt.cond);
-		free_stmt(stmt->ifstmt.true_case);
-		if (stmt->ifstmt.false_case)
-			free_stmt(stmt->ifstmt.false_case);
+		encode_bool(ast, stmt->ifstmt.cond, b);
+		encode_stmt(ast, stmt->ifstmt.true_case, b);
+		buf_push(*b, stmt->ifstmt.false_case != AST_NULL);
+		if (stmt->ifstmt.false_case != AST_NULL) encode_stmt(ast, stmt->ifstmt.false_case, b);
 		break;
 	case ST_COMP:
-		for (size_t i = 0; i < buf_len(stmt->stmts); ++i)
-			free_stmt(stmt->stmts[i]);
-		buf_free(stmt->stmts);
+		put_u32(b, stmt->stmts.len);
+		for (size_t i = 0; i < stmt->stmts.len; ++i)
+			encode_stmt(ast, ast_list(ast, stmt->stmts)[i], b);
 		break;
 	case ST_VARDECL:
-		for (size_t i = 0; i < buf_len(stmt->var_decls); ++i)
-			free(stmt->var_decls[i].name);
-		buf_free(stmt->var_decls);
+		decls = ast->decls + stmt->var_decls.begin;
+		put_u32(b, stmt->var_decls.len);
+		for (size_t i = 0; i < stmt->var_decls.len; ++i) {
+			put_str(b, decls[i].name);
+			buf_push(*b, decls[i].has_value);
+			if (decls[i].has_value) put_bytes(b, &decls[i].value, sizeof(decls[i].value));
+		}
 		break;
 	}
-	free(stmt);
 }
-void free_func(Function* func) {
-	free(func->name);
-	for (size_t i = 0; i < buf_len(func->paramnames); ++i)
-		free(func->paramnames[i]);
-	buf_free(func->paramnames);
-	switch (func->type) {
-	case FT_SIMPLE: free_expr(func->value); break;
-	case FT_COMPLEX:
-		for (size_t i = 0; i < buf_len(func->body); ++i)
-			free_stmt(func->body[i]);
-		buf_free(func->body);
-		break;
-	default: break;
+void encode_func(const Ast* ast, const Function* func, char** b) {
+	put_str(b, func->name);
+	put_u32(b, func->paramnames.len);
+	for (size_t i = 0; i < func->paramnames.len; ++i)
+		put_str(b, ast->names[func->paramnames.begin + i]);
+	buf_push(*b, func->type);
+	if (func->type == FT_SIMPLE) encode_expr(ast, func->value, b);
+	else {
+		put_u32(b, func->body.len);
+		for (size_t i = 0; i < func->body.len; ++i)
+			encode_stmt(ast, ast_list(ast, func->body)[i], b);
 	}
 }
+
+void free_ast(Ast* ast) {
+	buf_free(ast->lvs);
+	buf_free(ast->exprs);
+	buf_free(ast->bools);
+	buf_free(ast->stmts);
+	buf_free(ast->refs);
+	buf_free(ast->lists);
+	buf_free(ast->names);
+	buf_free(ast->decls);
+	buf_free(ast->lines);
+	arena_free(&ast->strings);
+}
+void clear_ast(Ast* ast) {
+#define clear(b) if (b) buf__hdr(b)->size = 0
+	clear(ast->lvs);
+	clear(ast->exprs);
+	clear(ast->bools);
+	clear(ast->stmts);
+	clear(ast->refs);
+	clear(ast->lists);
+	clear(ast->names);
+	clear(ast->decls);
+#undef clear
+	arena_free(&ast->strings);
+}
 void free_prog(Program* prog) {
-	for (size_t i = 0; i < buf_len(prog->externs); ++i)
-		free(prog->externs[i]);
-	for (size_t i = 0; i < buf_len(prog->funcs); ++i)
-		free_func(prog->funcs[i]);
-	buf_free(prog->externs);
+	free_ast(&prog->ast);
 	buf_free(prog->funcs);
+	buf_free(prog->externs);
 	free(prog);
 }
+size_t ast_size(const Ast* ast) {
+	return buf_len(ast->lvs) * sizeof(LValue)
+		+ buf_len(ast->exprs) * sizeof(Expression)
+		+ buf_len(ast->bools) * sizeof(BoolValue)
+		+ buf_len(ast->stmts) * sizeof(Statement)
+		+ buf_len(ast->refs) * sizeof(AstRef)
+		+ buf_len(ast->lists) * sizeof(AstList)
+		+ buf_len(ast->names) * sizeof(const char*)
+		+ buf_len(ast->decls) * sizeof(struct VarDecl)
+		+ buf_len(ast->lines) * sizeof(uint32_t)
+		+ ast->strings.bytes;
+}
 
-static bool eval_failed;
-static intmax_t eval_impl(const Expression* expr) {
-	if (eval_failed) return 0;
+static intmax_t eval_impl(const Ast* ast, AstRef r, bool* failed) {
+	if (*failed) return 0;
+	const Expression* expr = ast_expr(ast, r);
 	switch (expr->type) {
 	case EXPR_NUMBER:   return expr->num;
-	case EXPR_PAREN:    return eval_impl(expr->expr);
+	case EXPR_PAREN:    return eval_impl(ast, expr->expr, failed);
 	case EXPR_UNARY:
-		switch (expr->unary.op.type) {
-		case TK_PLUS:   return eval_impl(expr->unary.expr);
-		case TK_MINUS:  return -eval_impl(expr->unary.expr);
-		default:        return eval_failed = true, 0;
+		switch (expr->op) {
+		case TK_PLUS:   return eval_impl(ast, expr->expr, failed);
+		case TK_MINUS:  return -eval_impl(ast, expr->expr, failed);
+		default:        return *failed = true, 0;
 		}
 	case EXPR_BINARY:
-		switch (expr->binary.op.type) {
-		case TK_PLUS:   return eval_impl(expr->binary.left) + eval_impl(expr->binary.right);
-		case TK_MINUS:  return eval_impl(expr->binary.left) - eval_impl(expr->binary.right);
-		case TK_AND:    return eval_impl(expr->binary.left) & eval_impl(expr->binary.right);
-		case TK_OR:     return eval_impl(expr->binary.left) | eval_impl(expr->binary.right);
-		case TK_XOR:    return eval_impl(expr->binary.left) ^ eval_impl(expr->binary.right);
-		default:        return eval_failed = true, 0;
+		switch (expr->op) {
+		case TK_PLUS:   return eval_impl(ast, expr->binary.left, failed) + eval_impl(ast, expr->binary.right, failed);
+		case TK_MINUS:  return eval_impl(ast, expr->binary.left, failed) - eval_impl(ast, expr->binary.right, failed);
+		case TK_AND:    return eval_impl(ast, expr->binary.left, failed) & eval_impl(ast, expr->binary.right, failed);
+		case TK_OR:     return eval_impl(ast, expr->binary.left, failed) | eval_impl(ast, expr->binary.right, failed);
+		case TK_XOR:    return eval_impl(ast, expr->binary.left, failed) ^ eval_impl(ast, expr->binary.right, failed);
+		default:        return *failed = true, 0;
 		}
-	default:            return eval_failed = true, 0;
+	default:            return *failed = true, 0;
 	}
 }
-intmax_t eval_expr(const Expression* expr, bool* success) {
-	eval_failed = false;
-	const intmax_t v = eval_impl(expr);
-	if (success) *success = !eval_failed;
-	return eval_failed ? 0 : v;
+intmax_t eval_expr(const Ast* ast, AstRef expr, bool* success) {
+	bool failed = false;
+	const intmax_t v = eval_impl(ast, expr, &failed);
+	if (success) *success = !failed;
+	return failed ? 0 : v;
 }
-bool eval_bool(const BoolValue* bv, bool* success) {
+bool eval_bool(const Ast* ast, AstRef r, bool* success) {
+	const BoolValue* bv = ast_bool(ast, r);
 	intmax_t a, b;
 	switch (bv->type) {
-	case BOOL_EXPR: return eval_expr(bv->expr, success);
-	case BOOL_NOT: return !eval_expr(bv->expr, success);
+	case BOOL_EXPR: return eval_expr(ast, bv->expr, success);
+	case BOOL_NOT: return !eval_expr(ast, bv->expr, success);
 	case BOOL_BINARY:
-		a = eval_expr(bv->binary.left, success);
+		a = eval_expr(ast, bv->binary.left, success);
 		if (!*success)  return 0;
-		b = eval_expr(bv->binary.right, success);
+		b = eval_expr(ast, bv->binary.right, success);
 		if (!*success)  return 0;
-		switch (bv->binary.op.type) {
+		switch (bv->op) {
 		case TK_EQEQ:   return a == b;
 		case TK_GR:     return a >  b;
 		case TK_LE:     return a <  b;
 		default:        return *success = false;
 		}
 	}
-}
\ No newline at end of file
+	return *success = false;
+}
@@ -1,11 +1,24 @@
 #ifndef BENC_PARSER_H
 #define BENC_PARSER_H
 #include "lexer.h"
+#include "arena.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * The AST is stored flat: every kind of node lives in its own contiguous array
+ * inside an Ast, and nodes refer to their children by 32-bit indices (AstRef).
+ * Children are always created before their parents.
+ * Source positions are offsets into the source, use locate() with Ast.lines to get row and column.
+ */
+typedef uint32_t AstRef;
+#define AST_NULL UINT32_MAX
+typedef struct AstList {
+	uint32_t begin, len;        // range of Ast.refs (or Ast.names, Ast.decls)
+} AstList;
+
 enum LValueType {
 	LV_PAREN,
 	LV_NAME,
@@ -13,17 +26,16 @@ enum LValueType {
 	LV_AT,
 	LV_ASSIGN,
 };
-struct Expression;
 typedef struct LValue {
-	enum LValueType type;
-	size_t row, col;
+	uint8_t type;               // enum LValueType
+	uint32_t pos;
 	union {
-		char* name;
-		struct Expression* expr;
-		struct LValue* lv;
+		const char* name;       // interned
+		AstRef expr;
+		AstRef lv;
 		struct {
-			struct LValue* left;
-			struct Expression* right;
+			AstRef left;        // LValue
+			AstRef right;       // Expression
 		} binary;
 	};
 } LValue;
@@ -40,25 +52,20 @@ enum ExpressionType {
 	EXPR_STRING,
 };
 typedef struct Expression {
-	enum ExpressionType type;
-	size_t row, col;
+	uint8_t type;               // enum ExpressionType
+	uint8_t op;                 // enum TokenType of EXPR_UNARY and EXPR_BINARY
+	uint32_t pos;
 	union {
 		uintmax_t num;
-		struct LValue* lv;
-		struct Expression* expr;
-		char* buf;
-		struct {
-			Token op;
-			struct Expression* expr;
-		} unary;
+		AstRef lv;
+		AstRef expr;
+		const char* buf;
 		struct {
-			Token op;
-			struct Expression* left;
-			struct Expression* right;
+			AstRef left, right;
 		} binary;
 		struct {
-			LValue* func;
-			struct Expression** params;
+			AstRef func;        // LValue
+			uint32_t params;    // index into Ast.lists
 		} fcall;
 	};
 } Expression;
@@ -69,14 +76,13 @@ enum BoolValueType {
 	BOOL_BINARY,
 };
 typedef struct BoolValue {
-	enum BoolValueType type;
-	size_t row, col;
+	uint8_t type;               // enum BoolValueType
+	uint8_t op;                 // enum TokenType of BOOL_BINARY
+	uint32_t pos;
 	union {
-		Expression* expr;
+		AstRef expr;
 		struct {
-			Token op;
-			Expression* left;
-			Expression* right;
+			AstRef left, right;
 		} binary;
 	};
 } BoolValue;
@@ -91,25 +97,25 @@ enum StatementType {
 	ST_VARDECL,
 };
 struct VarDecl {
-	char* name;
+	const char* name;
 	bool has_value;
 	intmax_t value;
 };
 typedef struct Statement {
-	enum StatementType type;
-	size_t row, col;
+	uint8_t type;               // enum StatementType
+	uint32_t pos;
 	union {
-		Expression* expr;
-		struct Statement** stmts;
-		struct VarDecl* var_decls;
+		AstRef expr;
+		AstList stmts;
+		AstList var_decls;      // range of Ast.decls
 		struct {
-			BoolValue* cond;
-			struct Statement* true_case;
-			struct Statement* false_case; // nullable
+			AstRef cond;
+			AstRef true_case;
+			AstRef false_case;  // nullable
 		} ifstmt;
 		struct {
-			BoolValue* cond;
-			struct Statement* body;
+			AstRef cond;
+			AstRef body;
 		} whileloop;
 	};
 } Statement;
@@ -119,46 +125,73 @@ enum FunctionType {
 	FT_COMPLEX,
 };
 typedef struct Function {
-	enum FunctionType type;
-	char* name;
-	size_t row, col;
-	char** paramnames;
+	uint8_t type;               // enum FunctionType
+	uint32_t pos;
+	const char* name;
+	AstList paramnames;         // range of Ast.names
 	union {
-		Expression* value;
-		Statement** body;
+		AstRef value;
+		AstList body;
 	};
 } Function;
 
+typedef struct Ast {
+	LValue* lvs;
+	Expression* exprs;
+	BoolValue* bools;
+	Statement* stmts;
+	AstRef* refs;               // elements of statement and parameter lists
+	AstList* lists;             // parameter lists of function calls
+	const char** names;         // parameter names
+	struct VarDecl* decls;
+	uint32_t* lines;
+	Arena strings;              // contents of string literals
+} Ast;
+#define ast_lv(ast, r)      (&(ast)->lvs[r])
+#define ast_expr(ast, r)    (&(ast)->exprs[r])
+#define ast_bool(ast, r)    (&(ast)->bools[r])
+#define ast_stmt(ast, r)    (&(ast)->stmts[r])
+#define ast_list(ast, l)    ((ast)->refs + (l).begin)
+
 typedef struct Program {
-	struct Function** funcs;
-	char** externs;
+	Ast ast;                    // owns all nodes of the program
+	Function* funcs;
+	const char** externs;
 } Program;
 
-void parser_init(void);
+typedef struct Parser {
+	Lexer* lexer;
+	Ast* ast;                   // where parse_lv() ... parse_func() put nodes, parse_prog() uses its own
+} Parser;
+
+void parser_init(Parser* p, Lexer* lexer, Ast* ast);
 
-LValue* parse_lv(void);
-Expression* parse_expr(void);
-BoolValue* parse_bool(void);
-Statement* parse_stmt(void);
-Function* parse_func(void);
-Program* parse_prog(void);
+AstRef parse_lv(Parser* p);
+AstRef parse_expr(Parser* p);
+AstRef parse_bool(Parser* p);
+AstRef parse_stmt(Parser* p);
+// Parses `extern name;` if it comes next and returns the name, NULL otherwise.
+const char* parse_extern(Parser* p);
+Function parse_func(Parser* p);
+Program* parse_prog(Parser* p);
 
-void print_lv(const LValue* lv, FILE* file);
-void print_expr(const Expression* expr, FILE* file);
-void print_bool(const BoolValue* bv, FILE* file);
-void print_stmt(const Statement* stmt, FILE* file);
-void print_func(const Function* func, FILE* file);
+void print_lv(const Ast* ast, AstRef lv, FILE* file);
+void print_expr(const Ast* ast, AstRef expr, FILE* file);
+void print_bool(const Ast* ast, AstRef bv, FILE* file);
+void print_stmt(const Ast* ast, AstRef stmt, FILE* file);
+void print_func(const Ast* ast, const Function* func, FILE* file);
 void print_prog(const Program* prog, FILE* file);
+// Appends an encoding of func to the buf *b, which is the same for two functions exactly if their trees are, whatever their positions.
+void encode_func(const Ast* ast, const Function* func, char** b);
 
-void free_lv(LValue* lv);
-void free_expr(Expression* expr);
-void free_bool(BoolValue* bv);
-void free_stmt(Statement* stmt);
-void free_func(Function* func);
+void free_ast(Ast* ast);
+// Removes the nodes of ast but keeps its buffers and lines, for parsing a program one function at a time.
+void clear_ast(Ast* ast);
 void free_prog(Program* prog);
+size_t ast_size(const Ast* ast);    // bytes used by the nodes of ast
 
-intmax_t eval_expr(const Expression* expr, bool* success);
-bool eval_bool(const BoolValue* bv, bool* success);
+intmax_t eval_expr(const Ast* ast, AstRef expr, bool* success);
+bool eval_bool(const Ast* ast, AstRef bv, bool* success);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pool.h"
+#include "diag.h"
+
+typedef struct Worker {
+	Pool* pool;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	size_t begin, end;          // the iterations it didn't start yet
+} Worker;
+struct Pool {
+	Worker* workers;            // the caller of pool_for() is workers[0]
+	unsigned num_workers;
+	pthread_mutex_t lock;
+	pthread_cond_t start, finished;
+	unsigned loop;              // the number of the current loop
+	unsigned running;           // threads that didn't finish it yet
+	bool quit;
+	void (*fn)(void*, size_t);
+	void* arg;
+	size_t failed;              // the first iteration that ended in diag_fatal(), or SIZE_MAX
+	char* errors;               // what it wrote to diag_out()
+	size_t errors_len;
+};
+
+static bool take(Worker* w, size_t* i) {
+	pthread_mutex_lock(&w->lock);
+	const bool found = w->begin < w->end;
+	if (found) *i = w->begin++;
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+// Moves the upper half of the iterations of another worker to w, returns the first of them in i.
+static bool steal(Worker* w, size_t* i) {
+	Pool* const pool = w->pool;
+	const unsigned self = w - pool->workers;
+	for (unsigned k = 1; k < pool->num_workers; ++k) {
+		Worker* const v = &pool->workers[(self + k) % pool->num_workers];
+		pthread_mutex_lock(&v->lock);
+		const size_t mid = v->begin + (v->end - v->begin) / 2, end = v->end;
+		const bool found = v->begin < v->end;
+		if (found) v->end = mid;
+		pthread_mutex_unlock(&v->lock);
+		if (found) {
+			pthread_mutex_lock(&w->lock);
+			w->begin = mid + 1;
+			w->end = end;
+			pthread_mutex_unlock(&w->lock);
+			*i = mid;
+			return true;
+		}
+	}
+	return false;
+}
+static void run(Worker* w, size_t i) {
+	Pool* const pool = w->pool;
+	char* errors = NULL;
+	size_t errors_len = 0;
+	FILE* out = open_memstream(&errors, &errors_len);
+	jmp_buf fatal;
+	bool failed = false;
+	const Diag* const prev = diag_get();
+	const Diag d = { out ? out : diag_out(), &fatal };
+	diag_set(&d);
+	if (setjmp(fatal)) failed = true;
+	else pool->fn(pool->arg, i);
+	diag_set(prev);
+	if (out) fclose(out);
+	if (failed) {
+		pthread_mutex_lock(&pool->lock);
+		if (i < pool->failed) {
+			pool->failed = i;
+			free(pool->errors);
+			pool->errors = errors;
+			pool->errors_len = errors_len;
+			errors = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	free(errors);
+}
+static void run_loop(Worker* w) {
+	size_t i;
+	while (take(w, &i) || steal(w, &i))
+		run(w, i);
+}
+static void* worker_main(void* arg) {
+	Worker* const w = arg;
+	Pool* const pool = w->pool;
+	unsigned loop = 0;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->loop == loop)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit) break;
+		loop = pool->loop;
+		pthread_mutex_unlock(&pool->lock);
+		run_loop(w);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0) pthread_cond_signal(&pool->finished);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+Pool* pool_new(unsigned threads) {
+	if (threads < 2) return NULL;
+	Pool* pool = calloc(1, sizeof(Pool));
+	if (!pool) return NULL;
+	pool->workers = calloc(threads, sizeof(Worker));
+	if (!pool->workers) return free(pool), NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->finished, NULL);
+	pool->num_workers = 1;
+	pool->workers[0].pool = pool;
+	pthread_mutex_init(&pool->workers[0].lock, NULL);
+	for (unsigned i = 1; i < threads; ++i) {
+		Worker* const w = &pool->workers[i];
+		w->pool = pool;
+		pthread_mutex_init(&w->lock, NULL);
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+			pthread_mutex_destroy(&w->lock);
+			break;
+		}
+		++pool->num_workers;
+	}
+	return pool;
+}
+void pool_for(Pool* pool, size_t n, void (*fn)(void*, size_t), void* arg) {
+	if (!pool || n < 2) {
+		for (size_t i = 0; i < n; ++i)
+			fn(arg, i);
+		return;
+	}
+	const unsigned num = pool->num_workers;
+	pthread_mutex_lock(&pool->lock);
+	for (unsigned k = 0; k < num; ++k) {
+		pool->workers[k].begin = n * k / num;
+		pool->workers[k].end = n * (k + 1) / num;
+	}
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->failed = SIZE_MAX;
+	pool->running = num - 1;
+	++pool->loop;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	run_loop(&pool->workers[0]);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running)
+		pthread_cond_wait(&pool->finished, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (pool->failed != SIZE_MAX) {
+		fwrite(pool->errors, 1, pool->errors_len, diag_out());
+		free(pool->errors);
+		pool->errors = NULL;
+		diag_fatal();
+	}
+}
+void pool_free(Pool* pool) {
+	if (!pool) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (unsigned i = 0; i < pool->num_workers; ++i) {
+		if (i) pthread_join(pool->workers[i].thread, NULL);
+		pthread_mutex_destroy(&pool->workers[i].lock);
+	}
+	pthread_cond_destroy(&pool->finished);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,32 @@
+#ifndef BENC_POOL_H
+#define BENC_POOL_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A pool of threads for loops whose iterations don't depend on each other.
+ * Every thread starts with an equal share of the iterations and steals
+ * half of the remaining ones of another thread when it runs out,
+ * so a few expensive iterations don't hold up the rest.
+ */
+typedef struct Pool Pool;
+
+// Starts threads - 1 threads, the caller of pool_for() is the last one. Returns NULL if threads < 2.
+Pool* pool_new(unsigned threads);
+/*
+ * Calls fn(arg, i) for every i < n and returns when all calls have returned.
+ * The calls run on the threads of pool, or one after another if pool is NULL.
+ * If calls end in diag_fatal(), the errors of the one with the lowest i
+ * are written to the caller's diag_out() and the caller ends in diag_fatal().
+ */
+void pool_for(Pool* pool, size_t n, void (*fn)(void* arg, size_t i), void* arg);
+void pool_free(Pool* pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //BENC_POOL_H
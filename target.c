@@ -1,9 +1,15 @@
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <string.h>
 #include "target.h"
+#include "buf.h"
 
-extern int i386_gen_asm();
+extern int i386_gen_unit();
+extern int x86_64_gen_unit();
+extern int x86_64_gen_obj();
 static Target targets[NUM_TARGETS] = {
-	{ "i386", i386_gen_asm },
+	{ "i386", "", i386_gen_unit, NULL, { 6, 0xd } },                            // eax, ecx and edx are caller-saved
+	{ "x86_64", "bits 64\n", x86_64_gen_unit, x86_64_gen_obj, { 14, 0x1ff } },  // rax, rcx, rdx, rsi, rdi, r8 - r11 are caller-saved
 };
 
 const Target* get_target(enum Targets t) {
@@ -19,4 +25,117 @@ void print_targets() {
 	printf("%s", targets[0].name);
 	for (size_t i = 1; i < NUM_TARGETS; ++i)
 		printf(" %s", targets[i].name);
-}
\ No newline at end of file
+}
+
+// Returns the index where name is or would be inserted in s->funcs.
+static size_t find_func(const AsmStream* s, const char* name) {
+	size_t lo = 0, hi = buf_len(s->funcs);
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (s->funcs[mid] < name) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+void asm_begin(AsmStream* s, const Target* target, FILE* f, enum RegAlloc how) {
+	s->target = target;
+	s->how = how;
+	ob_init(&s->ob, f);
+	s->strs = (IStrPool){ 0 };
+	s->funcs = NULL;
+	ob_str(&s->ob, target->asm_header);
+}
+void asm_extern(AsmStream* s, const char* name) {
+	ob_str(&s->ob, "extern ");
+	ob_str(&s->ob, name);
+	ob_char(&s->ob, '\n');
+}
+void asm_declare(AsmStream* s, const char* name) {
+	const size_t i = find_func(s, name);
+	if (i < buf_len(s->funcs) && s->funcs[i] == name) return;
+	buf_push(s->funcs, NULL);
+	memmove(s->funcs + i + 1, s->funcs + i, (buf_len(s->funcs) - i - 1) * sizeof(*s->funcs));
+	s->funcs[i] = name;
+}
+bool asm_is_declared(const AsmStream* s, const char* name) {
+	const size_t i = find_func(s, name);
+	return i < buf_len(s->funcs) && s->funcs[i] == name;
+}
+int asm_unit(AsmStream* s, IUnit* unit) {
+	asm_declare(s, unit->name);
+	return s->target->gen_unit(s, unit);
+}
+int asm_unit_fragment(AsmStream* s, IUnit* unit, AsmFragment* f) {
+	*f = (AsmFragment){ 0 };
+	char* text = NULL;
+	FILE* mem = open_memstream(&text, &f->len);
+	if (!mem) return -1;
+	asm_declare(s, unit->name);
+	AsmStream u = { .target = s->target, .how = s->how, .funcs = s->funcs };
+	ob_init(&u.ob, mem);
+	int err = s->target->gen_unit(&u, unit);
+	if (ob_flush(&u.ob) != 0) err = -1;
+	fclose(mem);
+	f->text = text;
+
+	char* strs = NULL;
+	for (size_t i = 0; i < buf_len(u.strs.strs); ++i)
+		for (size_t j = 0; j <= u.strs.strs[i].len; ++j)
+			buf_push(strs, u.strs.strs[i].str[j]);
+	f->strs_len = buf_len(strs);
+	f->strs = f->strs_len ? memcpy(malloc(f->strs_len), strs, f->strs_len) : NULL;
+	buf_free(strs);
+	istr_pool_free(&u.strs);
+	return err;
+}
+static bool is_name_char(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+void asm_fragment(AsmStream* s, const AsmFragment* f) {
+	const char** strs = NULL;
+	for (const char* p = f->strs; p < f->strs + f->strs_len; p += strlen(p) + 1)
+		buf_push(strs, p);
+	static const char label[] = "__str";
+	const size_t n = sizeof(label) - 1;
+	size_t done = 0;
+	for (size_t i = 0; i + n < f->len; ++i) {
+		if (memcmp(f->text + i, label, n) != 0 || (i && is_name_char(f->text[i - 1]))) continue;
+		size_t j = i + n, k = 0;
+		while (j < f->len && f->text[j] >= '0' && f->text[j] <= '9')
+			k = k * 10 + (f->text[j++] - '0');
+		if (j == i + n || k >= buf_len(strs) || (j < f->len && is_name_char(f->text[j]))) continue;
+		ob_write(&s->ob, f->text + done, i - done);
+		ob_str(&s->ob, label);
+		ob_uint(&s->ob, istr_pool_add(&s->strs, strs[k]));
+		done = i = j;
+		--i;
+	}
+	ob_write(&s->ob, f->text + done, f->len - done);
+	buf_free(strs);
+}
+void asm_fragment_free(AsmFragment* f) {
+	free((char*)f->text);
+	free((char*)f->strs);
+	*f = (AsmFragment){ 0 };
+}
+int asm_end(AsmStream* s) {
+	if (s->strs.strs) {
+		ob_str(&s->ob, "section .rodata\n");
+		istr_pool_print(&s->strs, &s->ob);
+	}
+	istr_pool_free(&s->strs);
+	buf_free(s->funcs);
+	return ob_flush(&s->ob);
+}
+int gen_asm(const Target* target, IProgram* prog, FILE* f, enum RegAlloc how) {
+	AsmStream s;
+	asm_begin(&s, target, f, how);
+	for (size_t i = 0; i < buf_len(prog->units); ++i)
+		asm_declare(&s, prog->units[i]->name);
+	for (size_t i = 0; i < buf_len(prog->externs); ++i)
+		asm_extern(&s, prog->externs[i]);
+	int err = 0;
+	for (size_t i = 0; i < buf_len(prog->units) && !err; ++i)
+		err = asm_unit(&s, prog->units[i]);
+	return asm_end(&s) || err ? -1 : 0;
+}
@@ -2,6 +2,10 @@
 #define BENC_TARGET_H
 #include <stdint.h>
 #include "igen.h"
+#include "iralloc.h"
+#include "elfobj.h"
+#include "istr.h"
+#include "obuf.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,14 +13,61 @@ extern "C" {
 
 enum Targets {
 	TARGET_i386,
+	TARGET_x86_64,
 	
 	NUM_TARGETS,
 };
+typedef struct AsmStream AsmStream;
 typedef struct Target {
 	const char* name;
-	int(*gen_asm)(IProgram*, FILE*);
+	const char* asm_header;                                 // starts the assembly of a program
+	int(*gen_unit)(AsmStream*, IUnit*);                     // writes the assembly of a unit
+	int(*gen_obj)(IProgram*, ElfObject*, enum RegAlloc);     // machine code, NULL if unsupported
+	IRegInfo regs;
 } Target;
 
+/*
+ * Writes the assembly of a program one unit at a time, so that each unit
+ * can be freed before the next one is generated. The string literals are
+ * collected on the way and written at the end.
+ */
+struct AsmStream {
+	const Target* target;
+	enum RegAlloc how;
+	OBuf ob;
+	IStrPool strs;
+	const char** funcs;         // buf, by address, the units of the program known so far, other names are external
+};
+
+void asm_begin(AsmStream* s, const Target* target, FILE* f, enum RegAlloc how);
+void asm_extern(AsmStream* s, const char* name);
+// Makes name known as a unit of the program before its assembly is written.
+void asm_declare(AsmStream* s, const char* name);
+int asm_unit(AsmStream* s, IUnit* unit);
+// Writes the string literals, returns 0 if all of the assembly was written.
+int asm_end(AsmStream* s);
+bool asm_is_declared(const AsmStream* s, const char* name);
+
+/*
+ * The assembly of a unit by itself, to be kept and written into a later
+ * compilation of the program: its string literals are __str0, __str1, ...
+ * in the order of their first use and are renumbered by asm_fragment().
+ */
+typedef struct AsmFragment {
+	const char* text;
+	size_t len;
+	const char* strs;           // the literals, each with its terminating zero
+	size_t strs_len;
+} AsmFragment;
+
+// Declares unit and writes its assembly to a new fragment f instead of s.
+int asm_unit_fragment(AsmStream* s, IUnit* unit, AsmFragment* f);
+void asm_fragment(AsmStream* s, const AsmFragment* f);
+// Frees a fragment of asm_unit_fragment().
+void asm_fragment_free(AsmFragment* f);
+// Writes the assembly of the whole program to f, returns 0 on success.
+int gen_asm(const Target* target, IProgram* prog, FILE* f, enum RegAlloc how);
+
 const Target* get_target(enum Targets t);
 const Target* get_target_by_name(const char* name);
 void print_targets();
@@ -1,114 +1,272 @@
 #include "iutil.h"
 #include "igen.h"
+#include "iralloc.h"
+#include "ifold.h"
+#include "istr.h"
+#include "target.h"
 #include "buf.h"
-
-static char* string_pool = NULL;
-static uint32_t alloc_str(const char* str) {
-	const uint32_t pos = buf_len(string_pool);
-	for (size_t i = 0; str[i]; ++i)
-		buf_push(string_pool, str[i]);
-	buf_push(string_pool, 0);
-	return pos;
-}
+#include "obuf.h"
 
 static const char* regs[] = { "eax", "ebx", "ecx", "edx", "esi", "edi" };
 static int32_t get_off(const IUnit* unit, const char* name) {
 	for (size_t i = 0; i < buf_len(unit->paramnames); ++i) {
-		if (strcmp(unit->paramnames[i], name) == 0)
+		if (unit->paramnames[i] == name)
 			return i * 4 + 8;
 	}
 	for (size_t i = 0; i < buf_len(unit->decls); ++i) {
-		if (strcmp(unit->decls[i].name, name) == 0)
-			return -i * 4 - 12;
+		if (unit->decls[i].name == name)
+			return -i * 4 - 16;
 	}
 	return INT32_MAX;
 }
-static INode* translate(IUnit* unit, INode* n, FILE* f) {
+static int32_t get_frame_off(const IUnit* unit, ireg_t frame) {  // see iunit_frame_index()
+	const size_t params = buf_len(unit->paramnames);
+	return frame < params ? (int32_t)frame * 4 + 8 : -(int32_t)(frame - params) * 4 - 16;
+}
+static size_t get_slot_off(const IUnit* unit, unsigned slot) {     // below ebp, after the locals
+	return (buf_len(unit->decls) + slot) * 4 + 16;
+}
+// Writes an operand of n of kind `kind`, index is added to IO_FRAME words.
+static void put_operand(OBuf* ob, const IUnit* unit, const INode* n, uint8_t kind, ireg_t field, ireg_t index) {
+	switch (kind) {
+	case IO_IMM:
+		ob_int(ob, (int32_t)field);
+		break;
+	case IO_FRAME:
+		ob_str(ob, "dword [ebp + ");
+		if (index != IREG_NONE) {
+			ob_str(ob, regs[index]);
+			ob_str(ob, n->scaled ? "*4 + " : " + ");
+		}
+		ob_int(ob, get_frame_off(unit, field));
+		ob_char(ob, ']');
+		break;
+	default:
+		ob_str(ob, regs[field]);
+		break;
+	}
+}
+// Writes `op dst, src`, or `op dst` if src is NULL.
+static void put_insn(OBuf* ob, const char* op, const char* dst, const char* src) {
+	ob_str(ob, op);
+	ob_char(ob, ' ');
+	ob_str(ob, dst);
+	if (src) {
+		ob_str(ob, ", ");
+		ob_str(ob, src);
+	}
+	ob_char(ob, '\n');
+}
+// Writes `op dst, src` with the operands of n.
+static void put_insn_operands(OBuf* ob, const IUnit* unit, const INode* n, const char* op,
+		uint8_t dkind, ireg_t dst, ireg_t dindex, uint8_t skind, ireg_t src, ireg_t sindex) {
+	ob_str(ob, op);
+	ob_char(ob, ' ');
+	put_operand(ob, unit, n, dkind, dst, dindex);
+	ob_str(ob, ", ");
+	put_operand(ob, unit, n, skind, src, sindex);
+	ob_char(ob, '\n');
+}
+static void put_label(OBuf* ob, const char* op, unsigned label) {
+	ob_str(ob, op);
+	ob_str(ob, " .l");
+	ob_uint(ob, label);
+	ob_char(ob, '\n');
+}
+// Selects the two-address form of `dest = left op right`, copying left into dest only if needed.
+static void emit_binary(const IUnit* unit, const char* op, bool commutative, const INode* n, OBuf* ob) {
+	const ireg_t dest = n->binary.dest;
+	if (n->dkind != IO_REG || dest == n->binary.left)
+		put_insn_operands(ob, unit, n, op, n->dkind, dest, IREG_NONE, n->skind, n->binary.right, IREG_NONE);
+	else if (n->skind != IO_REG || dest != n->binary.right) {
+		put_insn(ob, "mov", regs[dest], regs[n->binary.left]);
+		put_insn_operands(ob, unit, n, op, IO_REG, dest, IREG_NONE, n->skind, n->binary.right, IREG_NONE);
+	}
+	else if (commutative)
+		put_insn(ob, op, regs[dest], regs[n->binary.left]);
+	else {  // dest = -right + left
+		put_insn(ob, "neg", regs[dest], NULL);
+		put_insn(ob, "add", regs[dest], regs[n->binary.left]);
+	}
+}
+// Writes the dword of the spill slot of n.
+static void put_slot(OBuf* ob, const IUnit* unit, const INode* n) {
+	ob_str(ob, "dword [ebp - ");
+	ob_uint(ob, get_slot_off(unit, n->spill.slot));
+	ob_char(ob, ']');
+}
+static void translate(IUnit* unit, IStrPool* strs, INode* n, OBuf* ob) {
 	int32_t tmp;
 	switch (n->type) {
-	case IN_LABEL:  fprintf(f, ".l%u:\n", n->label); break;
-	case IN_LDC:    fprintf(f, "mov %s, %jd\n", regs[n->ldc.dest], n->ldc.num); break;
+	case IN_LABEL:
+		ob_str(ob, ".l");
+		ob_uint(ob, n->label);
+		ob_str(ob, ":\n");
+		break;
+	case IN_LDC:
+		ob_str(ob, "mov ");
+		ob_str(ob, regs[n->ldc.dest]);
+		ob_str(ob, ", ");
+		ob_int(ob, n->ldc.num);
+		ob_char(ob, '\n');
+		break;
 	case IN_LDA:
 		tmp = get_off(unit, n->lda.name);
-		if (tmp == INT32_MAX) fprintf(f, "mov %s, %s\n", regs[n->lda.dest], n->lda.name);
-		else fprintf(f, "lea %s, [ebp + %d]\n", regs[n->lda.dest], tmp);
-		break;
-	case IN_MOVE:   fprintf(f, "mov %s, %s\n", regs[n->move.dest], regs[n->move.src]); break;
-	case IN_JMP:    fprintf(f, "jmp .l%u\n", n->label); break;
-	case IN_JE:     fprintf(f, "je .l%u\n", n->label); break;
-	case IN_JNE:    fprintf(f, "jne .l%u\n", n->label); break;
-	case IN_JG:     fprintf(f, "jg .l%u\n", n->label); break;
-	case IN_JL:     fprintf(f, "jl .l%u\n", n->label); break;
-	case IN_RETURN: fprintf(f, "jmp .ret\n"); break;
-	case IN_READ:   fprintf(f, "mov %s, dword [%s]\n", regs[n->move.dest], regs[n->move.src]); break;
-	case IN_WRITE:  fprintf(f, "mov dword [%s], %s\n", regs[n->move.dest], regs[n->move.src]); break;
-	case IN_PUSH:   fprintf(f, "push %s\n", regs[n->reg]); break;
-	case IN_NOP:    fprintf(f, "nop\n"); break;
-	case IN_CMP:    fprintf(f, "cmp %s, %s\n", regs[n->move.dest], regs[n->move.src]); break;
-	case IN_CALL:   fprintf(f, "call %s\nadd esp, %d\n", regs[n->fcall.dest], n->fcall.pcount * 4); break;
-	case IN_NEG:    fprintf(f, "neg %s\n", regs[n->reg]); break;
-	case IN_ADD:    fprintf(f, "lea %s, [%s + %s]\n",
-			regs[n->binary.dest], regs[n->binary.left], regs[n->binary.right]); break;
-	case IN_SUB:    fprintf(f, "neg %s\nlea %s, [%s + %s]\n",regs[n->binary.right],
-			regs[n->binary.dest], regs[n->binary.left], regs[n->binary.right]); break;
-	case IN_AND:
-		fprintf(f, "push %s\n", regs[n->binary.left]);
-		fprintf(f, "and %s, %s\n", regs[n->binary.left], regs[n->binary.right]);
-		fprintf(f, "mov %s, %s\n", regs[n->binary.dest], regs[n->binary.left]);
-		fprintf(f, "pop %s\n", regs[n->binary.left]);
-		break;
-	case IN_OR:
-		fprintf(f, "push %s\n", regs[n->binary.left]);
-		fprintf(f, "or %s, %s\n", regs[n->binary.left], regs[n->binary.right]);
-		fprintf(f, "mov %s, %s\n", regs[n->binary.dest], regs[n->binary.left]);
-		fprintf(f, "pop %s\n", regs[n->binary.left]);
-		break;
-	case IN_XOR:
-		fprintf(f, "push %s\n", regs[n->binary.left]);
-		fprintf(f, "xor %s, %s\n", regs[n->binary.left], regs[n->binary.right]);
-		fprintf(f, "mov %s, %s\n", regs[n->binary.dest], regs[n->binary.left]);
-		fprintf(f, "pop %s\n", regs[n->binary.left]);
+		if (tmp == INT32_MAX) put_insn(ob, "mov", regs[n->lda.dest], n->lda.name);
+		else {
+			ob_str(ob, "lea ");
+			ob_str(ob, regs[n->lda.dest]);
+			ob_str(ob, ", [ebp + ");
+			ob_int(ob, tmp);
+			ob_str(ob, "]\n");
+		}
+		break;
+	case IN_MOVE:   put_insn(ob, "mov", regs[n->move.dest], regs[n->move.src]); break;
+	case IN_JMP:    put_label(ob, "jmp", n->label); break;
+	case IN_JE:     put_label(ob, "je", n->label); break;
+	case IN_JNE:    put_label(ob, "jne", n->label); break;
+	case IN_JG:     put_label(ob, "jg", n->label); break;
+	case IN_JL:     put_label(ob, "jl", n->label); break;
+	case IN_RETURN:
+		if (n->reg != IREG_NONE && n->reg != 0) put_insn(ob, "mov", "eax", regs[n->reg]);
+		ob_str(ob, "jmp .ret\n");
+		break;
+	case IN_READ:
+		if (n->skind == IO_FRAME) {
+			put_insn_operands(ob, unit, n, "mov", IO_REG, n->move.dest, IREG_NONE,
+				n->skind, n->move.src, n->move.index);
+		}
+		else {
+			ob_str(ob, "mov ");
+			ob_str(ob, regs[n->move.dest]);
+			ob_str(ob, ", dword [");
+			ob_str(ob, regs[n->move.src]);
+			ob_str(ob, "]\n");
+		}
+		break;
+	case IN_WRITE:
+		if (n->dkind == IO_FRAME) {
+			put_insn_operands(ob, unit, n, "mov", n->dkind, n->move.dest, n->move.index,
+				n->skind, n->move.src, IREG_NONE);
+		}
+		else {
+			ob_str(ob, "mov dword [");
+			ob_str(ob, regs[n->move.dest]);
+			ob_str(ob, "], ");
+			put_operand(ob, unit, n, n->skind, n->move.src, IREG_NONE);
+			ob_char(ob, '\n');
+		}
+		break;
+	case IN_PUSH:
+		ob_str(ob, "push ");
+		put_operand(ob, unit, n, n->skind, n->reg, IREG_NONE);
+		ob_char(ob, '\n');
+		break;
+	case IN_NOP:    ob_str(ob, "nop\n"); break;
+	case IN_CMP:
+		put_insn_operands(ob, unit, n, "cmp", n->dkind, n->move.dest, IREG_NONE, n->skind, n->move.src, IREG_NONE);
 		break;
+	case IN_CALL:
+		put_insn(ob, "call", regs[n->fcall.dest], NULL);
+		ob_str(ob, "add esp, ");
+		ob_uint(ob, n->fcall.pcount * 4);
+		ob_char(ob, '\n');
+		if (n->fcall.ret != 0) put_insn(ob, "mov", regs[n->fcall.ret], "eax");
+		break;
+	case IN_NEG:
+		if (n->move.dest != n->move.src) put_insn(ob, "mov", regs[n->move.dest], regs[n->move.src]);
+		put_insn(ob, "neg", regs[n->move.dest], NULL);
+		break;
+	case IN_ADJOFF:
+		if (n->move.dest == n->move.src) put_insn(ob, "shl", regs[n->move.dest], "2");
+		else {
+			ob_str(ob, "lea ");
+			ob_str(ob, regs[n->move.dest]);
+			ob_str(ob, ", [");
+			ob_str(ob, regs[n->move.src]);
+			ob_str(ob, "*4]\n");
+		}
+		break;
+	case IN_ADD:
+		if (n->dkind == IO_REG && n->skind != IO_FRAME && n->binary.dest != n->binary.left
+		&& (n->skind == IO_IMM || n->binary.dest != n->binary.right)) {
+			ob_str(ob, "lea ");
+			ob_str(ob, regs[n->binary.dest]);
+			ob_str(ob, ", [");
+			ob_str(ob, regs[n->binary.left]);
+			ob_str(ob, " + ");
+			put_operand(ob, unit, n, n->skind, n->binary.right, IREG_NONE);
+			ob_str(ob, "]\n");
+		}
+		else emit_binary(unit, "add", true, n, ob);
+		break;
+	case IN_SUB:    emit_binary(unit, "sub", false, n, ob); break;
+	case IN_AND:    emit_binary(unit, "and", true, n, ob); break;
+	case IN_OR:     emit_binary(unit, "or", true, n, ob); break;
+	case IN_XOR:    emit_binary(unit, "xor", true, n, ob); break;
 	case IN_LDS:
-		fprintf(f, "mov %s, __string_pool + %u\n", regs[n->lda.dest], alloc_str(n->lda.name));
+		ob_str(ob, "mov ");
+		ob_str(ob, regs[n->lda.dest]);
+		ob_str(ob, ", __str");
+		ob_uint(ob, istr_pool_add(strs, n->lda.name));
+		ob_char(ob, '\n');
+		break;
+	case IN_SPILL:
+		ob_str(ob, "mov ");
+		put_slot(ob, unit, n);
+		ob_str(ob, ", ");
+		ob_str(ob, regs[n->spill.reg]);
+		ob_char(ob, '\n');
+		break;
+	case IN_RELOAD:
+		ob_str(ob, "mov ");
+		ob_str(ob, regs[n->spill.reg]);
+		ob_str(ob, ", ");
+		put_slot(ob, unit, n);
+		ob_char(ob, '\n');
 		break;
 		
 	default: break;
 	}
-	return n->next;
 }
 
-static int i386_gen_asm_f(IUnit * unit, FILE* f) {
-	buf_free(string_pool);
-	fprintf(f, "section .text\n");
-	fprintf(f, "global %s:function (%s.end - %s)\n%s:\n", unit->name, unit->name, unit->name, unit->name);
-	fprintf(f, "push ebp\nmov ebp, esp\npush ebx\npush esi\npush edi\n");
-	if (unit->decls) {
-		fprintf(f, "sub esp, %zu\n", buf_len(unit->decls) * 4);
+int i386_gen_unit(AsmStream* s, IUnit* unit) {
+	OBuf* const ob = &s->ob;
+	iunit_fold_operands(unit);
+	iunit_alloc_regs(unit, &get_target(TARGET_i386)->regs, s->how);
+	const size_t frame = (buf_len(unit->decls) + unit->num_slots) * 4;
+	ob_str(ob, "section .text\nglobal ");
+	ob_str(ob, unit->name);
+	ob_str(ob, ":function (");
+	ob_str(ob, unit->name);
+	ob_str(ob, ".end - ");
+	ob_str(ob, unit->name);
+	ob_str(ob, ")\n");
+	ob_str(ob, unit->name);
+	ob_str(ob, ":\npush ebp\nmov ebp, esp\npush ebx\npush esi\npush edi\n");
+	if (frame) {
+		ob_str(ob, "sub esp, ");
+		ob_uint(ob, frame);
+		ob_char(ob, '\n');
 		for (size_t i = 0; i < buf_len(unit->decls); ++i) {
-			if (unit->decls[i].has_value)
-				fprintf(f, "mov dword [ebp - %zu], %jd\n", i * 4 + 12, unit->decls[i].value);
+			if (!unit->decls[i].has_value) continue;
+			ob_str(ob, "mov dword [ebp - ");
+			ob_uint(ob, i * 4 + 16);
+			ob_str(ob, "], ");
+			ob_int(ob, unit->decls[i].value);
+			ob_char(ob, '\n');
 		}
 	}
-	fputc('\n', f);
+	ob_char(ob, '\n');
 	
-	for (INode* n = unit->nodes; n; n = translate(unit, n, f));
-	fprintf(f, "\n.ret:\n");
-	if (unit->decls) fprintf(f, "add esp, %zu\n", buf_len(unit->decls) * 4);
-	fprintf(f, "pop edi\npop esi\npop ebx\npop ebp\nret\n.end:\n");
-	fprintf(f, "\n\n; string section\n");
-	if (string_pool) {
-		fprintf(f, "__string_pool: db 0x%02X", string_pool[0]);
-		for (size_t i = 1; i < buf_len(string_pool); ++i)
-			fprintf(f, ", 0x%02X", string_pool[i]);
-		fputc('\n', f);
+	for (size_t i = 0; i < inode_count(unit); ++i)
+		translate(unit, &s->strs, &unit->nodes[i], ob);
+	ob_str(ob, "\n.ret:\n");
+	if (frame) {
+		ob_str(ob, "add esp, ");
+		ob_uint(ob, frame);
+		ob_char(ob, '\n');
 	}
+	ob_str(ob, "pop edi\npop esi\npop ebx\npop ebp\nret\n.end:\n\n");
 	return 0;
 }
-int i386_gen_asm(IProgram* prog, FILE* f) {
-	for (size_t i = 0; i < buf_len(prog->externs); ++i)
-		fprintf(f, "extern %s\n", prog->externs[i]);
-	for (size_t i = 0; i < buf_len(prog->units); ++i)
-		i386_gen_asm_f(prog->units[i], f);
-	return 0;
-}
\ No newline at end of file
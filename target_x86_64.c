@@ -0,0 +1,314 @@
+#include <elf.h>
+#include "iutil.h"
+#include "igen.h"
+#include "iralloc.h"
+#include "ifold.h"
+#include "target.h"
+#include "asm_x86_64.h"
+#include "buf.h"
+
+// The caller-saved registers come first, so values that don't live across a call don't need a callee-saved one.
+static const uint8_t regs[] = {
+	X_RAX, X_RCX, X_RDX, X_RSI, X_RDI, X_R8, X_R9, X_R10, X_R11,
+	X_RBX, X_R12, X_R13, X_R14, X_R15,
+};
+#define FIRST_SAVED 9
+#define NUM_REGS    (sizeof(regs) / sizeof(*regs))
+#define SCRATCH     8           // r11, holds the callee of IN_CALL while the arguments are popped
+static const ireg_t arg_regs[] = { 4, 3, 2, 1, 5, 6 };     // rdi, rsi, rdx, rcx, r8, r9
+#define R(r)        x_reg(regs[r])
+#define NUM_ARG_REGS (sizeof(arg_regs) / sizeof(*arg_regs))
+
+/*
+ * Layout of the frame, from rbp down:
+ *   [rbp + 16 + 8k]    parameters past the sixth, pushed by the caller
+ *   [rbp - 8 ...]      the callee-saved registers the unit uses
+ *   [rbp - home + 8k]  all parameters, copied in the prologue so they stay contiguous like on i386
+ *   below that         the locals, then the spill slots
+ */
+typedef struct Frame {
+	size_t home;                // bytes below rbp down to the first parameter
+	unsigned saved;             // number of callee-saved registers pushed
+	bool* pad;                  // node i pushes 8 bytes of padding first to keep a call aligned
+	const char** funcs;         // by address, the units of the program, the addresses of other names are loaded from the GOT
+	IStrPool* strs;             // the string literals of the program
+} Frame;
+
+static int32_t get_frame_off(const IUnit* unit, const Frame* fr, ireg_t frame) {  // see iunit_frame_index()
+	const size_t params = buf_len(unit->paramnames);
+	if (frame < params) return frame * 8 - (int32_t)fr->home;
+	return -(int32_t)fr->home - (int32_t)(frame - params) * 8 - 8;
+}
+static int32_t get_off(const IUnit* unit, const Frame* fr, const char* name) {
+	const ireg_t frame = iunit_frame_index(unit, name);
+	return frame == IREG_NONE ? INT32_MAX : get_frame_off(unit, fr, frame);
+}
+static size_t get_slot_off(const IUnit* unit, const Frame* fr, unsigned slot) {  // below rbp, after the locals
+	return fr->home + (buf_len(unit->decls) + slot) * 8 + 8;
+}
+// Returns an operand of n of kind `kind`, index is added to IO_FRAME words.
+static XOperand operand(const IUnit* unit, const Frame* fr, const INode* n, uint8_t kind, ireg_t field, ireg_t index) {
+	switch (kind) {
+	case IO_IMM:   return x_imm((int32_t)field);
+	case IO_FRAME: return x_mem(X_RBP, index == IREG_NONE ? X_NOREG : regs[index], n->scaled ? 8 : 1, get_frame_off(unit, fr, field));
+	default:       return R(field);
+	}
+}
+// Selects the two-address form of `dest = left op right`, copying left into dest only if needed.
+static void emit_binary(XAsm* a, const IUnit* unit, const Frame* fr, enum XInsn op, bool commutative, const INode* n) {
+	const XOperand dest = operand(unit, fr, n, n->dkind, n->binary.dest, IREG_NONE);
+	const XOperand right = operand(unit, fr, n, n->skind, n->binary.right, IREG_NONE);
+	if (n->dkind != IO_REG || n->binary.dest == n->binary.left)
+		x_insn(a, op, dest, right);
+	else if (n->skind != IO_REG || n->binary.dest != n->binary.right) {
+		x_insn(a, XI_MOV, dest, R(n->binary.left));
+		x_insn(a, op, dest, right);
+	}
+	else if (commutative)
+		x_insn(a, op, dest, R(n->binary.left));
+	else {  // dest = -right + left
+		x_insn1(a, XI_NEG, dest);
+		x_insn(a, XI_ADD, dest, R(n->binary.left));
+	}
+}
+/*
+ * IN_PUSH is kept as a push, IN_CALL pops the first six arguments into their registers.
+ * The pushes of a call may be nested in the arguments of another one, so whether its
+ * stack arguments leave rsp aligned depends on what the outer calls pushed, padding
+ * included. The padding goes before the first push of a call (or the call itself)
+ * and the call is marked too, to drop it again.
+ */
+static void plan_calls(const IUnit* unit, Frame* fr) {
+	const size_t count = inode_count(unit);
+	size_t* pending = NULL;
+	size_t* call_of = calloc(count, sizeof(size_t));        // first push of a call -> the call + 1
+	for (size_t i = 0; i < count; ++i) {
+		const INode* n = &unit->nodes[i];
+		if (n->type == IN_PUSH) buf_push(pending, i);
+		else if (n->type == IN_CALL) {
+			const size_t outer = buf_len(pending) - n->fcall.pcount;
+			call_of[n->fcall.pcount ? pending[outer] : i] = i + 1;
+			if (pending) buf__hdr(pending)->size = outer;
+		}
+	}
+	buf_free(pending);
+	fr->pad = calloc(count, sizeof(bool));
+	size_t depth = 0;                                       // words pushed
+	for (size_t i = 0; i < count; ++i) {
+		const INode* n = &unit->nodes[i];
+		if (call_of[i]) {
+			const size_t call = call_of[i] - 1;
+			const size_t params = unit->nodes[call].fcall.pcount;
+			const size_t stack = params > NUM_ARG_REGS ? params - NUM_ARG_REGS : 0;
+			if ((depth + stack) % 2) {
+				fr->pad[i] = fr->pad[call] = true;
+				++depth;
+			}
+		}
+		if (n->type == IN_PUSH) ++depth;
+		else if (n->type == IN_CALL) depth -= n->fcall.pcount + fr->pad[i];
+	}
+	free(call_of);
+}
+static int cmp_addr(const void* a, const void* b) {
+	const char* x = *(const char* const*)a;
+	const char* y = *(const char* const*)b;
+	return (x > y) - (x < y);
+}
+static bool is_extern(const Frame* fr, const char* name) {
+	return !bsearch(&name, fr->funcs, buf_len(fr->funcs), sizeof(name), cmp_addr);
+}
+// Whether the callee register of n would be overwritten while its arguments are loaded.
+static bool callee_clobbered(const INode* n) {
+	if (n->fcall.dest == 0) return true;
+	for (size_t i = 0; i < n->fcall.pcount && i < NUM_ARG_REGS; ++i) {
+		if (arg_regs[i] == n->fcall.dest) return true;
+	}
+	return false;
+}
+static void translate(XAsm* a, IUnit* unit, const Frame* fr, size_t i) {
+	INode* const n = &unit->nodes[i];
+	int32_t tmp;
+	size_t stack;
+	switch (n->type) {
+	case IN_LABEL:  x_label(a, n->label); break;
+	case IN_LDC:    x_insn(a, XI_MOV, R(n->ldc.dest), x_imm(n->ldc.num)); break;
+	case IN_LDA:
+		tmp = get_off(unit, fr, n->lda.name);
+		if (tmp != INT32_MAX) x_insn(a, XI_LEA, R(n->lda.dest), x_mem(X_RBP, X_NOREG, 1, tmp));
+		else if (is_extern(fr, n->lda.name)) x_insn(a, XI_MOV, R(n->lda.dest), x_got(n->lda.name));
+		else x_insn(a, XI_LEA, R(n->lda.dest), x_rel(n->lda.name, 0));
+		break;
+	case IN_MOVE:   x_insn(a, XI_MOV, R(n->move.dest), R(n->move.src)); break;
+	case IN_JMP:    x_jump(a, XC_ALWAYS, n->label); break;
+	case IN_JE:     x_jump(a, XC_E, n->label); break;
+	case IN_JNE:    x_jump(a, XC_NE, n->label); break;
+	case IN_JG:     x_jump(a, XC_G, n->label); break;
+	case IN_JL:     x_jump(a, XC_L, n->label); break;
+	case IN_RETURN:
+		if (n->reg != IREG_NONE && n->reg != 0) x_insn(a, XI_MOV, x_reg(X_RAX), R(n->reg));
+		x_jump(a, XC_ALWAYS, XL_RET);
+		break;
+	case IN_READ:
+		if (n->skind == IO_FRAME) x_insn(a, XI_MOV, R(n->move.dest), operand(unit, fr, n, n->skind, n->move.src, n->move.index));
+		else x_insn(a, XI_MOV, R(n->move.dest), x_mem(regs[n->move.src], X_NOREG, 1, 0));
+		break;
+	case IN_WRITE:
+		x_insn(a, XI_MOV, n->dkind == IO_FRAME ? operand(unit, fr, n, n->dkind, n->move.dest, n->move.index)
+			: x_mem(regs[n->move.dest], X_NOREG, 1, 0), operand(unit, fr, n, n->skind, n->move.src, IREG_NONE));
+		break;
+	case IN_PUSH:
+		if (fr->pad[i]) x_insn(a, XI_SUB, x_reg(X_RSP), x_imm(8));
+		x_insn1(a, XI_PUSH, operand(unit, fr, n, n->skind, n->reg, IREG_NONE));
+		break;
+	case IN_NOP:    x_insn1(a, XI_NOP, x_reg(X_RAX)); break;
+	case IN_CMP:
+		x_insn(a, XI_CMP, operand(unit, fr, n, n->dkind, n->move.dest, IREG_NONE),
+			operand(unit, fr, n, n->skind, n->move.src, IREG_NONE));
+		break;
+	case IN_CALL:   // only the callee is live in a caller-saved register here
+		tmp = n->fcall.dest;
+		if (callee_clobbered(n)) {
+			x_insn(a, XI_MOV, R(SCRATCH), R(tmp));
+			tmp = SCRATCH;
+		}
+		for (size_t j = 0; j < n->fcall.pcount && j < NUM_ARG_REGS; ++j)
+			x_insn1(a, XI_POP, R(arg_regs[j]));
+		if (fr->pad[i] && !n->fcall.pcount) x_insn(a, XI_SUB, x_reg(X_RSP), x_imm(8));
+		x_insn1(a, XI_ZERO, x_reg(X_RAX));     // al: no vector registers for varargs
+		x_insn1(a, XI_CALL, R(tmp));
+		stack = (n->fcall.pcount > NUM_ARG_REGS ? n->fcall.pcount - NUM_ARG_REGS : 0) + fr->pad[i];
+		if (stack) x_insn(a, XI_ADD, x_reg(X_RSP), x_imm(stack * 8));
+		if (n->fcall.ret != 0) x_insn(a, XI_MOV, R(n->fcall.ret), x_reg(X_RAX));
+		break;
+	case IN_NEG:
+		if (n->move.dest != n->move.src) x_insn(a, XI_MOV, R(n->move.dest), R(n->move.src));
+		x_insn1(a, XI_NEG, R(n->move.dest));
+		break;
+	case IN_ADJOFF:
+		if (n->move.dest == n->move.src) x_insn(a, XI_SHL, R(n->move.dest), x_imm(3));
+		else x_insn(a, XI_LEA, R(n->move.dest), x_mem(X_NOREG, regs[n->move.src], 8, 0));
+		break;
+	case IN_ADD:
+		if (n->dkind == IO_REG && n->skind != IO_FRAME && n->binary.dest != n->binary.left
+		&& (n->skind == IO_IMM || n->binary.dest != n->binary.right)) {
+			x_insn(a, XI_LEA, R(n->binary.dest), n->skind == IO_IMM
+				? x_mem(regs[n->binary.left], X_NOREG, 1, (int32_t)n->binary.right)
+				: x_mem(regs[n->binary.left], regs[n->binary.right], 1, 0));
+		}
+		else emit_binary(a, unit, fr, XI_ADD, true, n);
+		break;
+	case IN_SUB:    emit_binary(a, unit, fr, XI_SUB, false, n); break;
+	case IN_AND:    emit_binary(a, unit, fr, XI_AND, true, n); break;
+	case IN_OR:     emit_binary(a, unit, fr, XI_OR, true, n); break;
+	case IN_XOR:    emit_binary(a, unit, fr, XI_XOR, true, n); break;
+	case IN_LDS:    // the label of the literal in assembly, its offset in the pool in an object
+		tmp = a->out ? istr_pool_add(fr->strs, n->lda.name) : istr_pool_off(fr->strs, n->lda.name);
+		x_insn(a, XI_LEA, R(n->lda.dest), x_rel(NULL, tmp));
+		break;
+	case IN_SPILL:
+		x_insn(a, XI_MOV, x_mem(X_RBP, X_NOREG, 1, -(int32_t)get_slot_off(unit, fr, n->spill.slot)), R(n->spill.reg));
+		break;
+	case IN_RELOAD:
+		x_insn(a, XI_MOV, R(n->spill.reg), x_mem(X_RBP, X_NOREG, 1, -(int32_t)get_slot_off(unit, fr, n->spill.slot)));
+		break;
+
+	default: break;
+	}
+}
+// Returns the mask of the registers that unit writes or reads.
+static uint32_t used_regs(IUnit* unit) {
+	uint32_t mask = 0;
+	for (size_t i = 0; i < inode_count(unit); ++i) {
+		ireg_t uses[2];
+		const int num = inode_uses(&unit->nodes[i], uses);
+		for (int j = 0; j < num; ++j)
+			mask |= 1u << uses[j];
+		if (inode_def(&unit->nodes[i]) != IREG_NONE) mask |= 1u << inode_def(&unit->nodes[i]);
+	}
+	return mask;
+}
+
+static int x86_64_gen_f(IUnit * unit, const char** funcs, IStrPool* strs, XAsm* a, enum RegAlloc how) {
+	iunit_fold_operands(unit);
+	iunit_alloc_regs(unit, &get_target(TARGET_x86_64)->regs, how);
+	const uint32_t used = used_regs(unit);
+	const size_t params = buf_len(unit->paramnames);
+	Frame fr = { .funcs = funcs, .strs = strs };
+	ireg_t saved[NUM_REGS];
+	for (ireg_t r = FIRST_SAVED; r < NUM_REGS; ++r) {
+		if (used >> r & 1) saved[fr.saved++] = r;
+	}
+	fr.home = (fr.saved + params) * 8;
+	plan_calls(unit, &fr);
+
+	// rsp is 16-byte aligned after the pushes of rbp, the saved registers and the frame
+	size_t frame = (params + buf_len(unit->decls) + unit->num_slots) * 8;
+	if ((fr.saved * 8 + frame) % 16) frame += 8;
+	x_begin_func(a, unit->name);
+	x_insn1(a, XI_PUSH, x_reg(X_RBP));
+	x_insn(a, XI_MOV, x_reg(X_RBP), x_reg(X_RSP));
+	for (unsigned i = 0; i < fr.saved; ++i)
+		x_insn1(a, XI_PUSH, R(saved[i]));
+	if (frame) x_insn(a, XI_SUB, x_reg(X_RSP), x_imm(frame));
+	for (size_t i = 0; i < params; ++i) {
+		const XOperand home = x_mem(X_RBP, X_NOREG, 1, (int32_t)(i * 8) - (int32_t)fr.home);
+		if (i < NUM_ARG_REGS) x_insn(a, XI_MOV, home, R(arg_regs[i]));
+		else {
+			x_insn(a, XI_MOV, x_reg(X_RAX), x_mem(X_RBP, X_NOREG, 1, (i - NUM_ARG_REGS) * 8 + 16));
+			x_insn(a, XI_MOV, home, x_reg(X_RAX));
+		}
+	}
+	for (size_t i = 0; i < buf_len(unit->decls); ++i) {
+		if (!unit->decls[i].has_value) continue;
+		const XOperand decl = x_mem(X_RBP, X_NOREG, 1, -(int32_t)(fr.home + i * 8 + 8));
+		if (unit->decls[i].value == (int32_t)unit->decls[i].value)
+			x_insn(a, XI_MOV, decl, x_imm(unit->decls[i].value));
+		else {
+			x_insn(a, XI_MOV, x_reg(X_RAX), x_imm(unit->decls[i].value));
+			x_insn(a, XI_MOV, decl, x_reg(X_RAX));
+		}
+	}
+	if (a->out) ob_char(a->out, '\n');
+
+	for (size_t i = 0; i < inode_count(unit); ++i)
+		translate(a, unit, &fr, i);
+	x_label(a, XL_RET);
+	if (frame) x_insn(a, XI_LEA, x_reg(X_RSP), x_mem(X_RBP, X_NOREG, 1, -(int32_t)fr.saved * 8));
+	for (unsigned i = fr.saved; i; --i)
+		x_insn1(a, XI_POP, R(saved[i - 1]));
+	x_insn1(a, XI_POP, x_reg(X_RBP));
+	x_insn1(a, XI_RET, x_reg(X_RAX));
+	free(fr.pad);
+	if (x_end_func(a)) return 1;
+	if (a->out) ob_char(a->out, '\n');
+	return 0;
+}
+int x86_64_gen_unit(AsmStream* s, IUnit* unit) {
+	XAsm a = { .out = &s->ob };
+	const int err = x86_64_gen_f(unit, s->funcs, &s->strs, &a, s->how);
+	x_free(&a);
+	return err;
+}
+int x86_64_gen_obj(IProgram* prog, ElfObject* obj, enum RegAlloc how) {
+	obj->machine = EM_X86_64;
+	XAsm a = { .obj = obj };
+	IStrPool strs = { 0 };
+	istr_pool_build(&strs, prog);
+	istr_pool_layout(&strs);
+	const char** funcs = NULL;
+	for (size_t i = 0; i < buf_len(prog->units); ++i)
+		buf_push(funcs, prog->units[i]->name);
+	if (funcs) qsort(funcs, buf_len(funcs), sizeof(*funcs), cmp_addr);
+	for (size_t i = 0; i < buf_len(prog->externs); ++i)
+		x_extern(&a, prog->externs[i]);
+	int err = 0;
+	for (size_t i = 0; i < buf_len(prog->units) && !err; ++i)
+		err = x86_64_gen_f(prog->units[i], funcs, &strs, &a, how);
+	for (size_t i = 0; i < buf_len(strs.data); ++i)
+		buf_push(obj->rodata, strs.data[i]);
+	buf_free(funcs);
+	istr_pool_free(&strs);
+	x_free(&a);
+	return err;
+}